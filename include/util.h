@@ -337,10 +337,12 @@ int mkdir_recursive(char *path);
 /**
  * @brief Count the number of "1" bits in an n-byte buffer
  *
+ * Uses AVX2 or popcnt where the CPU has them.
+ *
  * @param buf The buffer to test
  * @param len The length in bytes of buf
  *
- * @returns The number of set bits in x (0 <= n <= 32)
+ * @returns The number of set bits in buf
  */
 uint32_t hamming_weight(uint8_t *buf, int len);
 
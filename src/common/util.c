@@ -45,16 +45,28 @@
 #include "util.h"
 
 
-/* Mask values used by "hamming_weight" */
+/* Mask values used by the portable "hamming_weight" */
+#define MASK64_1S   ((uint64_t)0x5555555555555555) /* binary: 0101... */
+#define MASK64_2S   ((uint64_t)0x3333333333333333) /* binary: 00110011.. */
+#define MASK64_4S   ((uint64_t)0x0f0f0f0f0f0f0f0f) /* binary: 4 zeros, 4 ones */
+#define MASK64_8S   ((uint64_t)0x0101010101010101) /* binary: 7 zeros, 1 one */
+
 #define MASK8_1S    ((uint8_t)0x55) /* binary: 0101... */
 #define MASK8_2S    ((uint8_t)0x33) /* binary: 00110011.. */
 #define MASK8_4S    ((uint8_t)0x0f) /* binary:  4 zeros,  4 ones ... */
 
-#define MASK32_1S   ((uint32_t)0x55555555) /* binary: 0101... */
-#define MASK32_2S   ((uint32_t)0x33333333) /* binary: 00110011.. */
-#define MASK32_4S   ((uint32_t)0x0f0f0f0f) /* binary:  4 zeros,  4 ones ... */
-#define MASK32_8S   ((uint32_t)0x00ff00ff) /* binary:  8 zeros,  8 ones ... */
-#define MASK32_16S  ((uint32_t)0x0000ffff) /* binary:  16 zeros, 16 ones ... */
+/**
+ * x86-64 "hamming_weight" backends, picked at run time. Below
+ * HAMMING_WEIGHT_AVX2_MIN bytes, a few popcnt instructions beat the AVX2
+ * setup and horizontal sum.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAMMING_WEIGHT_X86
+#include <immintrin.h>
+#define HAMMING_WEIGHT_AVX2_MIN     128
+#define HAMMING_WEIGHT_CPU_POPCNT   1
+#define HAMMING_WEIGHT_CPU_AVX2     2
+#endif
 
 
 /**
@@ -665,44 +677,38 @@ int mkdir_recursive(char *path)
 
 
 /**
- * @brief Count the number of "1" bits in an n-byte buffer
+ * @brief Count the number of "1" bits in a buffer, 64 bits at a time
  *
  * @param buf The buffer to test
  * @param len The length in bytes of buf
  *
- * @returns The number of set bits in x (0 <= n <= 32)
+ * @returns The number of set bits in buf
  */
-uint32_t hamming_weight(uint8_t *buf, int len) {
+static uint32_t hamming_weight_swar(const uint8_t *buf, int len) {
     uint8_t     x;
-    uint32_t    x32;
-    uint32_t *  buf32 = (uint32_t *) buf;
+    uint64_t    x64;
     uint32_t    count = 0;
 
-    /* Process in 4-byte chunks as far as possible */
-    while (len >= 4) {
-        x32 = *buf32++;
+    /* Process in 8-byte chunks as far as possible */
+    while (len >= 8) {
+        memcpy(&x64, buf, sizeof(x64));
 
         /* put count of each 2 bits into those 2 bits */
-        x32 = (x32 & MASK32_1S) + ((x32 >> 1) & MASK32_1S);
+        x64 -= (x64 >> 1) & MASK64_1S;
 
         /* put count of each 4 bits into those 4 bits */
-        x32 = (x32 & MASK32_2S) + ((x32 >> 2) & MASK32_2S);
+        x64 = (x64 & MASK64_2S) + ((x64 >> 2) & MASK64_2S);
 
         /* put count of each 8 bits into those 8 bits */
-        x32 = (x32 & MASK32_4S) + ((x32 >> 4) & MASK32_4S);
-
-        /* put count of each 16 bits into those 16 bits */
-        x32 = (x32 & MASK32_8S) + ((x32 >> 8) & MASK32_8S);
-
-        /* put count of each 16 bits into those 16 bits */
-        x32 = (x32 + (x32 >> 16)) & MASK32_16S;
+        x64 = (x64 + (x64 >> 4)) & MASK64_4S;
 
-        count += x32;
-        len -= 4;
+        /* sum the 8 byte counts into the top byte */
+        count += (uint32_t)((x64 * MASK64_8S) >> 56);
+        buf += 8;
+        len -= 8;
     }
 
     /* Process any remaining bytes one at a time */
-    buf = (uint8_t *)buf32;
     while (len > 0) {
         x = *buf++;
 
@@ -722,6 +728,118 @@ uint32_t hamming_weight(uint8_t *buf, int len) {
     return count;
 }
 
+#ifdef HAMMING_WEIGHT_X86
+/**
+ * @brief Count the number of "1" bits in a buffer with popcnt
+ *
+ * @param buf The buffer to test
+ * @param len The length in bytes of buf
+ *
+ * @returns The number of set bits in buf
+ */
+__attribute__((target("popcnt")))
+static uint32_t hamming_weight_popcnt(const uint8_t *buf, int len) {
+    uint64_t    x64;
+    uint32_t    count = 0;
+
+    while (len >= 8) {
+        memcpy(&x64, buf, sizeof(x64));
+        count += __builtin_popcountll(x64);
+        buf += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        count += __builtin_popcount(*buf++);
+        len--;
+    }
+
+    return count;
+}
+
+
+/**
+ * @brief Count the number of "1" bits in a buffer with AVX2
+ *
+ * Looks up the count of each nibble of 32 bytes at a time with a byte
+ * shuffle, and sums the byte counts into 64-bit lanes.
+ *
+ * @param buf The buffer to test
+ * @param len The length in bytes of buf
+ *
+ * @returns The number of set bits in buf
+ */
+__attribute__((target("avx2,popcnt")))
+static uint32_t hamming_weight_avx2(const uint8_t *buf, int len) {
+    const __m256i nibble_counts = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i     sums = _mm256_setzero_si256();
+    __m256i     x;
+    __m256i     counts;
+    uint64_t    lanes[4];
+
+    while (len >= 32) {
+        x = _mm256_loadu_si256((const __m256i *)buf);
+        counts = _mm256_add_epi8(
+                _mm256_shuffle_epi8(nibble_counts,
+                                    _mm256_and_si256(x, low_nibbles)),
+                _mm256_shuffle_epi8(nibble_counts,
+                                    _mm256_and_si256(_mm256_srli_epi16(x, 4),
+                                                     low_nibbles)));
+        sums = _mm256_add_epi64(sums,
+                                _mm256_sad_epu8(counts,
+                                                _mm256_setzero_si256()));
+        buf += 32;
+        len -= 32;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, sums);
+
+    return (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+           hamming_weight_popcnt(buf, len);
+}
+#endif
+
+
+/**
+ * @brief Count the number of "1" bits in an n-byte buffer
+ *
+ * Uses AVX2 or popcnt where the CPU has them.
+ *
+ * @param buf The buffer to test
+ * @param len The length in bytes of buf
+ *
+ * @returns The number of set bits in buf
+ */
+uint32_t hamming_weight(uint8_t *buf, int len) {
+#ifdef HAMMING_WEIGHT_X86
+    /* -1 until the first call checks the CPU (any thread may be first) */
+    static int cpu_features = -1;
+    int features = __atomic_load_n(&cpu_features, __ATOMIC_RELAXED);
+
+    if (features < 0) {
+        __builtin_cpu_init();
+        features = 0;
+        if (__builtin_cpu_supports("popcnt")) {
+            features |= HAMMING_WEIGHT_CPU_POPCNT;
+            if (__builtin_cpu_supports("avx2")) {
+                features |= HAMMING_WEIGHT_CPU_AVX2;
+            }
+        }
+        __atomic_store_n(&cpu_features, features, __ATOMIC_RELAXED);
+    }
+    if ((features & HAMMING_WEIGHT_CPU_AVX2) &&
+        (len >= HAMMING_WEIGHT_AVX2_MIN)) {
+        return hamming_weight_avx2(buf, len);
+    }
+    if (features & HAMMING_WEIGHT_CPU_POPCNT) {
+        return hamming_weight_popcnt(buf, len);
+    }
+#endif
+    return hamming_weight_swar(buf, len);
+}
+
+
 /**
  * @brief Bit-balance MID/PID, VID/PID
  *
@@ -37,10 +37,12 @@ MCL_FFLEN:=8
 DREC1=C448
 DREC2=C25519
 
-DRRSA1=RSA2048
-# We only use RSA2048. DRRSA2 and DRRSA3 are defined to pass compiling
-# DRRSA2 would still be compiled into the libmclcurve$(DREC2).a but will
-# not be in the final image since no one is going to call it.
-DRRSA2=RSANA
+# We only use RSA2048. It goes into libmclcurve$(DREC2).a, whose 256-bit
+# BIGs make MCL_FFLEN * 256 = 2048 bits and whose FF layout is the one
+# imsgen builds the ERRK keys in. DRRSA1 and DRRSA3 are defined to pass
+# compiling; DRRSA1 would still be compiled into libmclcurve$(DREC1).a but
+# will not be in the final image since no one is going to call it.
+DRRSA1=RSANA
+DRRSA2=RSA2048
 DRRSA3=RSA3072
 
@@ -37,8 +37,9 @@
  * (Yes it's uncommon to include a C file, but this is how MIRACL provided
  * a wrapper). The SHA256 wrappers provided/used are:
  *      MCL_HASH256_init (Initialize the SHA hash)
- *      MCL_HASH256_process (Add data to the SHA hash)
+ *      MCL_HASH256_update (Add data to the SHA hash)
  *      MCL_HASH256_hash (Finalize the SHA hash and return the digest)
+ *      MCL_HASH256_batch (Hash several equal-length messages at once)
  */
 #include "../vendors/MIRACL/bootrom.c"
 #undef unsign32     /* (benign unconditional define in bootrom.c) */
@@ -46,7 +47,11 @@
 #include "mcl_hash.h"
 
 
-static mcl_hash256 shctx;
+/*
+ * Per-thread so that the IMS generator's worker threads can hash
+ * concurrently.
+ */
+static __thread mcl_hash256 shctx;
 
 
 /**
@@ -64,11 +69,7 @@ void hash_start(void) {
  * @param datalen The length in bytes of the data run.
  */
 void hash_update(const uint8_t *data, const size_t datalen) {
-    size_t i;
-
-    for (i = 0; i < datalen; i++) {
-        MCL_HASH256_process(&shctx, data[i]);
-    }
+    MCL_HASH256_update(&shctx, (const char *)data, (int)datalen);
 }
 
 
@@ -97,3 +98,23 @@ void hash_it(const uint8_t *data, const size_t datalen, uint8_t * digest) {
     hash_update(data, datalen);
     hash_final(digest);
 }
+
+
+/**
+ * @brief Perform SHA hashes of several equal-length blobs
+ *
+ * The blobs are independent, so they are hashed together on the CPU's
+ * multi-buffer SHA backend if it has one.
+ *
+ * @param count The number of blobs
+ * @param data Pointers to the blobs to hash
+ * @param datalen The length in bytes of each blob
+ * @param digest Pointers to the output digest buffers
+ */
+void hash_it_batch(int count,
+                   const uint8_t * const * data,
+                   const size_t datalen,
+                   uint8_t * const * digest) {
+    MCL_HASH256_batch(count, (const char * const *)data, (int)datalen,
+                      (char * const *)digest);
+}
@@ -74,4 +74,21 @@ void hash_final(uint8_t * digest);
  */
 void hash_it(const uint8_t *data, const size_t datalen, uint8_t * digest);
 
+
+/**
+ * @brief Perform SHA hashes of several equal-length blobs
+ *
+ * The blobs are independent, so they are hashed together on the CPU's
+ * multi-buffer SHA backend if it has one.
+ *
+ * @param count The number of blobs
+ * @param data Pointers to the blobs to hash
+ * @param datalen The length in bytes of each blob
+ * @param digest Pointers to the output digest buffers
+ */
+void hash_it_batch(int count,
+                   const uint8_t * const * data,
+                   const size_t datalen,
+                   uint8_t * const * digest);
+
 #endif /* !_CRYPTO_H */
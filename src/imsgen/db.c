@@ -32,6 +32,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include "mcl_arch.h"
 #include "mcl_oct.h"
@@ -48,6 +50,248 @@ static const char * insert_stmt =
 static const char * select_format_stmt =
     "SELECT ep_uid, epvk, esvk, erpk_mod FROM pub_keys WHERE ep_uid = '%s'";
 
+static const char * create_checkpoint_stmt =
+    "CREATE TABLE IF NOT EXISTS imsgen_checkpoint("
+    "id INTEGER PRIMARY KEY CHECK (id = 0), seed_fingerprint BLOB, "
+    "format INTEGER, first_index INTEGER, num_ims INTEGER, "
+    "next_index INTEGER, ims_count INTEGER, ims_offset INTEGER)";
+static const char * put_checkpoint_stmt =
+    "INSERT OR REPLACE INTO imsgen_checkpoint(id, seed_fingerprint, format, "
+    "first_index, num_ims, next_index, ims_count, ims_offset) "
+    "VALUES (0, ?, ?, ?, ?, ?, ?, ?)";
+static const char * get_checkpoint_stmt =
+    "SELECT seed_fingerprint, format, first_index, num_ims, next_index, "
+    "ims_count, ims_offset FROM imsgen_checkpoint WHERE id = 0";
+
+/* The INSERT statement, prepared once by db_init */
+static sqlite3_stmt * insert_keyset;
+
+/* The checkpoint statement, prepared by db_set_commit_hook */
+static sqlite3_stmt * put_checkpoint;
+
+/* Called before each commit (see db_set_commit_hook) */
+static db_commit_hook commit_hook;
+static void *         commit_hook_context;
+
+/**
+ * Batched writes: keysets are added inside a transaction which is committed
+ * after every batch_size keysets (1 means every keyset is committed on its
+ * own, without an explicit transaction).
+ */
+static uint32_t batch_size = 1;
+static uint32_t batch_count;
+static bool     in_transaction;
+
+/**
+ * In-memory index of the EP_UIDs in the database, loaded by db_load_ep_uids.
+ * EP_UIDs are hash outputs, so their 8 bytes are used directly as the key
+ * in an open-addressed (linear probing) table. A key of zero marks an empty
+ * slot; the (unlikely) all-zero EP_UID is tracked separately.
+ * IMS generation workers look EP_UIDs up while the sink adds keysets, so
+ * the index is guarded by a reader/writer lock once loaded.
+ */
+#define DB_EP_UID_SIZE              8   /* EP_UID_SIZE in ims_common.h */
+#define EP_UID_INDEX_MIN_CAPACITY   (1 << 16)
+static uint64_t * ep_uid_index;
+static uint32_t   ep_uid_index_mask;
+static uint32_t   ep_uid_index_count;
+static bool       ep_uid_index_has_zero;
+static pthread_rwlock_t ep_uid_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* An independent read-only connection (see db_reader_open) */
+struct db_reader {
+    sqlite3 * handle;
+};
+
+
+/**
+ * @brief Run a single SQL statement which returns no rows
+ *
+ * @param sql The statement to run
+ *
+ * @returns Zero if successful, SQLite status otherwise.
+ */
+static int db_exec(const char * sql) {
+    int status;
+    char * errmsg = NULL;
+
+    status = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    if (status != SQLITE_OK) {
+        fprintf(stderr, "'%s' failed: %s\n", sql, errmsg? errmsg : "?");
+        sqlite3_free(errmsg);
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Convert an EP_UID into its hash index key
+ *
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ *
+ * @returns The 64-bit key
+ */
+static uint64_t ep_uid_key(const uint8_t * ep_uid) {
+    uint64_t key;
+
+    memcpy(&key, ep_uid, sizeof(key));
+    return key;
+}
+
+
+/**
+ * @brief Find the slot for a key in the EP_UID index
+ *
+ * @param table The table to search
+ * @param mask The table size - 1
+ * @param key The (non-zero) key to look for
+ *
+ * @returns The index of the slot holding the key, or of the empty slot
+ *          where it would go.
+ */
+static uint32_t ep_uid_index_slot(const uint64_t * table, uint32_t mask,
+                                  uint64_t key) {
+    uint32_t slot = (uint32_t)(key ^ (key >> 32)) & mask;
+
+    while ((table[slot] != 0) && (table[slot] != key)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+/**
+ * @brief Resize the EP_UID index
+ *
+ * @param capacity The new number of slots (a power of 2)
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+static int ep_uid_index_resize(uint32_t capacity) {
+    uint64_t * table;
+    uint32_t i;
+
+    table = calloc(capacity, sizeof(*table));
+    if (!table) {
+        fprintf(stderr, "ERROR: Can't allocate EP_UID index\n");
+        return ENOMEM;
+    }
+    if (ep_uid_index) {
+        for (i = 0; i <= ep_uid_index_mask; i++) {
+            if (ep_uid_index[i] != 0) {
+                table[ep_uid_index_slot(table, capacity - 1,
+                                        ep_uid_index[i])] = ep_uid_index[i];
+            }
+        }
+        free(ep_uid_index);
+    }
+    ep_uid_index = table;
+    ep_uid_index_mask = capacity - 1;
+
+    return 0;
+}
+
+
+/**
+ * @brief Add an EP_UID to the in-memory index
+ *
+ * The table is kept at most half full.
+ *
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+static int ep_uid_index_add(const uint8_t * ep_uid) {
+    int status = 0;
+    uint64_t key = ep_uid_key(ep_uid);
+    uint32_t slot;
+
+    if (key == 0) {
+        ep_uid_index_has_zero = true;
+    } else {
+        if (2 * (ep_uid_index_count + 1) > ep_uid_index_mask + 1) {
+            status = ep_uid_index_resize(2 * (ep_uid_index_mask + 1));
+        }
+        if (status == 0) {
+            slot = ep_uid_index_slot(ep_uid_index, ep_uid_index_mask, key);
+            if (ep_uid_index[slot] == 0) {
+                ep_uid_index[slot] = key;
+                ep_uid_index_count++;
+            }
+        }
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Look up an EP_UID in the in-memory index
+ *
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ *
+ * @returns True if the EP_UID is in the index, false if it isn't.
+ */
+static bool ep_uid_index_contains(const uint8_t * ep_uid) {
+    uint64_t key = ep_uid_key(ep_uid);
+
+    if (key == 0) {
+        return ep_uid_index_has_zero;
+    }
+    return ep_uid_index[ep_uid_index_slot(ep_uid_index, ep_uid_index_mask,
+                                          key)] == key;
+}
+
+
+/**
+ * @brief Discard the in-memory EP_UID index
+ */
+static void ep_uid_index_free(void) {
+    free(ep_uid_index);
+    ep_uid_index = NULL;
+    ep_uid_index_mask = 0;
+    ep_uid_index_count = 0;
+    ep_uid_index_has_zero = false;
+}
+
+
+/**
+ * @brief Convert a hex EP_UID from the database back into binary
+ *
+ * @param hex The EP_UID as stored in the database
+ * @param ep_uid Where to store the 8-byte EP_UID
+ *
+ * @returns True if hex was a valid EP_UID, false otherwise.
+ */
+static bool ep_uid_from_hex(const unsigned char * hex, uint8_t * ep_uid) {
+    int i;
+    int nibble;
+    unsigned char c;
+
+    if (!hex) {
+        return false;
+    }
+    for (i = 0; i < 2 * DB_EP_UID_SIZE; i++) {
+        c = hex[i];
+        if ((c >= '0') && (c <= '9')) {
+            nibble = c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            nibble = c - 'a' + 10;
+        } else if ((c >= 'A') && (c <= 'F')) {
+            nibble = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        if ((i & 1) == 0) {
+            ep_uid[i / 2] = nibble << 4;
+        } else {
+            ep_uid[i / 2] |= nibble;
+        }
+    }
+    return hex[i] == '\0';
+}
+
 
 /**
  * @brief Initialize the key database subsystem
@@ -65,7 +309,316 @@ int db_init(const char * db_name) {
         sqlite3_close(db);
         db = NULL;
         status = ENOENT;
+    } else {
+        status = sqlite3_prepare_v2(db, insert_stmt, -1, &insert_keyset, NULL);
+        if (status != SQLITE_OK) {
+            fprintf(stderr, "db_init: prepare failed: %s\n",
+                    sqlite3_errmsg(db));
+            db_deinit();
+            status = EIO;
+        }
+    }
+    batch_size = 1;
+    batch_count = 0;
+    in_transaction = false;
+
+    return status;
+}
+
+
+/**
+ * @brief Call a function for every EP_UID in an open database
+ *
+ * @param handle The database to scan
+ * @param callback The function to call with each EP_UID
+ * @param context Passed through to callback
+ *
+ * @returns Zero if successful, the first non-zero callback status, or errno.
+ */
+static int db_scan(sqlite3 * handle,
+                   db_ep_uid_callback callback,
+                   void * context) {
+    int status = 0;
+    int step;
+    uint8_t ep_uid[DB_EP_UID_SIZE];
+    sqlite3_stmt *stmt;
+
+    status = sqlite3_prepare_v2(handle, "SELECT ep_uid FROM pub_keys", -1,
+                                &stmt, NULL);
+    if (status != SQLITE_OK) {
+        fprintf(stderr, "db_scan: prepare failed: %s\n",
+                sqlite3_errmsg(handle));
+        return EIO;
+    }
+
+    while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (!ep_uid_from_hex(sqlite3_column_text(stmt, 0), ep_uid)) {
+            fprintf(stderr, "db_scan: bad ep_uid '%s'\n",
+                    sqlite3_column_text(stmt, 0));
+            status = EINVAL;
+            break;
+        }
+        status = callback(ep_uid, context);
+        if (status != 0) {
+            break;
+        }
+    }
+    if ((status == 0) && (step != SQLITE_DONE)) {
+        fprintf(stderr, "db_scan: query failed: %s\n",
+                sqlite3_errmsg(handle));
+        status = EIO;
+    }
+    sqlite3_finalize(stmt);
+
+    return status;
+}
+
+
+/**
+ * @brief db_scan callback to add an EP_UID to the in-memory index
+ */
+static int ep_uid_index_add_callback(const uint8_t * ep_uid, void * context) {
+    (void)context;
+    return ep_uid_index_add(ep_uid);
+}
+
+
+/**
+ * @brief Load every EP_UID in the key database into memory
+ *
+ * Once loaded, db_ep_uid_exists is answered from memory and db_add_keyset
+ * keeps the in-memory set up to date, so the database is only written to.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_load_ep_uids(void) {
+    int status = 0;
+
+    ep_uid_index_free();
+    status = ep_uid_index_resize(EP_UID_INDEX_MIN_CAPACITY);
+    if (status == 0) {
+        status = db_scan(db, ep_uid_index_add_callback, NULL);
+    }
+    if (status != 0) {
+        ep_uid_index_free();
+    }
+    return status;
+}
+
+
+/**
+ * @brief Call a function for every EP_UID in a (historical) key database
+ *
+ * The database is opened read-only and independently of the one opened by
+ * db_init.
+ *
+ * @param database_name The name of the key database to scan
+ * @param callback The function to call with each 8-byte EP_UID
+ * @param context Passed through to callback
+ *
+ * @returns Zero if successful, the first non-zero callback status, or errno.
+ */
+int db_scan_ep_uids(const char * database_name,
+                    db_ep_uid_callback callback,
+                    void * context) {
+    int status = 0;
+    sqlite3 * handle;
+
+    status = sqlite3_open_v2(database_name, &handle, SQLITE_OPEN_READONLY,
+                             NULL);
+    if (status != SQLITE_OK) {
+        fprintf(stderr, "Can't open database '%s': %s\n", database_name,
+                sqlite3_errmsg(handle));
+        status = ENOENT;
+    } else {
+        status = db_scan(handle, callback, context);
     }
+    sqlite3_close(handle);
+
+    return status;
+}
+
+
+/**
+ * @brief Set how the key database is written
+ *
+ * @param keysets_per_transaction The number of keysets to add before each
+ *        commit. Larger batches make adding keysets much cheaper, at the cost
+ *        of losing up to that many keysets if the program dies.
+ * @param wal If true, use write-ahead logging with synchronous=NORMAL
+ *        rather than SQLite's default rollback journal with full syncs.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_set_write_mode(uint32_t keysets_per_transaction, bool wal) {
+    int status = 0;
+
+    /* Commit anything written under the old batching */
+    status = db_commit();
+    if ((status == 0) && wal) {
+        if ((db_exec("PRAGMA journal_mode=WAL") != SQLITE_OK) ||
+            (db_exec("PRAGMA synchronous=NORMAL") != SQLITE_OK)) {
+            status = EIO;
+        }
+    }
+    if (status == 0) {
+        batch_size = (keysets_per_transaction > 0)? keysets_per_transaction : 1;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Commit any keysets added since the last commit
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_commit(void) {
+    int status = 0;
+
+    if (db && in_transaction) {
+        /* Let the caller record its state in the same transaction */
+        if (commit_hook) {
+            status = commit_hook(commit_hook_context);
+        }
+        if (status != 0) {
+            fprintf(stderr, "db_commit: checkpoint failed, rolling back\n");
+            db_exec("ROLLBACK");
+        } else if (db_exec("COMMIT") != SQLITE_OK) {
+            status = EIO;
+        }
+        in_transaction = false;
+        batch_count = 0;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Call a function inside each keyset transaction, just before it
+ * commits
+ *
+ * Lets the caller make its own state durable and record it (with
+ * db_put_checkpoint) atomically with the keysets. Once a hook is set,
+ * keysets are always added inside a transaction, even with a batch size
+ * of 1. If the hook fails, the transaction is rolled back.
+ *
+ * @param hook The function to call (NULL to remove the hook)
+ * @param context Passed through to hook
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_set_commit_hook(db_commit_hook hook, void * context) {
+    int status = 0;
+
+    /* Commit anything written without the hook */
+    status = db_commit();
+    if ((status == 0) && hook && !put_checkpoint) {
+        if (db_exec(create_checkpoint_stmt) != SQLITE_OK) {
+            status = EIO;
+        } else if (sqlite3_prepare_v2(db, put_checkpoint_stmt, -1,
+                                      &put_checkpoint, NULL) != SQLITE_OK) {
+            fprintf(stderr, "db_set_commit_hook: prepare failed: %s\n",
+                    sqlite3_errmsg(db));
+            status = EIO;
+        }
+    }
+    if (status == 0) {
+        commit_hook = hook;
+        commit_hook_context = context;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Record the imsgen checkpoint in the current transaction
+ *
+ * Replaces any previous checkpoint. Only valid from a commit hook (see
+ * db_set_commit_hook).
+ *
+ * @param checkpoint The checkpoint to record
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_put_checkpoint(const db_checkpoint * checkpoint) {
+    int status = 0;
+    sqlite3_stmt *stmt = put_checkpoint;
+
+    if (!stmt || !in_transaction) {
+        fprintf(stderr, "db_put_checkpoint: no transaction\n");
+        return EBADF;
+    }
+
+    if ((sqlite3_bind_blob(stmt, 1, checkpoint->seed_fingerprint,
+                           DB_FINGERPRINT_SIZE, SQLITE_STATIC) != SQLITE_OK) ||
+        (sqlite3_bind_int64(stmt, 2, checkpoint->format) != SQLITE_OK) ||
+        (sqlite3_bind_int64(stmt, 3, checkpoint->first_index) != SQLITE_OK) ||
+        (sqlite3_bind_int64(stmt, 4, checkpoint->num_ims) != SQLITE_OK) ||
+        (sqlite3_bind_int64(stmt, 5, checkpoint->next_index) != SQLITE_OK) ||
+        (sqlite3_bind_int64(stmt, 6, checkpoint->ims_count) != SQLITE_OK) ||
+        (sqlite3_bind_int64(stmt, 7, checkpoint->ims_offset) != SQLITE_OK)) {
+        fprintf(stderr, "db_put_checkpoint: bind failed: %s\n",
+                sqlite3_errmsg(db));
+        status = EIO;
+    } else if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "db_put_checkpoint: can't save checkpoint: %s\n",
+                sqlite3_errmsg(db));
+        status = EIO;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return status;
+}
+
+
+/**
+ * @brief Fetch the last committed imsgen checkpoint
+ *
+ * @param checkpoint Where to store the checkpoint
+ *
+ * @returns Zero if successful, ENOENT if there is no checkpoint, errno
+ *          otherwise.
+ */
+int db_get_checkpoint(db_checkpoint * checkpoint) {
+    int status = 0;
+    int step;
+    sqlite3_stmt *stmt;
+
+    if (db_exec(create_checkpoint_stmt) != SQLITE_OK) {
+        return EIO;
+    }
+    status = sqlite3_prepare_v2(db, get_checkpoint_stmt, -1, &stmt, NULL);
+    if (status != SQLITE_OK) {
+        fprintf(stderr, "db_get_checkpoint: prepare failed: %s\n",
+                sqlite3_errmsg(db));
+        return EIO;
+    }
+
+    step = sqlite3_step(stmt);
+    if (step == SQLITE_DONE) {
+        status = ENOENT;
+    } else if ((step != SQLITE_ROW) ||
+               (sqlite3_column_bytes(stmt, 0) != DB_FINGERPRINT_SIZE)) {
+        fprintf(stderr, "db_get_checkpoint: bad checkpoint: %s\n",
+                sqlite3_errmsg(db));
+        status = EIO;
+    } else {
+        memcpy(checkpoint->seed_fingerprint, sqlite3_column_blob(stmt, 0),
+               DB_FINGERPRINT_SIZE);
+        checkpoint->format = sqlite3_column_int64(stmt, 1);
+        checkpoint->first_index = sqlite3_column_int64(stmt, 2);
+        checkpoint->num_ims = sqlite3_column_int64(stmt, 3);
+        checkpoint->next_index = sqlite3_column_int64(stmt, 4);
+        checkpoint->ims_count = sqlite3_column_int64(stmt, 5);
+        checkpoint->ims_offset = sqlite3_column_int64(stmt, 6);
+        status = 0;
+    }
+    sqlite3_finalize(stmt);
 
     return status;
 }
@@ -74,13 +627,21 @@ int db_init(const char * db_name) {
 /**
  * @brief De-initialize the key database subsystem
  *
- * Flushes the IMS output file, closes the database
+ * Commits any outstanding keysets, closes the database
  */
 void db_deinit(void) {
     if (db) {
+        db_commit();
+        commit_hook = NULL;
+        commit_hook_context = NULL;
+        sqlite3_finalize(put_checkpoint);
+        put_checkpoint = NULL;
+        sqlite3_finalize(insert_keyset);
+        insert_keyset = NULL;
         sqlite3_close(db);
         db = NULL;
     }
+    ep_uid_index_free();
 }
 
 
@@ -100,7 +661,7 @@ int db_add_keyset(mcl_octet * ep_uid,
                   mcl_octet * erpk_mod) {
     int status = 0;
     char ep_uid_hex[32];
-    sqlite3_stmt *stmt;
+    sqlite3_stmt *stmt = insert_keyset;
 
 #ifdef DB_DEBUGMSG
     printf("db_add_keyset:\n");
@@ -109,10 +670,16 @@ int db_add_keyset(mcl_octet * ep_uid,
     display_binary_data(esvk->val, esvk->len, true, "esvk     ");
     display_binary_data(erpk_mod->val, erpk_mod->len, true, "erpk_mod ");
 #endif
-    status = sqlite3_prepare_v2(db, insert_stmt, -1, &stmt, NULL);
+    /* Open a transaction for the batch (or checkpoint) if need be */
+    if (((batch_size > 1) || commit_hook) && !in_transaction) {
+        status = db_exec("BEGIN");
+        in_transaction = (status == SQLITE_OK);
+    }
     if (status != SQLITE_OK) {
-        fprintf(stderr, "db_add_keyset: prepare failed: %s\n",
-                sqlite3_errmsg(db));
+        status = EIO;
+    } else if (!stmt) {
+        fprintf(stderr, "db_add_keyset: database not open\n");
+        status = EBADF;
     } else {
         /* Bind the values to the statement */
         MCL_OCT_toHex(ep_uid, ep_uid_hex);
@@ -146,13 +713,32 @@ int db_add_keyset(mcl_octet * ep_uid,
 
 
         /* Push the row out to the db */
-        status = sqlite3_step(stmt);
-        if (status != SQLITE_DONE) {
-            fprintf(stderr, "db_add_keyset: can't add row: %s\n",
-                    sqlite3_errmsg(db));
+        if (status == SQLITE_OK) {
+            status = sqlite3_step(stmt);
+            if (status != SQLITE_DONE) {
+                fprintf(stderr, "db_add_keyset: can't add row: %s\n",
+                        sqlite3_errmsg(db));
+            } else {
+                status = SQLITE_OK;
+            }
         }
 
-        status = sqlite3_finalize(stmt);
+        /* Keep the in-memory EP_UID set in step with the db */
+        if ((status == SQLITE_OK) && ep_uid_index) {
+            pthread_rwlock_wrlock(&ep_uid_index_lock);
+            status = ep_uid_index_add((uint8_t *)ep_uid->val);
+            pthread_rwlock_unlock(&ep_uid_index_lock);
+        }
+
+        /* Ready the statement for the next keyset */
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+
+        /* Commit at the end of each batch */
+        if ((status == SQLITE_OK) && in_transaction &&
+            (++batch_count >= batch_size)) {
+            status = db_commit();
+        }
     }
 
     return status;
@@ -192,8 +778,9 @@ static int db_get_blob(sqlite3_stmt *stmt,
 
 
 /**
- * @brief Fetch the set of keys associated with an EP_UID
+ * @brief Fetch the set of keys associated with an EP_UID from a database
  *
+ * @param handle The database to search
  * @param ep_uid The EndPoint Unique ID, to look up
  * @param epsk (Optional) the EPSK to retrieve
  * @param essk (Optional) the ESSK to retrieve
@@ -201,10 +788,11 @@ static int db_get_blob(sqlite3_stmt *stmt,
  *
  * @returns Zero if successful, errno otherwise.
  */
-int db_get_keyset(mcl_octet * ep_uid,
-                  mcl_octet * epvk,
-                  mcl_octet * esvk,
-                  mcl_octet * erpk_mod) {
+static int db_select_keyset(sqlite3 * handle,
+                            mcl_octet * ep_uid,
+                            mcl_octet * epvk,
+                            mcl_octet * esvk,
+                            mcl_octet * erpk_mod) {
     int status = 0;
     int step = 0;
     char ep_uid_hex[32];
@@ -214,9 +802,9 @@ int db_get_keyset(mcl_octet * ep_uid,
     /* Convert the EP_UID to a hex string to use as the key */
     MCL_OCT_toHex(ep_uid, ep_uid_hex);
     snprintf(query, sizeof(query), select_format_stmt, ep_uid_hex);
-    status = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+    status = sqlite3_prepare_v2(handle, query, -1, &stmt, NULL);
     if (status != SQLITE_OK) {
-        fprintf(stderr, "db_get_keyset: prepare failed: %s\n", sqlite3_errmsg(db));
+        fprintf(stderr, "db_get_keyset: prepare failed: %s\n", sqlite3_errmsg(handle));
     } else {
         /* Search the result for the ep_uid */
         step = sqlite3_step(stmt);
@@ -259,20 +847,112 @@ int db_get_keyset(mcl_octet * ep_uid,
 }
 
 
+/**
+ * @brief Fetch the set of keys associated with an EP_UID
+ *
+ * @param ep_uid The EndPoint Unique ID, to look up
+ * @param epsk (Optional) the EPSK to retrieve
+ * @param essk (Optional) the ESSK to retrieve
+ * @param erpk_mod (Optional) the modulus for ERPK to retrieve
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_get_keyset(mcl_octet * ep_uid,
+                  mcl_octet * epvk,
+                  mcl_octet * esvk,
+                  mcl_octet * erpk_mod) {
+    return db_select_keyset(db, ep_uid, epvk, esvk, erpk_mod);
+}
+
+
+/**
+ * @brief Open an independent read-only connection to a key database
+ *
+ * Each connection may be used from a different thread than db_init's
+ * connection and than each other.
+ *
+ * @param database_name The name of the key database
+ * @param reader Set to the new connection
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_reader_open(const char * database_name, db_reader ** reader) {
+    int status = 0;
+
+    *reader = calloc(1, sizeof(**reader));
+    if (!*reader) {
+        return ENOMEM;
+    }
+
+    status = sqlite3_open_v2(database_name, &(*reader)->handle,
+                             SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                             NULL);
+    if (status != SQLITE_OK) {
+        fprintf(stderr, "Can't open database '%s': %s\n", database_name,
+                sqlite3_errmsg((*reader)->handle));
+        db_reader_close(*reader);
+        *reader = NULL;
+        status = ENOENT;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Fetch the set of keys associated with an EP_UID
+ *
+ * As db_get_keyset, but through a connection opened by db_reader_open.
+ *
+ * @param reader The connection to use
+ * @param ep_uid The EndPoint Unique ID, to look up
+ * @param epsk (Optional) the EPSK to retrieve
+ * @param essk (Optional) the ESSK to retrieve
+ * @param erpk_mod (Optional) the modulus for ERPK to retrieve
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_reader_get_keyset(db_reader * reader,
+                         mcl_octet * ep_uid,
+                         mcl_octet * epvk,
+                         mcl_octet * esvk,
+                         mcl_octet * erpk_mod) {
+    return db_select_keyset(reader->handle, ep_uid, epvk, esvk, erpk_mod);
+}
+
+
+/**
+ * @brief Close a connection opened by db_reader_open
+ *
+ * @param reader The connection to close (may be NULL)
+ */
+void db_reader_close(db_reader * reader) {
+    if (reader) {
+        sqlite3_close(reader->handle);
+        free(reader);
+    }
+}
+
+
 /**
  * @brief Determine if an EP_UID is already in the key database
  *
+ * Uses the in-memory set if db_load_ep_uids has been called (in which case
+ * it may be called from any thread), otherwise queries the database.
+ *
  * @param ep_uid The EndPoint Unique ID to check for
  *
  * @returns True if the EP_UID is already in the db, false if it isn't.
  */
 bool db_ep_uid_exists(mcl_octet * ep_uid) {
-    int status = 0;
-    char ep_uid_hex[32];
-    char sql_stmt[256];
-    sqlite3_stmt *stmt;
-    bool ep_uid_exists = false;
+    bool exists;
 
+    if (ep_uid_index && (ep_uid->len == DB_EP_UID_SIZE)) {
+        pthread_rwlock_rdlock(&ep_uid_index_lock);
+        exists = ep_uid_index_contains((uint8_t *)ep_uid->val);
+        pthread_rwlock_unlock(&ep_uid_index_lock);
+        return exists;
+    }
 
-   return (db_get_keyset(ep_uid, NULL, NULL, NULL) != SQLITE_NOTFOUND);
+    return (db_get_keyset(ep_uid, NULL, NULL, NULL) != SQLITE_NOTFOUND);
 }
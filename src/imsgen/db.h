@@ -36,6 +36,31 @@
 #ifndef _DATABASE_H
 #define _DATABASE_H
 
+/* Called with each EP_UID by db_scan_ep_uids; non-zero stops the scan */
+typedef int (*db_ep_uid_callback)(const uint8_t * ep_uid, void * context);
+
+/* An independent read-only key database connection (see db_reader_open) */
+typedef struct db_reader db_reader;
+
+/* Called just before each keyset transaction commits (see db_set_commit_hook) */
+typedef int (*db_commit_hook)(void * context);
+
+/**
+ * The imsgen progress recorded alongside the keysets (see db_put_checkpoint).
+ * The IMS file is known to hold ims_count values in its first ims_offset
+ * bytes, matching the keysets committed with the checkpoint.
+ */
+#define DB_FINGERPRINT_SIZE 16  /* IMS_BIN_FINGERPRINT_SIZE in ims_common.h */
+typedef struct {
+    uint8_t  seed_fingerprint[DB_FINGERPRINT_SIZE];
+    uint32_t format;        /* IMS_FORMAT_xxx */
+    uint32_t first_index;   /* The range of IMS indices being generated */
+    uint32_t num_ims;
+    uint32_t next_index;    /* The next IMS index to generate */
+    uint32_t ims_count;     /* IMS values in the IMS file */
+    uint64_t ims_offset;    /* Size of the IMS file */
+} db_checkpoint;
+
 
 /**
  * @brief Initialize the key database subsystem
@@ -47,10 +72,101 @@
 int db_init(const char * database_name);
 
 
+/**
+ * @brief Load every EP_UID in the key database into memory
+ *
+ * Once loaded, db_ep_uid_exists is answered from memory and db_add_keyset
+ * keeps the in-memory set up to date, so the database is only written to.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_load_ep_uids(void);
+
+
+/**
+ * @brief Call a function for every EP_UID in a (historical) key database
+ *
+ * The database is opened read-only and independently of the one opened by
+ * db_init.
+ *
+ * @param database_name The name of the key database to scan
+ * @param callback The function to call with each 8-byte EP_UID
+ * @param context Passed through to callback
+ *
+ * @returns Zero if successful, the first non-zero callback status, or errno.
+ */
+int db_scan_ep_uids(const char * database_name,
+                    db_ep_uid_callback callback,
+                    void * context);
+
+
+/**
+ * @brief Set how the key database is written
+ *
+ * @param keysets_per_transaction The number of keysets to add before each
+ *        commit. Larger batches make adding keysets much cheaper, at the cost
+ *        of losing up to that many keysets if the program dies.
+ * @param wal If true, use write-ahead logging with synchronous=NORMAL
+ *        rather than SQLite's default rollback journal with full syncs.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_set_write_mode(uint32_t keysets_per_transaction, bool wal);
+
+
+/**
+ * @brief Commit any keysets added since the last commit
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_commit(void);
+
+
+/**
+ * @brief Call a function inside each keyset transaction, just before it
+ * commits
+ *
+ * Lets the caller make its own state durable and record it (with
+ * db_put_checkpoint) atomically with the keysets. Once a hook is set,
+ * keysets are always added inside a transaction, even with a batch size
+ * of 1. If the hook fails, the transaction is rolled back.
+ *
+ * @param hook The function to call (NULL to remove the hook)
+ * @param context Passed through to hook
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_set_commit_hook(db_commit_hook hook, void * context);
+
+
+/**
+ * @brief Record the imsgen checkpoint in the current transaction
+ *
+ * Replaces any previous checkpoint. Only valid from a commit hook (see
+ * db_set_commit_hook).
+ *
+ * @param checkpoint The checkpoint to record
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_put_checkpoint(const db_checkpoint * checkpoint);
+
+
+/**
+ * @brief Fetch the last committed imsgen checkpoint
+ *
+ * @param checkpoint Where to store the checkpoint
+ *
+ * @returns Zero if successful, ENOENT if there is no checkpoint, errno
+ *          otherwise.
+ */
+int db_get_checkpoint(db_checkpoint * checkpoint);
+
+
 /**
  * @brief De-initialize the key database subsystem
  *
- * Flushes the IMS output file, closes the database
+ * Commits any outstanding keysets, closes the database
  */
 void db_deinit(void);
 
@@ -58,6 +174,9 @@ void db_deinit(void);
 /**
  * @brief Determine if an EP_UID is already in the key database
  *
+ * Uses the in-memory set if db_load_ep_uids has been called (in which case
+ * it may be called from any thread), otherwise queries the database.
+ *
  * @param ep_uid The EndPoint Unique ID to check for
  *
  * @returns True if the EP_UID is already in the db, false if it isn't.
@@ -96,4 +215,46 @@ int db_get_keyset(mcl_octet * ep_uid,
                   mcl_octet * esvk,
                   mcl_octet * erpk_mod);
 
+
+/**
+ * @brief Open an independent read-only connection to a key database
+ *
+ * Each connection may be used from a different thread than db_init's
+ * connection and than each other.
+ *
+ * @param database_name The name of the key database
+ * @param reader Set to the new connection
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_reader_open(const char * database_name, db_reader ** reader);
+
+
+/**
+ * @brief Fetch the set of keys associated with an EP_UID
+ *
+ * As db_get_keyset, but through a connection opened by db_reader_open.
+ *
+ * @param reader The connection to use
+ * @param ep_uid The EndPoint Unique ID, to look up
+ * @param epsk (Optional) the EPSK to retrieve
+ * @param essk (Optional) the ESSK to retrieve
+ * @param erpk_mod (Optional) the modulus for ERPK to retrieve
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int db_reader_get_keyset(db_reader * reader,
+                         mcl_octet * ep_uid,
+                         mcl_octet * epvk,
+                         mcl_octet * esvk,
+                         mcl_octet * erpk_mod);
+
+
+/**
+ * @brief Close a connection opened by db_reader_open
+ *
+ * @param reader The connection to close (may be NULL)
+ */
+void db_reader_close(db_reader * reader);
+
 #endif /* !_DATABASE_H */
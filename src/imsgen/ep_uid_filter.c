@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ *
+ * @brief: This file contains the EP_UID Bloom filter.
+ *
+ * The filter file is a 32-byte little-endian header followed by the bit
+ * array (bit i is bit i % 8 of byte i / 8):
+ *      magic       8   "EPUIDFLT"
+ *      version     4   EP_UID_FILTER_VERSION
+ *      num_hashes  4
+ *      num_bits    8   (a power of 2)
+ *      num_uids    8
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "util.h"
+#include "ep_uid_filter.h"
+
+#define EP_UID_FILTER_MAGIC         "EPUIDFLT"
+#define EP_UID_FILTER_MAGIC_SIZE    8
+#define EP_UID_FILTER_VERSION       1
+#define EP_UID_FILTER_HEADER_SIZE   32
+
+
+/**
+ * @brief Store a little-endian integer
+ *
+ * @param buf Where to store the value
+ * @param value The value to store
+ * @param size The number of bytes to store
+ */
+static void put_le(uint8_t * buf, uint64_t value, int size) {
+    int i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+
+/**
+ * @brief Fetch a little-endian integer
+ *
+ * @param buf Where to read the value from
+ * @param size The number of bytes to read
+ *
+ * @returns The value
+ */
+static uint64_t get_le(const uint8_t * buf, int size) {
+    uint64_t value = 0;
+    int i;
+
+    for (i = size - 1; i >= 0; i--) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+
+/**
+ * @brief Derive the two hashes used to pick an EP_UID's filter bits
+ *
+ * The EP_UID is already a hash, so it is used as the first hash. The second
+ * is a mix of it, made odd so that the probe sequence h1 + i * h2 visits
+ * distinct bits.
+ *
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ * @param h1 Where to store the first hash
+ * @param h2 Where to store the second hash
+ */
+static void ep_uid_filter_hash(const uint8_t * ep_uid,
+                               uint64_t * h1, uint64_t * h2) {
+    uint64_t x = get_le(ep_uid, 8);
+
+    *h1 = x;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    *h2 = x | 1;
+}
+
+
+/**
+ * @brief Create an empty EP_UID filter
+ *
+ * @param filter The filter to initialize
+ * @param num_uids The number of EP_UIDs the filter will hold
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ep_uid_filter_create(ep_uid_filter * filter, uint64_t num_uids) {
+    uint64_t num_bits = EP_UID_FILTER_MIN_BITS;
+
+    while (num_bits < num_uids * EP_UID_FILTER_BITS_PER_UID) {
+        num_bits <<= 1;
+    }
+
+    filter->bits = calloc(num_bits / 8, 1);
+    if (!filter->bits) {
+        fprintf(stderr, "ERROR: Can't allocate EP_UID filter\n");
+        return ENOMEM;
+    }
+    filter->num_bits = num_bits;
+    filter->num_uids = 0;
+    filter->num_hashes = EP_UID_FILTER_NUM_HASHES;
+
+    return 0;
+}
+
+
+/**
+ * @brief Add an EP_UID to a filter
+ *
+ * @param filter The filter to add to
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ */
+void ep_uid_filter_add(ep_uid_filter * filter, const uint8_t * ep_uid) {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t bit;
+    uint32_t i;
+
+    ep_uid_filter_hash(ep_uid, &h1, &h2);
+    for (i = 0; i < filter->num_hashes; i++) {
+        bit = (h1 + i * h2) & (filter->num_bits - 1);
+        filter->bits[bit / 8] |= 1 << (bit % 8);
+    }
+    filter->num_uids++;
+}
+
+
+/**
+ * @brief Determine if an EP_UID may be in a filter
+ *
+ * @param filter The filter to check
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ *
+ * @returns False if the EP_UID is definitely not in the filter, true if it
+ *          probably is.
+ */
+bool ep_uid_filter_contains(const ep_uid_filter * filter,
+                            const uint8_t * ep_uid) {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t bit;
+    uint32_t i;
+
+    ep_uid_filter_hash(ep_uid, &h1, &h2);
+    for (i = 0; i < filter->num_hashes; i++) {
+        bit = (h1 + i * h2) & (filter->num_bits - 1);
+        if ((filter->bits[bit / 8] & (1 << (bit % 8))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief Write a filter to a file
+ *
+ * @param filter The filter to save
+ * @param filename The name of the filter file
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ep_uid_filter_save(const ep_uid_filter * filter, const char * filename) {
+    int status = 0;
+    uint8_t header[EP_UID_FILTER_HEADER_SIZE];
+    FILE * fp;
+
+    memcpy(header, EP_UID_FILTER_MAGIC, EP_UID_FILTER_MAGIC_SIZE);
+    put_le(&header[8], EP_UID_FILTER_VERSION, 4);
+    put_le(&header[12], filter->num_hashes, 4);
+    put_le(&header[16], filter->num_bits, 8);
+    put_le(&header[24], filter->num_uids, 8);
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "ERROR: Can't create '%s'\n", filename);
+        return errno;
+    }
+    if ((fwrite(header, sizeof(header), 1, fp) != 1) ||
+        (fwrite(filter->bits, filter->num_bits / 8, 1, fp) != 1)) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", filename);
+        status = EIO;
+    }
+    if (fclose(fp) != 0) {
+        status = EIO;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Read a filter from a file written by ep_uid_filter_save
+ *
+ * @param filter The filter to initialize
+ * @param filename The name of the filter file
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ep_uid_filter_load(ep_uid_filter * filter, const char * filename) {
+    int status = 0;
+    uint8_t * buf;
+    ssize_t length;
+    uint64_t num_bits;
+
+    memset(filter, 0, sizeof(*filter));
+    buf = alloc_load_file(filename, &length);
+    if (!buf) {
+        return ENOENT;
+    }
+
+    num_bits = (length >= EP_UID_FILTER_HEADER_SIZE)? get_le(&buf[16], 8) : 0;
+    if ((length < EP_UID_FILTER_HEADER_SIZE) ||
+        (memcmp(buf, EP_UID_FILTER_MAGIC, EP_UID_FILTER_MAGIC_SIZE) != 0) ||
+        (get_le(&buf[8], 4) != EP_UID_FILTER_VERSION)) {
+        fprintf(stderr, "ERROR: '%s' is not an EP_UID filter\n", filename);
+        status = EINVAL;
+    } else if ((num_bits < 8) || ((num_bits & (num_bits - 1)) != 0) ||
+               ((uint64_t)length != EP_UID_FILTER_HEADER_SIZE + num_bits / 8) ||
+               (get_le(&buf[12], 4) == 0)) {
+        fprintf(stderr, "ERROR: EP_UID filter '%s' is corrupt\n", filename);
+        status = EINVAL;
+    } else {
+        filter->bits = malloc(num_bits / 8);
+        if (!filter->bits) {
+            fprintf(stderr, "ERROR: Can't allocate EP_UID filter\n");
+            status = ENOMEM;
+        } else {
+            memcpy(filter->bits, &buf[EP_UID_FILTER_HEADER_SIZE],
+                   num_bits / 8);
+            filter->num_bits = num_bits;
+            filter->num_hashes = get_le(&buf[12], 4);
+            filter->num_uids = get_le(&buf[24], 8);
+        }
+    }
+
+    free(buf);
+    return status;
+}
+
+
+/**
+ * @brief Release the resources held by a filter
+ *
+ * @param filter The filter to free
+ */
+void ep_uid_filter_free(ep_uid_filter * filter) {
+    free(filter->bits);
+    memset(filter, 0, sizeof(*filter));
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ *
+ * @brief: This file contains the header information for the EP_UID Bloom
+ * filter, used to keep EP_UIDs unique across historical key databases.
+ *
+ */
+
+#ifndef _EP_UID_FILTER_H
+#define _EP_UID_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Filter sizing: ~0.05% false positives at 16 bits per EP_UID */
+#define EP_UID_FILTER_BITS_PER_UID  16
+#define EP_UID_FILTER_NUM_HASHES    11
+#define EP_UID_FILTER_MIN_BITS      1024
+
+typedef struct {
+    uint8_t *   bits;       /* num_bits / 8 bytes */
+    uint64_t    num_bits;   /* Power of 2 */
+    uint64_t    num_uids;   /* Number of EP_UIDs added */
+    uint32_t    num_hashes;
+} ep_uid_filter;
+
+
+/**
+ * @brief Create an empty EP_UID filter
+ *
+ * @param filter The filter to initialize
+ * @param num_uids The number of EP_UIDs the filter will hold
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ep_uid_filter_create(ep_uid_filter * filter, uint64_t num_uids);
+
+
+/**
+ * @brief Add an EP_UID to a filter
+ *
+ * @param filter The filter to add to
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ */
+void ep_uid_filter_add(ep_uid_filter * filter, const uint8_t * ep_uid);
+
+
+/**
+ * @brief Determine if an EP_UID may be in a filter
+ *
+ * @param filter The filter to check
+ * @param ep_uid The 8-byte EndPoint Unique ID
+ *
+ * @returns False if the EP_UID is definitely not in the filter, true if it
+ *          probably is.
+ */
+bool ep_uid_filter_contains(const ep_uid_filter * filter,
+                            const uint8_t * ep_uid);
+
+
+/**
+ * @brief Write a filter to a file
+ *
+ * @param filter The filter to save
+ * @param filename The name of the filter file
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ep_uid_filter_save(const ep_uid_filter * filter, const char * filename);
+
+
+/**
+ * @brief Read a filter from a file written by ep_uid_filter_save
+ *
+ * @param filter The filter to initialize
+ * @param filename The name of the filter file
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ep_uid_filter_load(ep_uid_filter * filter, const char * filename);
+
+
+/**
+ * @brief Release the resources held by a filter
+ *
+ * @param filter The filter to free
+ */
+void ep_uid_filter_free(ep_uid_filter * filter);
+
+#endif /* !_EP_UID_FILTER_H */
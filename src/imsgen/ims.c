@@ -35,6 +35,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -63,12 +64,36 @@
 #include "db.h"
 #include "ims_common.h"
 #include "ims.h"
+#include "ims_sieve.h"
+#include "ims_metrics.h"
+#include "ep_uid_filter.h"
+#include "ims_mcl.h"
 
 /* Uncomment the following define to enable IMS diagnostic messages */
 /*#define IMS_DEBUGMSG*/
 
 /* IMS output file */
 static FILE *   fp_ims;
+static int      ims_format;     /* IMS_FORMAT_xxx */
+static uint32_t ims_count;      /* IMS values written to fp_ims */
+
+/**
+ * Checkpoint state, recorded with each database commit (see ims_checkpoint).
+ * Once a store fails, no more commits are made, so the last checkpoint
+ * always matches the IMS file and the key database.
+ */
+static uint32_t run_first_index;
+static uint32_t run_num_ims;
+static uint32_t ims_next_index;     /* The index after the last IMS stored */
+static bool     ims_store_failed;
+static bool     ims_resuming;
+static db_checkpoint resume_checkpoint;
+
+/* Working set for single-threaded generation */
+static ims_context ims_ctx;
+
+/* EP_UIDs from historical key databases (see ims_set_uid_filter) */
+static ep_uid_filter uid_filter;
 
 /**
  * Endpoint Rsa pRivate Key (ERRK/ERPK) data:
@@ -80,10 +105,20 @@ mcl_chunk errk_max_pq_ff[MCL_HFLEN][MCL_BS];
 mcl_chunk erpk_mod_ff[MCL_HFLEN][MCL_BS];
 mcl_chunk erpk_e[MCL_HFLEN][MCL_BS];
 mcl_chunk erpk_d[MCL_HFLEN][MCL_BS];
-mcl_chunk p1[MCL_HFLEN][MCL_BS];
-mcl_chunk q1[MCL_HFLEN][MCL_BS];
+
+/**
+ * Q bias indices (0..4095) grouped by Hamming weight, ascending within each
+ * group. The group for weight w is q_index_by_weight[q_index_weight_start[w]]
+ * up to (but not including) q_index_by_weight[q_index_weight_start[w + 1]].
+ * Without IMS_PQ_BIAS_HAMMING_BALANCED, all indices are in the group for 0.
+ */
+static uint16_t q_index_by_weight[1 << P_Q_BIAS_BITS];
+static uint16_t q_index_weight_start[P_Q_BIAS_BITS + 2];
 
 void calc_errk_max_pq(void);
+static void calc_q_index_table(void);
+static int ims_checkpoint(void * context);
+static int ims_resume_file(const char * ims_filename, int format);
 
 
 /**
@@ -95,6 +130,12 @@ void calc_errk_max_pq(void);
  * @param prng_seed_string Raw seed string
  * @param ims_filename The name of the IMS output file
  * @param database_name The name of the key database
+ * @param db_batch_size The number of keysets to write per database
+ *        transaction
+ * @param db_wal If true, put the key database in WAL mode
+ * @param format The IMS file format (IMS_FORMAT_xxx)
+ * @param resume If true, continue the run recorded by the database's
+ *        checkpoint, truncating the IMS file to match (see ims_set_run)
  *
  * @note One and only 1 of prng_seed_file and prng_seed_string must be
  *       non-null.
@@ -104,25 +145,78 @@ void calc_errk_max_pq(void);
 int ims_init(const char * prng_seed_file,
              const char * prng_seed_string,
              const char * ims_filename,
-             const char * database_name) {
+             const char * database_name,
+             uint32_t db_batch_size,
+             bool db_wal,
+             int format,
+             bool resume) {
     int status = 0;
     mcl_octet * seed = NULL;
+    uint8_t header[IMS_BIN_HEADER_SIZE];
 
     /* Seed the PRNG */
     status = ims_common_init(prng_seed_file, prng_seed_string);
+    ims_context_init(&ims_ctx);
+    ims_context_seed_legacy(&ims_ctx);
 
     /* Open the key database */
     status = db_init(database_name);
     if (status != 0) {
         goto ims_init_err;
     }
+    status = db_set_write_mode(db_batch_size, db_wal);
+    if (status != 0) {
+        goto ims_init_err;
+    }
+    status = db_load_ep_uids();
+    if (status != 0) {
+        goto ims_init_err;
+    }
 
     /* Open the IMS output file */
-    fp_ims = fopen(ims_filename, "w");
+    ims_format = format;
+    ims_count = 0;
+    ims_next_index = 0;
+    ims_store_failed = false;
+    ims_resuming = false;
+    if (resume) {
+        status = ims_resume_file(ims_filename, format);
+        if (status != 0) {
+            goto ims_init_err;
+        }
+    } else {
+        fp_ims = fopen(ims_filename, (format == IMS_FORMAT_BIN)? "wb" : "w");
+        if (!fp_ims) {
+            fprintf(stderr, "ERROR: Can't create IMS file '%s'\n",
+                    ims_filename);
+            status = errno;
+            goto ims_init_err;
+        }
+        if (format == IMS_FORMAT_BIN) {
+            /* The count is filled in when the file is closed */
+            ims_bin_header(header, 0);
+            if (fwrite(header, sizeof(header), 1, fp_ims) != 1) {
+                status = EIO;
+                goto ims_init_err;
+            }
+        }
+    }
+
+    /* Checkpoint the IMS file with every database commit */
+    status = db_set_commit_hook(ims_checkpoint, NULL);
+    if (status != 0) {
+        goto ims_init_err;
+    }
 
     /* Establish any really big number constants */
     calc_errk_max_pq();
 
+    /* Group the Q bias indices for the P & Q bias search */
+    calc_q_index_table();
+
+    /* Build the small-prime table for the P & Q sieves */
+    ims_sieve_init();
+
 ims_init_err:
 
     return status;
@@ -135,19 +229,173 @@ ims_init_err:
  * Flushes the IMS output file, closes the database
  */
 void ims_deinit(void) {
+    uint8_t header[IMS_BIN_HEADER_SIZE];
+
+    /* Commit (and checkpoint) the last keysets while the IMS file is open */
+    db_commit();
+
     /* Close the IMS output file */
     if (fp_ims) {
+        if (ims_format == IMS_FORMAT_BIN) {
+            /* Record how many IMS values the file holds */
+            ims_bin_header(header, ims_count);
+            if ((fseek(fp_ims, 0, SEEK_SET) != 0) ||
+                (fwrite(header, sizeof(header), 1, fp_ims) != 1)) {
+                fprintf(stderr, "ERROR: Can't update the IMS file header\n");
+            }
+        }
         fclose(fp_ims);
         fp_ims = NULL;
     }
 
     /* Close the key database */
     db_deinit();
+    ep_uid_filter_free(&uid_filter);
 
+    ims_context_deinit(&ims_ctx);
     ims_common_deinit();
 }
 
 
+/**
+ * @brief Reopen an IMS file to continue the run recorded by the checkpoint
+ *
+ * Checks the checkpoint matches this run's seed and format, then truncates
+ * the IMS file to the values committed with it: any written after the last
+ * commit have no keysets in the database, and will be generated again.
+ *
+ * @param ims_filename The name of the IMS output file
+ * @param format The IMS file format (IMS_FORMAT_xxx)
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+static int ims_resume_file(const char * ims_filename, int format) {
+    int status = 0;
+    struct stat st;
+    uint8_t fingerprint[IMS_BIN_FINGERPRINT_SIZE];
+
+    status = db_get_checkpoint(&resume_checkpoint);
+    if (status == ENOENT) {
+        fprintf(stderr, "ERROR: The database has no checkpoint to resume\n");
+        return status;
+    } else if (status != 0) {
+        return status;
+    }
+    ims_seed_fingerprint(fingerprint);
+    if (memcmp(fingerprint, resume_checkpoint.seed_fingerprint,
+               sizeof(fingerprint)) != 0) {
+        fprintf(stderr, "ERROR: The checkpoint is for a different seed\n");
+        return EINVAL;
+    }
+    if (resume_checkpoint.format != (uint32_t)format) {
+        fprintf(stderr, "ERROR: The checkpoint is for a different format\n");
+        return EINVAL;
+    }
+
+    fp_ims = fopen(ims_filename, "r+b");
+    if (!fp_ims) {
+        fprintf(stderr, "ERROR: Can't open IMS file '%s'\n", ims_filename);
+        return errno;
+    }
+    if ((fstat(fileno(fp_ims), &st) != 0) ||
+        ((uint64_t)st.st_size < resume_checkpoint.ims_offset)) {
+        fprintf(stderr, "ERROR: IMS file '%s' is shorter than its "
+                "checkpoint\n", ims_filename);
+        status = EIO;
+    } else if ((ftruncate(fileno(fp_ims),
+                          resume_checkpoint.ims_offset) != 0) ||
+               (fseek(fp_ims, 0, SEEK_END) != 0)) {
+        fprintf(stderr, "ERROR: Can't truncate IMS file '%s'\n",
+                ims_filename);
+        status = EIO;
+    }
+    if (status != 0) {
+        /* Don't let ims_deinit stamp a header on a file we didn't resume */
+        fclose(fp_ims);
+        fp_ims = NULL;
+        return status;
+    }
+
+    ims_count = resume_checkpoint.ims_count;
+    ims_next_index = resume_checkpoint.next_index;
+    ims_resuming = true;
+
+    return status;
+}
+
+
+/**
+ * @brief Record the IMS file state in the key database
+ *
+ * Called by the database just before each commit, so the checkpoint is
+ * committed atomically with the keysets. The IMS file is synced first, so
+ * it holds at least the values the checkpoint claims.
+ *
+ * @param context Unused
+ *
+ * @returns Zero if successful, errno otherwise (which rolls back the
+ *          commit).
+ */
+static int ims_checkpoint(void * context) {
+    db_checkpoint checkpoint;
+    off_t offset;
+
+    (void)context;
+    if (!fp_ims || ims_store_failed) {
+        return EIO;
+    }
+    if ((fflush(fp_ims) != 0) || (fsync(fileno(fp_ims)) != 0) ||
+        ((offset = ftello(fp_ims)) < 0)) {
+        fprintf(stderr, "ERROR: Can't sync the IMS file\n");
+        return EIO;
+    }
+
+    ims_seed_fingerprint(checkpoint.seed_fingerprint);
+    checkpoint.format = ims_format;
+    checkpoint.first_index = run_first_index;
+    checkpoint.num_ims = run_num_ims;
+    checkpoint.next_index = ims_next_index;
+    checkpoint.ims_count = ims_count;
+    checkpoint.ims_offset = offset;
+
+    return db_put_checkpoint(&checkpoint);
+}
+
+
+/**
+ * @brief Set the range of IMS indices being generated
+ *
+ * The range is recorded in each checkpoint. When resuming, it must match
+ * the range of the checkpointed run.
+ *
+ * @param first_index The (zero-based) index of the first IMS of the run
+ * @param num_ims The number of IMS values in the run
+ * @param next_index Set to the index of the next IMS to generate
+ *        (first_index, unless resuming)
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_set_run(uint32_t first_index, uint32_t num_ims,
+                uint32_t * next_index) {
+    if (ims_resuming) {
+        if ((resume_checkpoint.first_index != first_index) ||
+            (resume_checkpoint.num_ims != num_ims)) {
+            fprintf(stderr, "ERROR: The checkpoint is for %u IMS values from "
+                    "index %u\n", resume_checkpoint.num_ims,
+                    resume_checkpoint.first_index);
+            return EINVAL;
+        }
+    } else {
+        ims_next_index = first_index;
+    }
+    run_first_index = first_index;
+    run_num_ims = num_ims;
+    *next_index = ims_next_index;
+
+    return 0;
+}
+
+
 /**
  * @brief Generate an FF num for the maximum starting ERRK_P or ERRK_Q
  *
@@ -177,9 +425,49 @@ void calc_errk_max_pq(void) {
 
 
 /**
- * @brief Write the IMS as an ASCII binarray string
+ * @brief Build the table of Q bias indices grouped by Hamming weight
+ *
+ * With IMS_PQ_BIAS_HAMMING_BALANCED, a Q index can only partner a P index
+ * if together they have a Hamming weight of 12, so grouping the Q indices
+ * by weight lets the search visit just the admissible ones.
+ */
+static void calc_q_index_table(void) {
+    uint32_t count[P_Q_BIAS_BITS + 1] = {0};
+    uint16_t q_index;
+    uint32_t weight;
+
+    for (q_index = 0; q_index < (1 << P_Q_BIAS_BITS); q_index++) {
+#ifdef IMS_PQ_BIAS_HAMMING_BALANCED
+        weight = hamming_weight((uint8_t *)&q_index, sizeof(q_index));
+#else
+        weight = 0;
+#endif
+        count[weight]++;
+    }
+
+    q_index_weight_start[0] = 0;
+    for (weight = 0; weight <= P_Q_BIAS_BITS; weight++) {
+        q_index_weight_start[weight + 1] = q_index_weight_start[weight] +
+                                           count[weight];
+        count[weight] = q_index_weight_start[weight];
+    }
+
+    for (q_index = 0; q_index < (1 << P_Q_BIAS_BITS); q_index++) {
+#ifdef IMS_PQ_BIAS_HAMMING_BALANCED
+        weight = hamming_weight((uint8_t *)&q_index, sizeof(q_index));
+#else
+        weight = 0;
+#endif
+        q_index_by_weight[count[weight]++] = q_index;
+    }
+}
+
+
+/**
+ * @brief Write the IMS to the IMS file
  *
- * Writes the IMS value as a single-line binary array string, MSB-to-LSB
+ * In text form, writes the IMS value as a single-line binary array string,
+ * MSB-to-LSB. In binary form, writes it as a record (see IMS_BIN_MAGIC).
  *
  * @param fp The file to which to write
  * @param epsk The IMS value to write
@@ -187,33 +475,43 @@ void calc_errk_max_pq(void) {
  * @returns Zero if successful, errno otherwise.
  */
 int ims_write(FILE * fp, uint8_t * ims) {
-    int status = 0;
     int byte_index;
     int bit;
+    int i = 0;
     uint8_t byte;
+    char line[IMS_LINE_SIZE];
+    uint8_t record[IMS_BIN_RECORD_SIZE];
 
 #ifdef IMS_DEBUGMSG
     printf("ims_write:\n");
     display_binary_data(ims, IMS_SIZE, true, NULL);
 #endif
-   if (fp_ims) {
+    if (!fp) {
+        return EBADF;
+    }
+
+    if (ims_format == IMS_FORMAT_BIN) {
+        ims_bin_record(record, ims);
+        if (fwrite(record, sizeof(record), 1, fp) != 1) {
+            return EIO;
+        }
+    } else {
+        /* Build the whole line, then write it in one go */
         for (byte_index = IMS_SIZE - 1; byte_index >= 0; byte_index--) {
             byte = ims[byte_index];
             for (bit = 0; bit < 8; bit++) {
-                if (fputc((byte & BYTE_MASK_MSB)? '1' : '0', fp) == EOF) {
-                    return EIO;
-                }
+                line[i++] = (byte & BYTE_MASK_MSB)? '1' : '0';
                 byte <<= 1;
             }
         }
-        if (fputc('\n', fp) == EOF) {
-                 return EIO;
+        line[i] = '\n';
+        if (fwrite(line, sizeof(line), 1, fp) != 1) {
+            return EIO;
         }
-
-        return 0;
-    } else {
-        return EBADF;
     }
+    ims_count++;
+
+    return 0;
 }
 
 
@@ -223,29 +521,126 @@ int ims_write(FILE * fp, uint8_t * ims) {
  * Generates a random IMS value, the lower 32-bits of which will have a
  * Hamming weight of 128.
  *
- * @param ims A pointer to the 35-byte IMS value
+ * In production, the 128 set bits are chosen directly as a random 128 of
+ * the 256 bit positions (a partial Fisher-Yates shuffle). Every string of
+ * weight 128 is equally likely, exactly as when drawing random strings
+ * until one has weight 128, but without discarding the ~95% that don't.
+ *
+ * @param ctx The generation context (supplies the PRNG and receives the IMS)
+ * @param ims_sample_compatibility If true, draw whole random strings until
+ *        one has the right weight, as the original 100 samples were.
  */
-static void ims_generate_candidate(uint8_t * ims) {
-    int status = 0;
+static void ims_generate_candidate(ims_context * ctx,
+                                   bool ims_sample_compatibility) {
+    uint8_t * ims = ctx->ims;
+    uint8_t positions[IMS_HAMMING_SIZE * BITS_PER_BYTE];
+    uint8_t position;
+    uint8_t bytes[IMS_HAMMING_WEIGHT];
+    int num_bytes = 0;
+    int next_byte = 0;
+    uint32_t limit;
+    uint32_t reject_from;
     int i;
+    int j;
 
-    do {
-        /* Create a new 35-bit random number... */
-        for(i = 0; i < IMS_HAMMING_SIZE; i++) {
-            ims[i] = MCL_RAND_byte(&rng);
+    if (ims_sample_compatibility) {
+        do {
+            /* Create a new 35-bit random number... */
+            MCL_RAND_bytes(&ctx->rng, (char *)ims, IMS_HAMMING_SIZE);
+            /* ...and check the Hamming weight of the lower 32 bytes) */
+        } while (hamming_weight(ims, IMS_HAMMING_SIZE) != IMS_HAMMING_WEIGHT);
+        return;
+    }
+
+    for (i = 0; i < (int)sizeof(positions); i++) {
+        positions[i] = i;
+    }
+    memset(ims, 0, IMS_HAMMING_SIZE);
+
+    /* Move a random remaining position into place i, and set that bit */
+    for (i = 0; i < IMS_HAMMING_WEIGHT; i++) {
+        /**
+         * Draw j uniformly from i..255, rejecting the top (256 % limit)
+         * byte values, which would bias it
+         */
+        limit = sizeof(positions) - i;
+        reject_from = 256 - (256 % limit);
+        do {
+            /**
+             * Every remaining position needs at least one byte, so drawing
+             * that many at once uses exactly the bytes a byte-at-a-time
+             * draw would
+             */
+            if (next_byte == num_bytes) {
+                num_bytes = IMS_HAMMING_WEIGHT - i;
+                next_byte = 0;
+                MCL_RAND_bytes(&ctx->rng, (char *)bytes, num_bytes);
+            }
+        } while (bytes[next_byte++] >= reject_from);
+        j = i + (bytes[next_byte - 1] % limit);
+        position = positions[j];
+        positions[j] = positions[i];
+        positions[i] = position;
+        ims[position / BITS_PER_BYTE] |= 1 << (position % BITS_PER_BYTE);
+    }
+}
+
+
+/* Sieve survivors given to each MCL_FF_prime_batch call */
+#define IMS_PRIME_BATCH     MCL_FF_PRIME_LANES
+
+/**
+ * @brief Test a batch of ERRK P or Q candidates for primality
+ *
+ * Tests base + (index * odd_mod) for each of the given window indices with
+ * one MCL_FF_prime_batch call, and records the verdicts.
+ *
+ * @param ctx The generation context
+ * @param base The base value of P or Q
+ * @param odd_mod The spacing between candidates
+ * @param indices The window indices to test
+ * @param count The number of indices, at most IMS_PRIME_BATCH
+ * @param known Window bitmap of indices with a verdict, updated
+ * @param prime Window bitmap of indices found to be prime, updated
+ */
+static void test_prime_batch(ims_context * ctx,
+                             mcl_chunk base[][MCL_BS],
+                             int odd_mod,
+                             const uint16_t * indices,
+                             uint32_t count,
+                             uint64_t * known,
+                             uint64_t * prime) {
+    mcl_chunk candidates[IMS_PRIME_BATCH][MCL_FFLEN][MCL_BS];
+    mcl_chunk (*batch[IMS_PRIME_BATCH])[MCL_BS];
+    int is_prime[IMS_PRIME_BATCH];
+    uint32_t i;
+
+    /* MCL_FF_prime_batch takes each candidate as its own FF */
+    for (i = 0; i < count; i++) {
+        MCL_FF_copy_C25519(candidates[i], base, MCL_HFLEN);
+        MCL_FF_inc_C25519(candidates[i], indices[i] * odd_mod, MCL_HFLEN);
+        batch[i] = candidates[i];
+    }
+    ctx->prime_tests += count;
+    MCL_FF_prime_batch_C25519(is_prime, batch, count, ctx->prime_rng,
+                              ctx->prime_test, MCL_HFLEN);
+    for (i = 0; i < count; i++) {
+        IMS_SIEVE_SET(known, indices[i]);
+        if (is_prime[i]) {
+            IMS_SIEVE_SET(prime, indices[i]);
         }
-        /* ...and check the Hamming weight of the lower 32 bytes) */
-    } while (hamming_weight(ims, IMS_HAMMING_SIZE) != IMS_HAMMING_WEIGHT);
+    }
 }
 
 
 /**
  * @brief Calculate the Endpoint Rsa pRivate Key (ERRK)
  *
- * @param y2 A pointer to the Y2 term used by all
- * @param ims A pointer to the ims (the upper 3 bytes will be modified)
- * @param erpk_mod A pointer to a buffer to store the modulus for ERPK
- * @param errk_d A pointer to a buffer to store the  ERPK decryption exponent
+ * On success, the upper 3 bytes of ctx->ims hold the P & Q bias, the RSA
+ * key pair is in ctx->rsa_private/rsa_public and the modulus is in
+ * ctx->erpk_mod.
+ *
+ * @param ctx The generation context (ctx->y2 and ctx->ims must be set)
  * @param ims_sample_compatibility If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, generate the IMS value using
@@ -253,17 +648,32 @@ static void ims_generate_candidate(uint8_t * ims) {
  *
  * @returns Zero if successful, errno otherwise.
  */
-static int calc_errk(uint8_t * y2,
-                     uint8_t * ims,
-                     mcl_octet * erpk_mod,
-                     mcl_octet * errk_d,
+static int calc_errk(ims_context * ctx,
                      bool ims_sample_compatibility) {
     int status = 0;
     uint32_t p_bias;
-    uint32_t q_bias;
+    uint16_t p_index;
+    uint16_t q_index;
     uint32_t pq_bias;
-    MCL_rsa_private_key priv_key = { 0 };
-    MCL_rsa_public_key pub_key = { 0 };
+    const uint16_t * q_indices;
+    uint32_t num_q_indices;
+    uint32_t q_weight;
+    uint32_t i;
+    uint32_t j;
+    uint32_t count;
+    uint16_t batch[IMS_PRIME_BATCH];
+    MCL_rsa_private_key * priv_key = &ctx->rsa_private;
+    MCL_rsa_public_key * pub_key = &ctx->rsa_public;
+    mcl_chunk p1[MCL_HFLEN][MCL_BS];
+    mcl_chunk q1[MCL_HFLEN][MCL_BS];
+    uint64_t p_composite[IMS_SIEVE_WORDS];
+    uint64_t p_known[IMS_SIEVE_WORDS];
+    uint64_t p_prime[IMS_SIEVE_WORDS];
+    uint64_t q_known[IMS_SIEVE_WORDS];
+    uint64_t q_prime[IMS_SIEVE_WORDS];
+    bool sieve;
+    bool p_is_prime;
+    bool q_is_prime;
     int odd_mod;
     int prime_search_limit;
     uint8_t odd_mod_bitmask;
@@ -293,17 +703,45 @@ static int calc_errk(uint8_t * y2,
      *  ERRK_Q[0] |= 0x03
      *    :
      */
-    calc_errk_pq_bias_odd(y2, ims, &errk_p, &errk_q, ims_sample_compatibility);
+    calc_errk_pq_bias_odd(ctx->y2, ctx->ims, &ctx->errk_p, &ctx->errk_q,
+                          ims_sample_compatibility);
 
     /* Convert P & Q into FFs for arithmetic operations */
     if (ims_sample_compatibility) {
         /* Used in first 100 IMS samples */
-        ff_from_big_endian_octet(p_ff, &errk_p, MCL_HFLEN);
-        ff_from_big_endian_octet(q_ff, &errk_q, MCL_HFLEN);
+        ff_from_big_endian_octet(ctx->p_ff, &ctx->errk_p, MCL_HFLEN);
+        ff_from_big_endian_octet(ctx->q_ff, &ctx->errk_q, MCL_HFLEN);
     } else {
         /* Used subsequent to the first 100 IMS samples */
-        ff_from_little_endian_octet(p_ff, &errk_p, MCL_HFLEN);
-        ff_from_little_endian_octet(q_ff, &errk_q, MCL_HFLEN);
+        ff_from_little_endian_octet(ctx->p_ff, &ctx->errk_p, MCL_HFLEN);
+        ff_from_little_endian_octet(ctx->q_ff, &ctx->errk_q, MCL_HFLEN);
+    }
+
+    /**
+     * Strike out every P & Q candidate in the search windows that has a
+     * small factor, so that only the survivors get a primality test. This
+     * finds the same primes, but the legacy sample stream also feeds the
+     * primality test witnesses, so skipping tests would change the
+     * subsequent samples; only sieve in production.
+     *
+     * The same goes for remembering Q primality: the Q search restarts for
+     * every prime P, so each Q index's verdict is kept for the rest of this
+     * IMS (q_known: verdict available, q_prime: the verdict). The sieve
+     * supplies the first "composite" verdicts.
+     *
+     * With verdicts kept, the sieve survivors can be tested IMS_PRIME_BATCH
+     * at a time (MCL_FF_prime_batch), starting with the one the search
+     * needs next. P verdicts are kept the same way (p_known, p_prime).
+     * Production also uses the context's prime test profile, while the
+     * legacy samples keep the 10 round Miller-Rabin test.
+     */
+    sieve = !ims_sample_compatibility;
+    if (sieve) {
+        ims_sieve_window(ctx->p_ff, MCL_HFLEN, odd_mod, p_composite);
+        ims_sieve_window(ctx->q_ff, MCL_HFLEN, odd_mod, q_known);
+        memset(q_prime, 0, sizeof(q_prime));
+        memset(p_known, 0, sizeof(p_known));
+        memset(p_prime, 0, sizeof(p_prime));
     }
 
     /**
@@ -316,22 +754,76 @@ static int calc_errk(uint8_t * y2,
      * 2 and test again. Give up when we've swept all 4k possibilities for each
      * without finding a prime number.
      */
-    MCL_FF_copy_C25519(priv_key.p, p_ff, MCL_HFLEN);
+    MCL_FF_copy_C25519(priv_key->p, ctx->p_ff, MCL_HFLEN);
 
     for (p_bias = 0;
          p_bias < prime_search_limit;
          p_bias += odd_mod,
-         MCL_FF_inc_C25519(priv_key.p, odd_mod, MCL_HFLEN)) {
-        if (MCL_FF_comp_C25519(priv_key.p, errk_max_pq_ff, MCL_HFLEN) == 1) {
+         MCL_FF_inc_C25519(priv_key->p, odd_mod, MCL_HFLEN)) {
+        if (MCL_FF_comp_C25519(priv_key->p, errk_max_pq_ff, MCL_HFLEN) == 1) {
             /* The sum of P + P_bias will overflow */
             fprintf(stderr, "P would overflow - discard IMS\n");
             break;
         }
-        /* Check if P is prime */
-        if (MCL_FF_prime_C25519(priv_key.p, &rng, MCL_HFLEN) == 1) {
+        p_index = p_bias / odd_mod;
+        if (sieve && IMS_SIEVE_IS_COMPOSITE(p_composite, p_index)) {
+            continue;
+        }
+
+        /* Look up the Q indices which can partner this P index */
+#ifdef IMS_PQ_BIAS_HAMMING_BALANCED
+        /**
+         * If enabled, PQ bias must have equal numbers of 1s and 0s, so Q
+         * index must make up the rest of P index's Hamming weight.
+         */
+        q_weight = IMS_PQ_BIAS_HAMMING_WEIGHT -
+                   hamming_weight((uint8_t *)&p_index, sizeof(uint16_t));
+#else
+        q_weight = 0;
+#endif
+        q_indices = &q_index_by_weight[q_index_weight_start[q_weight]];
+        num_q_indices = q_index_weight_start[q_weight + 1] -
+                        q_index_weight_start[q_weight];
+
+        /* Don't test P if all of its partners are known to be composite */
+        if (sieve) {
+            for (i = 0; i < num_q_indices; i++) {
+                if (!IMS_SIEVE_TEST(q_known, q_indices[i]) ||
+                    IMS_SIEVE_TEST(q_prime, q_indices[i])) {
+                    break;
+                }
+            }
+            if (i == num_q_indices) {
+                continue;
+            }
+        }
+
+        /* Check if P is prime, with the next few P survivors if sieving */
+        if (sieve) {
+            if (!IMS_SIEVE_TEST(p_known, p_index)) {
+                count = 0;
+                for (j = p_index;
+                     j < IMS_SIEVE_WINDOW && count < IMS_PRIME_BATCH;
+                     j++) {
+                    if (!IMS_SIEVE_IS_COMPOSITE(p_composite, j)) {
+                        batch[count++] = j;
+                    }
+                }
+                test_prime_batch(ctx, ctx->p_ff, odd_mod, batch, count,
+                                 p_known, p_prime);
+            }
+            p_is_prime = IMS_SIEVE_TEST(p_prime, p_index);
+        } else {
+            ctx->prime_tests++;
+            p_is_prime = (MCL_FF_prime_test_C25519(priv_key->p,
+                                                   ctx->prime_rng,
+                                                   MCL_FF_PRIME_MR,
+                                                   MCL_HFLEN) == 1);
+        }
+        if (p_is_prime) {
 #ifdef RSA_PQ_FACTORABILITY
             if (ims_sample_compatibility) {
-                MCL_FF_copy_C25519(p1, priv_key.p, MCL_HFLEN);
+                MCL_FF_copy_C25519(p1, priv_key->p, MCL_HFLEN);
                 MCL_FF_dec_C25519(p1, 1, MCL_HFLEN);
 
                 if (MCL_FF_cfactor_C25519(p1, ERPK_EXPONENT, MCL_HFLEN)) {
@@ -344,39 +836,57 @@ static int calc_errk(uint8_t * y2,
              * Always start with the base value of Q, since the inner loop
              * modifies it.
              */
-            MCL_FF_copy_C25519(priv_key.q, q_ff, MCL_HFLEN);
+            MCL_FF_copy_C25519(priv_key->q, ctx->q_ff, MCL_HFLEN);
+            q_index = 0;
+
+            /* Visit only the admissible Q indices, in ascending order */
+            for (i = 0; i < num_q_indices; i++) {
+                MCL_FF_inc_C25519(priv_key->q,
+                                  (q_indices[i] - q_index) * odd_mod,
+                                  MCL_HFLEN);
+                q_index = q_indices[i];
 
-            for (q_bias = 0;
-                 q_bias < prime_search_limit;
-                 q_bias += odd_mod,
-                 MCL_FF_inc_C25519(priv_key.q, odd_mod, MCL_HFLEN)) {
-                if (MCL_FF_comp_C25519(priv_key.q, errk_max_pq_ff, MCL_HFLEN) == 1) {
+                if (MCL_FF_comp_C25519(priv_key->q, errk_max_pq_ff, MCL_HFLEN) == 1) {
                     /* The sum of Q + Q_bias will overflow */
                     fprintf(stderr, "Q would overflow - discard IMS\n");
                     break;
                 }
                 /**
-                 * P_bias and Q_bias are guaranteed to be >= 0, < 8192, and even.
-                 * Divide them by two to get a 12-bit version (< 4096) and pack
-                 * them as a 24-bit number as they will be in IMS[32:34]
+                 * The P & Q indices (bias / odd_mod) are 12-bit numbers
+                 * (< 4096); pack them as a 24-bit number as they will be
+                 * in IMS[32:34]
                  */
-                pq_bias = (4096 * (p_bias / odd_mod)) + (q_bias / odd_mod);
+                pq_bias = (4096 * p_index) + q_index;
 
-#ifdef IMS_PQ_BIAS_HAMMING_BALANCED
                 /**
-                 * If enabled, reject if PQ bias doesn't have equal numbers
-                 * of 1s and 0s.
+                 * Check if Q is prime (unless we already know), with the
+                 * next few untested partners if sieving
                  */
-                if (hamming_weight((uint8_t *)&pq_bias, 3) !=
-                    IMS_PQ_BIAS_HAMMING_WEIGHT) {
-                    continue;
+                if (sieve) {
+                    if (!IMS_SIEVE_TEST(q_known, q_index)) {
+                        count = 0;
+                        for (j = i;
+                             j < num_q_indices && count < IMS_PRIME_BATCH;
+                             j++) {
+                            if (!IMS_SIEVE_TEST(q_known, q_indices[j])) {
+                                batch[count++] = q_indices[j];
+                            }
+                        }
+                        test_prime_batch(ctx, ctx->q_ff, odd_mod, batch,
+                                         count, q_known, q_prime);
+                    }
+                    q_is_prime = IMS_SIEVE_TEST(q_prime, q_index);
+                } else {
+                    ctx->prime_tests++;
+                    q_is_prime = (MCL_FF_prime_test_C25519(priv_key->q,
+                                                           ctx->prime_rng,
+                                                           MCL_FF_PRIME_MR,
+                                                           MCL_HFLEN) == 1);
                 }
-#endif
-                /* Check if Q is prime */
-                if (MCL_FF_prime_C25519(priv_key.q, &rng, MCL_HFLEN) == 1) {
+                if (q_is_prime) {
 #ifdef RSA_PQ_FACTORABILITY
                     if (ims_sample_compatibility) {
-                        MCL_FF_copy_C25519(q1, priv_key.q, MCL_HFLEN);
+                        MCL_FF_copy_C25519(q1, priv_key->q, MCL_HFLEN);
                         MCL_FF_dec_C25519(q1, 1, MCL_HFLEN);
 
                         if (MCL_FF_cfactor_C25519(q1, ERPK_EXPONENT, MCL_HFLEN)) {
@@ -404,9 +914,9 @@ SUCCESS:
      */
 
     /* Save the bias offset in IMS[32:34] */
-    ims[32] = (uint8_t)(pq_bias);
-    ims[33] = (uint8_t)(pq_bias >> 8);
-    ims[34] = (uint8_t)(pq_bias >> 16);
+    ctx->ims[32] = (uint8_t)(pq_bias);
+    ctx->ims[33] = (uint8_t)(pq_bias >> 8);
+    ctx->ims[34] = (uint8_t)(pq_bias >> 16);
 
     /**
      * Generate the public and private keys
@@ -416,88 +926,265 @@ SUCCESS:
      *  ERRK_D = RSA_secret(ERRK_P, ERK_Q, ERPK_E) // Private decrypt exponent
      *                                             // (unused in IMS creation)
      * On return, the structs are set to the following:
-     *   - pub_key.n    ERRPK_MOD (p * q)
-     *   - pub_key.e    ERPK_EXPONENT (65537)
+     *   - pub_key->n    ERRPK_MOD (p * q)
+     *   - pub_key->e    ERPK_EXPONENT (65537)
      *
-     *   - priv_key.p   secret prime p
-     *   - priv_key.q   secret prime q
-     *   - priv_key.dp  decrypting exponent mod (p-1)
-     *   - priv_key.dq  decrypting exponent mod (q-1)
-     *   - priv_key.c   1/p mod q
+     *   - priv_key->p   secret prime p
+     *   - priv_key->q   secret prime q
+     *   - priv_key->dp  decrypting exponent mod (p-1)
+     *   - priv_key->dq  decrypting exponent mod (q-1)
+     *   - priv_key->c   1/p mod q
      */
-    rsa_secret(&priv_key, &pub_key, ERPK_EXPONENT, ims_sample_compatibility);
+    rsa_secret(priv_key, pub_key, ERPK_EXPONENT, ims_sample_compatibility);
 
     /* Convert the calculated FF nums back into octets for later storage */
-    MCL_FF_toOctet_C25519(erpk_mod, pub_key.n, MCL_FFLEN);
+    MCL_FF_toOctet_C25519(&ctx->erpk_mod, pub_key->n, MCL_FFLEN);
 
     return status;
 }
 
 
 /**
- * @brief Generate an IMS value
+ * @brief IMS generation stage 1: draw a candidate IMS value
  *
- * Generates a unique IMS value, storing it in the IMS output file and
- * the generated EPVK, ERPK and ESVK keys in the key
- * database.
+ * Draws the next candidate IMS from the context's PRNG and calculates its
+ * EP_UID and "Y2".
  *
+ * @param ctx The generation context
  * @param ims_sample_compatibility If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, generate the IMS value using
  *        the correct form.
+ */
+void ims_stage_candidate(ims_context * ctx, bool ims_sample_compatibility) {
+    uint64_t start = ims_metrics_now_ns();
+
+    ims_generate_candidate(ctx, ims_sample_compatibility);
+    calculate_epuid_es3(ctx->ims, &ctx->ep_uid);
+
+    /* Calculate "Y2", used in generating EPSK, MPDK, ERRK, EPCK, ERGS */
+    calculate_y2(ctx->ims, ctx->y2);
+
+    ims_metrics_event(IMS_EVENT_CANDIDATE);
+    ims_metrics_stage(IMS_STAGE_CANDIDATE, start);
+}
+
+
+/**
+ * @brief IMS generation stage 2: search for the ERRK primes
  *
- * @returns Zero if successful, errno otherwise.
+ * @param ctx The generation context, holding a candidate from stage 1
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14. If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, non-zero if the candidate must be discarded
+ *          (and a new one drawn by stage 1).
+ */
+int ims_stage_errk(ims_context * ctx, bool ims_sample_compatibility) {
+    int status;
+    uint64_t start = ims_metrics_now_ns();
+
+    /**
+     * Calculate ERRK from that IMS (returns EOVERFLOW if we need to spin
+     * a new IMS)
+     */
+    status = calc_errk(ctx, ims_sample_compatibility);
+    if (status != 0) {
+        ims_metrics_event(IMS_EVENT_ERRK_OVERFLOW);
+    }
+    ims_metrics_stage(IMS_STAGE_ERRK, start);
+
+    return status;
+}
+
+
+/**
+ * @brief IMS generation stage 3: derive the ECC keys
+ *
+ * @param ctx The generation context, holding a candidate which passed
+ *        stage 2
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14. If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, non-zero if the candidate must be discarded
+ *          (and a new one drawn by stage 1).
  */
-int ims_generate(bool ims_sample_compatibility) {
+int ims_stage_ecc(ims_context * ctx, bool ims_sample_compatibility) {
     int status = 0;
     int epvk_status;
     int esvk_status;
+    uint64_t start = ims_metrics_now_ns();
+
+    /* Calculate EPSK/EPVK and  ESSK/ESVK from the confirmed-valid IMS */
+    calc_epsk(ctx->y2, &ctx->epsk);
+    epvk_status = calc_epvk(&ctx->epsk, &ctx->epvk);
+    calc_essk(ctx->y2, &ctx->essk, ims_sample_compatibility);
+    esvk_status = calc_esvk(&ctx->essk, &ctx->esvk);
+
+    /**
+     * For the first 100 samples, we didn't check epvk or esvk
+     * generation status. In a production environment, we do, and
+     * if either one fails, we discard the IMS.
+     */
+    if (!ims_sample_compatibility &&
+            ((epvk_status != 0) || (esvk_status != 0))) {
+        ims_metrics_event(IMS_EVENT_ECC_INVALID);
+        status = -1;
+    }
+    ims_metrics_stage(IMS_STAGE_ECC, start);
+
+    return status;
+}
+
+
+/**
+ * @brief Generate an IMS value and its keys into a context
+ *
+ * Generates a cryptographically good IMS value with a unique EP_UID, along
+ * with the EPVK, ERPK and ESVK keys derived from it. Candidates whose EP_UID
+ * is taken are redrawn before the ERRK search (see ims_is_unique). Only the
+ * context is written to (the database is only read), so several contexts
+ * may be worked on concurrently.
+ *
+ * @param ctx The generation context
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14. If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_generate_one(ims_context * ctx, bool ims_sample_compatibility) {
+    int status = 0;
 
     /* Generate a cryptographiclly good IMS value */
     do {
         /* Find a unique IMS value */
         do {
-            ims_generate_candidate(ims);
-            calculate_epuid_es3(ims, &ep_uid);
-         } while (db_ep_uid_exists(&ep_uid));
-
-        /* Calculate "Y2", used in generating EPSK, MPDK, ERRK, EPCK, ERGS */
-        calculate_y2(ims, y2);
-
-        /**
-         * Calculate ERRK from that IMS (returns EOVERFLOW if we need to spin
-         * a new IMS)
-         */
-        status = calc_errk(y2, ims, &erpk_mod, &errk_d,
-                           ims_sample_compatibility);
+            ims_stage_candidate(ctx, ims_sample_compatibility);
+        } while (!ims_is_unique(ctx));
 
+        status = ims_stage_errk(ctx, ims_sample_compatibility);
         if (status == 0) {
-            /* Calculate EPSK/EPVK and  ESSK/ESVK from the confirmed-valid IMS */
-            calc_epsk(y2, &epsk);
-            epvk_status = calc_epvk(&epsk, &epvk);
-            calc_essk(y2, &essk, ims_sample_compatibility);
-            esvk_status = calc_esvk(&essk, &esvk);
-            /**
-             * For the first 100 samples, we didn't check epvk or esvk
-             * generation status. In a production environment, we do, and
-             * if either one fails, we discard the IMS.
-             */
-            if (!ims_sample_compatibility &&
-                    ((epvk_status != 0) || (esvk_status != 0))) {
-                status = -1;
-            }
+            status = ims_stage_ecc(ctx, ims_sample_compatibility);
         }
     } while (status != 0);
 
-    /**
-     * Write the IMS value to the IMS file and the various keys and magic
-     * numbers to the database
-     */
+    return status;
+}
+
+
+/**
+ * @brief Check EP_UIDs against those of historical key databases
+ *
+ * Loads an EP_UID filter built by imsgen_filter. Generated EP_UIDs which
+ * the filter (probably) contains are rejected by ims_is_unique, so a false
+ * positive only costs drawing another candidate.
+ *
+ * @param filter_filename The name of the EP_UID filter file
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_set_uid_filter(const char * filter_filename) {
+    ep_uid_filter_free(&uid_filter);
+    return ep_uid_filter_load(&uid_filter, filter_filename);
+}
+
+
+/**
+ * @brief Check whether a candidate IMS is unique
+ *
+ * Called on each candidate as soon as its EP_UID is known, so that taken
+ * EP_UIDs are rejected before the ERRK search. The key database is only
+ * read, so worker threads may call this while the sink stores keysets.
+ *
+ * @param ctx The generation context holding the candidate
+ *
+ * @returns True if the EP_UID is neither in the EP_UID filter (if any) nor
+ *          in the key database.
+ */
+bool ims_is_unique(ims_context * ctx) {
+    if (uid_filter.bits &&
+        ep_uid_filter_contains(&uid_filter, (uint8_t *)ctx->ep_uid.val)) {
+        ims_metrics_event(IMS_EVENT_UID_FILTER);
+        return false;
+    }
+    if (db_ep_uid_exists(&ctx->ep_uid)) {
+        ims_metrics_event(IMS_EVENT_UID_DB);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief Store a generated IMS value
+ *
+ * Writes the IMS value to the IMS file and the various keys and magic
+ * numbers to the database.
+ *
+ * @param ctx The generation context holding the IMS and keys
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_store(ims_context * ctx) {
+    int status;
+    uint64_t start = ims_metrics_now_ns();
+
+    status = ims_write(fp_ims, ctx->ims);
     if (status == 0){
-        status = ims_write(fp_ims, ims);
+        /* Set before adding the keyset, which may commit a checkpoint */
+        ims_next_index = ctx->index + 1;
+        status = db_add_keyset(&ctx->ep_uid, &ctx->epvk, &ctx->esvk,
+                               &ctx->erpk_mod);
+    }
+    ims_metrics_stage(IMS_STAGE_SINK, start);
+    if (status != 0) {
+        ims_store_failed = true;
+    } else {
+        ims_metrics_stored(ctx->prime_tests);
+        ctx->prime_tests = 0;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Generate an IMS value
+ *
+ * Generates a unique IMS value, storing it in the IMS output file and
+ * the generated EPVK, ERPK and ESVK keys in the key
+ * database.
+ *
+ * @param index The (zero-based) index of the IMS value, which selects its
+ *        PRNG streams (see ims_context_seed)
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14 (continuing the single legacy PRNG stream,
+ *        so index is ignored). If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_generate(uint32_t index, bool ims_sample_compatibility) {
+    int status = 0;
+
+    if (!ims_sample_compatibility) {
+        ims_context_seed(&ims_ctx, index);
+    } else {
+        ims_ctx.index = index;
     }
+
+    /* Find a unique, cryptographically good IMS value */
+    status = ims_generate_one(&ims_ctx, ims_sample_compatibility);
+
     if (status == 0){
-        status = db_add_keyset(&ep_uid, &epvk, &esvk, &erpk_mod);
+        status = ims_store(&ims_ctx);
     }
 
     return status;
@@ -36,7 +36,16 @@
 #ifndef _IMS_H
 #define _IMS_H
 
+/* IMS generation context (see ims_common.h) */
+struct ims_context;
 
+/* IMS generation stages, in the order an IMS passes through them */
+#define IMS_STAGE_CANDIDATE     0   /* Draw a candidate IMS, EP_UID and Y2 */
+#define IMS_STAGE_ERRK          1   /* Search for the ERRK P & Q primes */
+#define IMS_STAGE_ECC           2   /* Derive the EPVK & ESVK */
+#define IMS_STAGE_SINK          3   /* Check uniqueness, store IMS & keys */
+#define IMS_NUM_STAGES          4
+#define IMS_NUM_WORKER_STAGES   3   /* Stages run by the jobs' worker threads */
 
 /**
  * @brief Initialize the IMS generation subsystem
@@ -47,6 +56,12 @@
  * @param prng_seed_string Raw seed string
  * @param ims_filename The name of the IMS output file
  * @param database_name The name of the certificate database
+ * @param db_batch_size The number of keysets to write per database
+ *        transaction
+ * @param db_wal If true, put the key database in WAL mode
+ * @param format The IMS file format (IMS_FORMAT_xxx)
+ * @param resume If true, continue the run recorded by the database's
+ *        checkpoint, truncating the IMS file to match (see ims_set_run)
  *
  * @note One and only 1 of prng_seed_file and prng_seed_string must be used.
  *
@@ -55,7 +70,28 @@
 int ims_init(const char * prng_seed_file,
              const char * prng_seed_string,
              const char * ims_filename,
-             const char * database_name);
+             const char * database_name,
+             uint32_t db_batch_size,
+             bool db_wal,
+             int format,
+             bool resume);
+
+
+/**
+ * @brief Set the range of IMS indices being generated
+ *
+ * The range is recorded in each checkpoint. When resuming, it must match
+ * the range of the checkpointed run.
+ *
+ * @param first_index The (zero-based) index of the first IMS of the run
+ * @param num_ims The number of IMS values in the run
+ * @param next_index Set to the index of the next IMS to generate
+ *        (first_index, unless resuming)
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_set_run(uint32_t first_index, uint32_t num_ims,
+                uint32_t * next_index);
 
 
 /**
@@ -65,6 +101,76 @@ int ims_init(const char * prng_seed_file,
  * the generated EPVK, ERPK and ESVK keys in the key
  * database.
  *
+ * @param index The (zero-based) index of the IMS value, which selects its
+ *        PRNG streams (see ims_context_seed)
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14 (continuing the single legacy PRNG stream,
+ *        so index is ignored). If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_generate(uint32_t index, bool ims_sample_compatibility);
+
+
+/**
+ * @brief IMS generation stage 1: draw a candidate IMS value
+ *
+ * Draws the next candidate IMS from the context's PRNG and calculates its
+ * EP_UID and "Y2".
+ *
+ * @param ctx The generation context
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14. If false, generate the IMS value using
+ *        the correct form.
+ */
+void ims_stage_candidate(struct ims_context * ctx,
+                         bool ims_sample_compatibility);
+
+
+/**
+ * @brief IMS generation stage 2: search for the ERRK primes
+ *
+ * @param ctx The generation context, holding a candidate from stage 1
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14. If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, non-zero if the candidate must be discarded
+ *          (and a new one drawn by stage 1).
+ */
+int ims_stage_errk(struct ims_context * ctx, bool ims_sample_compatibility);
+
+
+/**
+ * @brief IMS generation stage 3: derive the ECC keys
+ *
+ * @param ctx The generation context, holding a candidate which passed
+ *        stage 2
+ * @param ims_sample_compatibility If true, generate IMS values that are
+ *        compatible with the original (incorrect) 100 sample values sent
+ *        to Toshiba 2016/01/14. If false, generate the IMS value using
+ *        the correct form.
+ *
+ * @returns Zero if successful, non-zero if the candidate must be discarded
+ *          (and a new one drawn by stage 1).
+ */
+int ims_stage_ecc(struct ims_context * ctx, bool ims_sample_compatibility);
+
+
+/**
+ * @brief Generate an IMS value and its keys into a context
+ *
+ * Generates a cryptographically good IMS value with a unique EP_UID, along
+ * with the EPVK, ERPK and ESVK keys derived from it. Candidates whose EP_UID
+ * is taken are redrawn before the ERRK search (see ims_is_unique). Only the
+ * context is written to (the database is only read), so several contexts
+ * may be worked on concurrently.
+ *
+ * @param ctx The generation context
  * @param ims_sample_compatibility If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, generate the IMS value using
@@ -72,7 +178,49 @@ int ims_init(const char * prng_seed_file,
  *
  * @returns Zero if successful, errno otherwise.
  */
-int ims_generate(bool ims_sample_compatibility);
+int ims_generate_one(struct ims_context * ctx, bool ims_sample_compatibility);
+
+
+/**
+ * @brief Check EP_UIDs against those of historical key databases
+ *
+ * Loads an EP_UID filter built by imsgen_filter. Generated EP_UIDs which
+ * the filter (probably) contains are rejected by ims_is_unique, so a false
+ * positive only costs drawing another candidate.
+ *
+ * @param filter_filename The name of the EP_UID filter file
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_set_uid_filter(const char * filter_filename);
+
+
+/**
+ * @brief Check whether a candidate IMS is unique
+ *
+ * Called on each candidate as soon as its EP_UID is known, so that taken
+ * EP_UIDs are rejected before the ERRK search. The key database is only
+ * read, so worker threads may call this while the sink stores keysets.
+ *
+ * @param ctx The generation context holding the candidate
+ *
+ * @returns True if the EP_UID is neither in the EP_UID filter (if any) nor
+ *          in the key database.
+ */
+bool ims_is_unique(struct ims_context * ctx);
+
+
+/**
+ * @brief Store a generated IMS value
+ *
+ * Writes the IMS value to the IMS file and the various keys and magic
+ * numbers to the database.
+ *
+ * @param ctx The generation context holding the IMS and keys
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_store(struct ims_context * ctx);
 
 
 /**
@@ -64,6 +64,7 @@
 #include "db.h"
 #include "ims_common.h"
 #include "ims.h"
+#include "ims_mcl.h"
 
 /* Uncomment the following define to enable IMS diagnostic messages */
 /*#define IMS_DEBUGMSG*/
@@ -78,6 +79,10 @@
 uint8_t  prng_seed_buffer[EVP_MAX_MD_SIZE];
 mcl_octet prng_seed = {0, sizeof(prng_seed_buffer), prng_seed_buffer};
 
+/* Per-index PRNG stream purposes (see ims_context_seed) */
+#define IMS_STREAM_CANDIDATE    0
+#define IMS_STREAM_WITNESS      1
+
 
 /* Cryptographically Secure Random Number Generator */
 csprng  rng;        /* Generic */
@@ -149,6 +154,19 @@ MCL_rsa_public_key  rsa_public;
 static int get_prng_seed(const char * prng_seed_file,
                   const char * prng_seed_string);
 
+/**
+ * Full public key validation (including the multiplication by the group
+ * order) for EPVK/ESVK. Off for generation, since the keys are derived
+ * from the curve generator; see ims_set_key_validation.
+ */
+static bool full_key_validation = false;
+
+/**
+ * Probable prime test profile (MCL_FF_PRIME_xxx) given to new contexts for
+ * the production ERRK P & Q search; see ims_set_prime_test.
+ */
+static int prime_test_profile = MCL_FF_PRIME_BPSW;
+
 
 /**
  * @brief Perform any common IMS initialization
@@ -168,10 +186,61 @@ int ims_common_init(const char * prng_seed_file,
         MCL_RAND_seed(&rng, prng_seed.len, prng_seed.val);
     }
 
+    /*
+     * Pick the FF Montgomery backend (the C25519 copy serves both the ERRK
+     * search and RSA2048) while still single-threaded.
+     */
+    MCL_FF_backend_init_C25519();
+
+    /*
+     * Build the fixed-base generator tables used by calc_epvk/calc_esvk.
+     * They are shared read-only by the worker threads, so this must happen
+     * before any of them start.
+     */
+    MCL_ECP_generator_precompute_C448();
+    MCL_ECP_generator_precompute_C25519();
+
     return status;
 }
 
 
+/**
+ * @brief Select how thoroughly calc_epvk/calc_esvk validate their keys
+ *
+ * By default, freshly derived keys only get a sanity check: coordinates
+ * in range, on the curve and not the identity. Full validation adds the
+ * multiplication by the group order, which is redundant for keys derived
+ * from the curve generator but is useful when auditing.
+ *
+ * @param full If true, perform full public key validation
+ *
+ * @note Not thread-safe; set before starting any worker threads.
+ */
+void ims_set_key_validation(bool full) {
+    full_key_validation = full;
+}
+
+
+/**
+ * @brief Select the probable prime test for the ERRK P & Q search
+ *
+ * By default, production contexts use MCL_FF_PRIME_BPSW: a base 2
+ * Miller-Rabin round (which rejects nearly every composite), a strong Lucas
+ * test, and then only a couple of random base rounds. MCL_FF_PRIME_MR is
+ * the original 10 random base rounds, kept for regression comparison; both
+ * find the same primes. The legacy sample stream always uses
+ * MCL_FF_PRIME_MR, since its witnesses come from the IMS stream.
+ *
+ * @param profile MCL_FF_PRIME_BPSW or MCL_FF_PRIME_MR
+ *
+ * @note Applies to contexts initialized afterwards; not thread-safe, so set
+ *       before starting any worker threads.
+ */
+void ims_set_prime_test(int profile) {
+    prime_test_profile = profile;
+}
+
+
 /**
  * @brief Perform any common IMS de-initialization
  */
@@ -181,6 +250,111 @@ void ims_common_deinit(void) {
 }
 
 
+/**
+ * @brief Initialize an IMS generation context
+ *
+ * Clears the working set and binds the context's octets to its buffers.
+ *
+ * @param ctx The context to initialize
+ */
+void ims_context_init(ims_context * ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->ep_uid.max = sizeof(ctx->ep_uid_buf);
+    ctx->ep_uid.val = (char *)ctx->ep_uid_buf;
+    ctx->epsk.max = sizeof(ctx->epsk_buf);
+    ctx->epsk.val = (char *)ctx->epsk_buf;
+    ctx->epvk.max = sizeof(ctx->epvk_buf);
+    ctx->epvk.val = (char *)ctx->epvk_buf;
+    ctx->essk.max = sizeof(ctx->essk_buf);
+    ctx->essk.val = (char *)ctx->essk_buf;
+    ctx->esvk.max = sizeof(ctx->esvk_buf);
+    ctx->esvk.val = (char *)ctx->esvk_buf;
+    ctx->errk_p.max = sizeof(ctx->errk_p_buf);
+    ctx->errk_p.val = (char *)ctx->errk_p_buf;
+    ctx->errk_q.max = sizeof(ctx->errk_q_buf);
+    ctx->errk_q.val = (char *)ctx->errk_q_buf;
+    ctx->erpk_mod.max = sizeof(ctx->erpk_mod_buf);
+    ctx->erpk_mod.val = (char *)ctx->erpk_mod_buf;
+    ctx->errk_d.max = sizeof(ctx->errk_d_buf);
+    ctx->errk_d.val = (char *)ctx->errk_d_buf;
+
+    ctx->prime_rng = &ctx->rng;
+    ctx->prime_test = prime_test_profile;
+}
+
+
+/**
+ * @brief Seed a per-index PRNG stream
+ *
+ * The stream is seeded with (master seed || index || purpose), with the
+ * index as a big-endian 32-bit number.
+ *
+ * @param rng The PRNG to seed
+ * @param index The (zero-based) IMS index
+ * @param purpose Which of the IMS_STREAM_xxx streams for that index
+ */
+static void ims_rng_seed_index(csprng * rng, uint32_t index,
+                               uint8_t purpose) {
+    char     stream_seed_buf[EVP_MAX_MD_SIZE + sizeof(uint32_t) + 1];
+    mcl_octet stream_seed = {0, sizeof(stream_seed_buf), stream_seed_buf};
+
+    MCL_OCT_copy(&stream_seed, &prng_seed);
+    MCL_OCT_jint(&stream_seed, index, sizeof(uint32_t));
+    MCL_OCT_jbyte(&stream_seed, purpose, 1);
+    MCL_RAND_seed(rng, stream_seed.len, stream_seed.val);
+}
+
+
+/**
+ * @brief Seed a context with the PRNG streams for one IMS index
+ *
+ * Each IMS index gets its own pair of streams derived from the master
+ * seed (one for the IMS candidates, one for the primality test witnesses),
+ * so IMS N is the same no matter which thread or host generates it, and
+ * no matter how many primality tests earlier IMS values needed.
+ *
+ * @param ctx The context to seed
+ * @param index The (zero-based) IMS index
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_context_seed(ims_context * ctx, uint32_t index) {
+    ctx->index = index;
+    ims_rng_seed_index(&ctx->rng, index, IMS_STREAM_CANDIDATE);
+    ims_rng_seed_index(&ctx->witness_rng, index, IMS_STREAM_WITNESS);
+    ctx->prime_rng = &ctx->witness_rng;
+}
+
+
+/**
+ * @brief Seed a context with the single legacy PRNG stream
+ *
+ * The legacy stream is seeded directly from the master seed and is used
+ * for both IMS candidates and primality testing, exactly as the original
+ * 100 IMS samples were generated. It can only be consumed sequentially.
+ *
+ * @param ctx The context to seed
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_context_seed_legacy(ims_context * ctx) {
+    MCL_RAND_seed(&ctx->rng, prng_seed.len, prng_seed.val);
+    ctx->prime_rng = &ctx->rng;
+}
+
+
+/**
+ * @brief De-initialize an IMS generation context
+ *
+ * @param ctx The context to clean up
+ */
+void ims_context_deinit(ims_context * ctx) {
+    MCL_RAND_clean(&ctx->rng);
+    MCL_RAND_clean(&ctx->witness_rng);
+}
+
+
 /**
  * @brief Parse a raw seed string
  *
@@ -256,6 +430,39 @@ void sha256_concat(uint8_t * digest_x,
 }
 
 
+/**
+ * @brief Implement several "X[i] = sha256(Y || copy(b[i], n))" operations
+ *
+ * The terms only differ in their extension byte, so they are hashed as one
+ * batch (see hash_it_batch).
+ *
+ * @param digest_x Pointers to the output digest buffers ("X[i]" above)
+ * @param hash_y Pointer to the input digest ("Y" above)
+ * @param extend_bytes The extension bytes ("b[i]" above)
+ * @param count The number of terms (at most SHA256_CONCAT_BATCH_MAX)
+ * @param extend_count The numnnber of exension bytes to concatenate ("n" above)
+ */
+void sha256_concat_batch(uint8_t * const * digest_x,
+                         uint8_t * hash_y,
+                         const uint8_t * extend_bytes,
+                         int count,
+                         uint32_t extend_count) {
+    /* Scratch buffers for generating terms to feed sha256 */
+    uint8_t scratch_buf[SHA256_CONCAT_BATCH_MAX][256];
+    const uint8_t * scratch[SHA256_CONCAT_BATCH_MAX];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(scratch_buf[i], hash_y, SHA256_HASH_DIGEST_SIZE);
+        memset(&scratch_buf[i][SHA256_HASH_DIGEST_SIZE], extend_bytes[i],
+               extend_count);
+        scratch[i] = scratch_buf[i];
+    }
+    hash_it_batch(count, scratch, SHA256_HASH_DIGEST_SIZE + extend_count,
+                  digest_x);
+}
+
+
 /**
  * @brief Calculate the EP_UID from the IMS (ES3 version)
  *
@@ -311,9 +518,9 @@ void calculate_epuid(uint8_t * ims_value,
                      mcl_octet * ep_uid) {
     /* same code used in ES3 boot ROM to generate the EUID */
     int i;
-    static uint8_t ep_uid_calc[SHA256_HASH_DIGEST_SIZE];
-    static uint8_t y1[SHA256_HASH_DIGEST_SIZE];
-    static uint8_t z0[SHA256_HASH_DIGEST_SIZE];
+    uint8_t ep_uid_calc[SHA256_HASH_DIGEST_SIZE];
+    uint8_t y1[SHA256_HASH_DIGEST_SIZE];
+    uint8_t z0[SHA256_HASH_DIGEST_SIZE];
     uint32_t temp;
     uint32_t *pims = (uint32_t *)ims_value;
 
@@ -370,6 +577,8 @@ void calculate_y2(uint8_t * ims_value, uint8_t * y2) {
 void calc_epsk(uint8_t * y2, mcl_octet * epsk) {
     uint8_t z1[SHA256_HASH_DIGEST_SIZE];
     uint8_t scratch_hash[SHA256_HASH_DIGEST_SIZE];
+    uint8_t * const epsk_halves[2] = { (uint8_t *)&epsk->val[0], scratch_hash };
+    static const uint8_t epsk_extend[2] = { 0x01, 0x02 };
     int status;
 
     /**
@@ -380,10 +589,7 @@ void calc_epsk(uint8_t * y2, mcl_octet * epsk) {
      */
     sha256_concat(z1, y2, 0x01, 32);
 
-    sha256_concat(scratch_hash, z1, 0x01, 32);
-    memcpy(&epsk->val[0], scratch_hash, SHA256_HASH_DIGEST_SIZE);
-
-    sha256_concat(scratch_hash, z1, 0x02, 32);
+    sha256_concat_batch(epsk_halves, z1, epsk_extend, 2, 32);
     memcpy(&epsk->val[SHA256_HASH_DIGEST_SIZE],
            scratch_hash,
            (EPSK_SIZE - SHA256_HASH_DIGEST_SIZE));
@@ -407,7 +613,7 @@ int calc_epvk(mcl_octet * epsk, mcl_octet * epvk) {
 
     /* Generate the corresponding EPVK public key, an Ed448-Goldilocks ECC */
     MCL_ECP_KEY_PAIR_GENERATE_C448(NULL, epsk, epvk);
-    status = MCL_ECP_PUBLIC_KEY_VALIDATE_C448(1, epvk);
+    status = MCL_ECP_PUBLIC_KEY_VALIDATE_C448(full_key_validation, epvk);
     if (status != 0) {
         printf("EPVK is invalid!\r\n");
     }
@@ -473,7 +679,7 @@ int calc_esvk(mcl_octet * essk, mcl_octet * esvk) {
 
     /* Generate the corresponding EPVK public key, a djb25519 ECC */
     MCL_ECP_KEY_PAIR_GENERATE_C25519(NULL, essk, esvk);
-    status = MCL_ECP_PUBLIC_KEY_VALIDATE_C25519(1, esvk);
+    status = MCL_ECP_PUBLIC_KEY_VALIDATE_C25519(full_key_validation, esvk);
     if (status != 0) {
         printf("EPVK is invalid!\r\n");
     }
@@ -509,6 +715,15 @@ void calc_errk_pq_bias_odd(uint8_t * y2,
                            bool ims_sample_compatibility) {
     int status = 0;
     uint8_t z3[SHA256_HASH_DIGEST_SIZE];
+    uint8_t * const errk_pq_quarters[8] = {
+        (uint8_t *)&errk_p->val[0], (uint8_t *)&errk_p->val[32],
+        (uint8_t *)&errk_p->val[64], (uint8_t *)&errk_p->val[96],
+        (uint8_t *)&errk_q->val[0], (uint8_t *)&errk_q->val[32],
+        (uint8_t *)&errk_q->val[64], (uint8_t *)&errk_q->val[96]
+    };
+    static const uint8_t errk_pq_extend[8] = {
+        0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08
+    };
     uint8_t odd_mod_bitmask;
     int pq_len;
 
@@ -537,15 +752,6 @@ void calc_errk_pq_bias_odd(uint8_t * y2,
      *  ERRK_P[32:63] = sha256(Z3 || copy(0x02, 32))
      *  ERRK_P[64:95] = sha256(Z3 || copy(0x03, 32))
      *  ERRK_P[96:127] = sha256(Z3 || copy(0x41, 32))
-     *   :
-     */
-    sha256_concat(&errk_p->val[0],  z3, 0x01, 32);
-    sha256_concat(&errk_p->val[32], z3, 0x02, 32);
-    sha256_concat(&errk_p->val[64], z3, 0x03, 32);
-    sha256_concat(&errk_p->val[96], z3, 0x04, 32);
-    errk_p->len = pq_len;
-
-    /**
      *   :
      *  ERRK_Q[0:31] = sha256(Z3 || copy(0x05, 32))
      *  ERRK_Q[32:63] = sha256(Z3 || copy(0x06, 32))
@@ -553,10 +759,8 @@ void calc_errk_pq_bias_odd(uint8_t * y2,
      *  ERRK_Q[96:127] = sha256(Z3 || copy(0x8, 32))
      *   :
      */
-    sha256_concat(&errk_q->val[0],  z3, 0x05, 32);
-    sha256_concat(&errk_q->val[32], z3, 0x06, 32);
-    sha256_concat(&errk_q->val[64], z3, 0x07, 32);
-    sha256_concat(&errk_q->val[96], z3, 0x08, 32);
+    sha256_concat_batch(errk_pq_quarters, z3, errk_pq_extend, 8, 32);
+    errk_p->len = pq_len;
     errk_q->len = pq_len;
 
     /* Force P, Q to be suitably odd */
@@ -609,7 +813,7 @@ void reverse_buf(uint8_t *buf, size_t length) {
 void ff_from_little_endian_octet(mcl_chunk ff[][MCL_BS],
                                  mcl_octet * octet,
                                  int n) {
-    static uint8_t scratch_buf[1024];
+    uint8_t scratch_buf[1024];
     mcl_octet scratch = {0, sizeof(scratch_buf), scratch_buf};
     int i, j;
 
@@ -644,8 +848,8 @@ void rsa_secret(MCL_rsa_private_key *PRIV,
                 sign32 e,
                 bool ims_sample_compatibility) { /* IEEE1363 A16.11/A16.12 more or less */
     /**
-     * Note: PRIV FF's are[MCL_FFLEN/2][MCL_NLEN] = [4][5]
-     * internal chunks are[MCL_HFLEN][MCL_BS]     = [4][5]
+     * Note: PRIV FF's are[MCL_FFLEN/2][MCL_NLEN] = [4][9]
+     * internal chunks are[MCL_HFLEN][MCL_BS]     = [4][9]
      * so no size mismatch occurs.
      */
     mcl_chunk t[MCL_HFLEN][MCL_BS];
@@ -712,8 +916,8 @@ void rsa_secret(MCL_rsa_private_key *PRIV,
  */
 #define MSB_FIRST
 void print_ff(char * title, mcl_chunk ff[][MCL_BS], int n) {
-    static uint8_t buf[2048];
-    static mcl_octet temp = {0, sizeof(buf), buf};
+    uint8_t buf[2048];
+    mcl_octet temp = {0, sizeof(buf), buf};
 
     if (!title) {
         title = "";
@@ -828,3 +1032,142 @@ int ims_read(int fd, off_t offset, uint8_t * ims) {
 #endif
     return status;
 }
+
+
+/**
+ * @brief Store a 32-bit little-endian value
+ *
+ * @param buf Where to store the value
+ * @param value The value to store
+ */
+static void put_le32(uint8_t * buf, uint32_t value) {
+    buf[0] = (uint8_t)value;
+    buf[1] = (uint8_t)(value >> 8);
+    buf[2] = (uint8_t)(value >> 16);
+    buf[3] = (uint8_t)(value >> 24);
+}
+
+
+/**
+ * @brief Fetch a 32-bit little-endian value
+ *
+ * @param buf Where to read the value from
+ *
+ * @returns The value
+ */
+static uint32_t get_le32(const uint8_t * buf) {
+    return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+           ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+
+/**
+ * @brief Calculate the CRC-32 (IEEE 802.3) of a buffer
+ *
+ * @param buf The data to check
+ * @param len The length of buf in bytes
+ *
+ * @returns The CRC
+ */
+uint32_t ims_crc32(const uint8_t * buf, size_t len) {
+    uint32_t crc = 0xffffffff;
+    int bit;
+
+    /* Bitwise: records are short, and this needs no (shared) table */
+    while (len--) {
+        crc ^= *buf++;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 1)? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+
+/**
+ * @brief Calculate the fingerprint of the PRNG seed
+ *
+ * Identifies the seed an IMS file was generated from, without revealing it.
+ *
+ * @param fingerprint Where to store the IMS_BIN_FINGERPRINT_SIZE-byte
+ *        fingerprint
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_seed_fingerprint(uint8_t fingerprint[IMS_BIN_FINGERPRINT_SIZE]) {
+    uint8_t digest[SHA256_HASH_DIGEST_SIZE];
+
+    hash_it((uint8_t *)prng_seed.val, prng_seed.len, digest);
+    memcpy(fingerprint, digest, IMS_BIN_FINGERPRINT_SIZE);
+}
+
+
+/**
+ * @brief Build a binary IMS file header
+ *
+ * @param header Where to build the IMS_BIN_HEADER_SIZE-byte header
+ * @param num_ims The number of IMS records which follow the header
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_bin_header(uint8_t header[IMS_BIN_HEADER_SIZE], uint32_t num_ims) {
+    memcpy(&header[0], IMS_BIN_MAGIC, 4);
+    put_le32(&header[4], IMS_BIN_VERSION);
+    put_le32(&header[8], num_ims);
+    put_le32(&header[12], 0);
+    ims_seed_fingerprint(&header[16]);
+}
+
+
+/**
+ * @brief Parse a binary IMS file header
+ *
+ * @param header The IMS_BIN_HEADER_SIZE-byte header
+ * @param num_ims Where to store the IMS count
+ * @param fingerprint Where to store the PRNG seed fingerprint
+ *
+ * @returns Zero if successful, EINVAL if this isn't a binary IMS file.
+ */
+int ims_bin_parse_header(const uint8_t header[IMS_BIN_HEADER_SIZE],
+                         uint32_t * num_ims,
+                         uint8_t fingerprint[IMS_BIN_FINGERPRINT_SIZE]) {
+    if ((memcmp(&header[0], IMS_BIN_MAGIC, 4) != 0) ||
+        (get_le32(&header[4]) != IMS_BIN_VERSION)) {
+        return EINVAL;
+    }
+    *num_ims = get_le32(&header[8]);
+    memcpy(fingerprint, &header[16], IMS_BIN_FINGERPRINT_SIZE);
+    return 0;
+}
+
+
+/**
+ * @brief Build a binary IMS file record
+ *
+ * @param record Where to build the IMS_BIN_RECORD_SIZE-byte record
+ * @param ims The IMS value
+ */
+void ims_bin_record(uint8_t record[IMS_BIN_RECORD_SIZE],
+                    const uint8_t ims[IMS_SIZE]) {
+    memcpy(record, ims, IMS_SIZE);
+    put_le32(&record[IMS_SIZE], ims_crc32(ims, IMS_SIZE));
+}
+
+
+/**
+ * @brief Parse a binary IMS file record
+ *
+ * @param record The IMS_BIN_RECORD_SIZE-byte record
+ * @param ims Where to store the IMS value
+ *
+ * @returns Zero if successful, EIO if the record's CRC doesn't match.
+ */
+int ims_bin_parse_record(const uint8_t record[IMS_BIN_RECORD_SIZE],
+                         uint8_t ims[IMS_SIZE]) {
+    if (get_le32(&record[IMS_SIZE]) != ims_crc32(record, IMS_SIZE)) {
+        fprintf(stderr, "ERROR: IMS record fails its CRC check\n");
+        return EIO;
+    }
+    memcpy(ims, record, IMS_SIZE);
+    return 0;
+}
@@ -90,6 +90,23 @@ uint8_t  ims[IMS_SIZE];
 #define IMS_BINASCII_SIZE   (IMS_SIZE * BITS_PER_BYTE)
 #define IMS_LINE_SIZE       (IMS_BINASCII_SIZE + 1)
 
+/* IMS file formats (imsgen --format) */
+#define IMS_FORMAT_TEXT     0   /* IMS_LINE_SIZE-byte binascii lines */
+#define IMS_FORMAT_BIN      1   /* Binary header and records (see below) */
+
+/**
+ * Binary IMS files are an IMS_BIN_HEADER_SIZE-byte header followed by one
+ * IMS_BIN_RECORD_SIZE-byte record per IMS, all fields little-endian:
+ *      header: magic (4), version (4), IMS count (4), reserved (4),
+ *              PRNG seed fingerprint (16)
+ *      record: IMS (IMS_SIZE, ims[0] first), CRC-32 of the IMS (4)
+ */
+#define IMS_BIN_MAGIC               "IMSB"
+#define IMS_BIN_VERSION             1
+#define IMS_BIN_FINGERPRINT_SIZE    16
+#define IMS_BIN_HEADER_SIZE         32
+#define IMS_BIN_RECORD_SIZE         (IMS_SIZE + 4)
+
 /**
  * 24-bit P&Q bias field, divided evenly into 12 bit fields for each of P & Q bias
  */
@@ -158,6 +175,65 @@ mcl_chunk q_ff[MCL_HFLEN][MCL_BS];
 MCL_rsa_private_key rsa_private;
 MCL_rsa_public_key  rsa_public;
 
+/*
+ * The RSA2048 functions are built into the C25519 curve library (see
+ * MIRACL_cfg/config.mk), whose layout imsgen is built with, so octets
+ * passed to them are MCL_RFS bytes.
+ */
+#define RSA_OCTET_SIZE      MCL_RFS
+
+
+/**
+ * IMS generation context
+ *
+ * The complete per-IMS working set (PRNG stream, IMS, intermediate hashes,
+ * keys and FF scratch). Each generator thread owns one of these so that
+ * several IMS values can be worked on at once without sharing state.
+ *
+ * The mcl_octets point into the buffers of the same context, so a context
+ * must be set up in place with ims_context_init() and never struct-copied.
+ */
+typedef struct ims_context {
+    /* Cryptographically Secure Random Number Generators for this context */
+    csprng    rng;          /* IMS candidates */
+    csprng    witness_rng;  /* Primality test witnesses (per-index streams) */
+    csprng *  prime_rng;    /* Whichever of the above primality tests use */
+    uint32_t  index;        /* The IMS index the streams were seeded for */
+    uint32_t  prime_tests;  /* Primality tests run for the current IMS */
+    int       prime_test;   /* MCL_FF_PRIME_xxx test for production ERRKs */
+
+    uint8_t   ims[IMS_SIZE];
+    uint8_t   y2[Y2_SIZE];
+
+    uint8_t   ep_uid_buf[EP_UID_SIZE];
+    mcl_octet ep_uid;
+
+    uint8_t   epsk_buf[EPSK_SIZE];
+    mcl_octet epsk;
+    uint8_t   epvk_buf[EPVK_SIZE];
+    mcl_octet epvk;
+
+    uint8_t   essk_buf[ESSK_SIZE];
+    mcl_octet essk;
+    uint8_t   esvk_buf[ESVK_SIZE];
+    mcl_octet esvk;
+
+    uint8_t   errk_p_buf[ERRK_PQ_SIZE];
+    mcl_octet errk_p;
+    uint8_t   errk_q_buf[ERRK_PQ_SIZE];
+    mcl_octet errk_q;
+    uint8_t   erpk_mod_buf[ERRK_PQ_SIZE * 2];
+    mcl_octet erpk_mod;
+    uint8_t   errk_d_buf[RSA2048_PUBLIC_KEY_SIZE];
+    mcl_octet errk_d;
+
+    mcl_chunk p_ff[MCL_HFLEN][MCL_BS];
+    mcl_chunk q_ff[MCL_HFLEN][MCL_BS];
+
+    MCL_rsa_private_key rsa_private;
+    MCL_rsa_public_key  rsa_public;
+} ims_context;
+
 
 /**
  * @brief Perform any common IMS initialization
@@ -171,12 +247,85 @@ int ims_common_init(const char * prng_seed_file,
                     const char * prng_seed_string);
 
 
+/**
+ * @brief Select how thoroughly calc_epvk/calc_esvk validate their keys
+ *
+ * @param full If true, perform full public key validation (including the
+ *        multiplication by the group order), otherwise only check that
+ *        the key is on the curve and is not the identity
+ *
+ * @note Not thread-safe; set before starting any worker threads.
+ */
+void ims_set_key_validation(bool full);
+
+
+/**
+ * @brief Select the probable prime test for the ERRK P & Q search
+ *
+ * @param profile MCL_FF_PRIME_BPSW (the default) or MCL_FF_PRIME_MR (10
+ *        random base Miller-Rabin rounds). Legacy sample generation always
+ *        uses MCL_FF_PRIME_MR.
+ *
+ * @note Applies to contexts initialized afterwards; not thread-safe, so set
+ *       before starting any worker threads.
+ */
+void ims_set_prime_test(int profile);
+
+
 /**
  * @brief Perform any common IMS de-initialization
  */
 void ims_common_deinit(void);
 
 
+/**
+ * @brief Initialize an IMS generation context
+ *
+ * Clears the working set and binds the context's octets to its buffers.
+ *
+ * @param ctx The context to initialize
+ */
+void ims_context_init(ims_context * ctx);
+
+
+/**
+ * @brief Seed a context with the PRNG streams for one IMS index
+ *
+ * Each IMS index gets its own pair of streams derived from the master
+ * seed (one for the IMS candidates, one for the primality test witnesses),
+ * so IMS N is the same no matter which thread or host generates it, and
+ * no matter how many primality tests earlier IMS values needed.
+ *
+ * @param ctx The context to seed
+ * @param index The (zero-based) IMS index
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_context_seed(ims_context * ctx, uint32_t index);
+
+
+/**
+ * @brief Seed a context with the single legacy PRNG stream
+ *
+ * The legacy stream is seeded directly from the master seed and is used
+ * for both IMS candidates and primality testing, exactly as the original
+ * 100 IMS samples were generated. It can only be consumed sequentially.
+ *
+ * @param ctx The context to seed
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_context_seed_legacy(ims_context * ctx);
+
+
+/**
+ * @brief De-initialize an IMS generation context
+ *
+ * @param ctx The context to clean up
+ */
+void ims_context_deinit(ims_context * ctx);
+
+
 void MCL_FF_fromOctetRev(mcl_chunk x[][MCL_BS],mcl_octet *S,int n);
 
 
@@ -197,6 +346,28 @@ void sha256_concat(uint8_t * digest_x,
                    uint32_t extend_count);
 
 
+/* The most "X = sha256(Y || copy(b, n))" terms sha256_concat_batch makes */
+#define SHA256_CONCAT_BATCH_MAX 8
+
+/**
+ * @brief Implement several "X[i] = sha256(Y || copy(b[i], n))" operations
+ *
+ * The terms only differ in their extension byte, so they are hashed as one
+ * batch (see hash_it_batch).
+ *
+ * @param digest_x Pointers to the output digest buffers ("X[i]" above)
+ * @param hash_y Pointer to the input digest ("Y" above)
+ * @param extend_bytes The extension bytes ("b[i]" above)
+ * @param count The number of terms (at most SHA256_CONCAT_BATCH_MAX)
+ * @param extend_count The numnnber of exension bytes to concatenate ("n" above)
+ */
+void sha256_concat_batch(uint8_t * const * digest_x,
+                         uint8_t * hash_y,
+                         const uint8_t * extend_bytes,
+                         int count,
+                         uint32_t extend_count);
+
+
 /**
  * @brief Calculate the EP_UID from the IMS (ES3 version)
  *
@@ -399,4 +570,75 @@ int ims_parse(const char * binascii_buf, uint8_t ims[IMS_SIZE]);
  */
 int ims_read(int fd, off_t offset, uint8_t * ims);
 
+
+/**
+ * @brief Calculate the CRC-32 (IEEE 802.3) of a buffer
+ *
+ * @param buf The data to check
+ * @param len The length of buf in bytes
+ *
+ * @returns The CRC
+ */
+uint32_t ims_crc32(const uint8_t * buf, size_t len);
+
+
+/**
+ * @brief Calculate the fingerprint of the PRNG seed
+ *
+ * Identifies the seed an IMS file was generated from, without revealing it.
+ *
+ * @param fingerprint Where to store the IMS_BIN_FINGERPRINT_SIZE-byte
+ *        fingerprint
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_seed_fingerprint(uint8_t fingerprint[IMS_BIN_FINGERPRINT_SIZE]);
+
+
+/**
+ * @brief Build a binary IMS file header
+ *
+ * @param header Where to build the IMS_BIN_HEADER_SIZE-byte header
+ * @param num_ims The number of IMS records which follow the header
+ *
+ * @note ims_common_init must have been called first.
+ */
+void ims_bin_header(uint8_t header[IMS_BIN_HEADER_SIZE], uint32_t num_ims);
+
+
+/**
+ * @brief Parse a binary IMS file header
+ *
+ * @param header The IMS_BIN_HEADER_SIZE-byte header
+ * @param num_ims Where to store the IMS count
+ * @param fingerprint Where to store the PRNG seed fingerprint
+ *
+ * @returns Zero if successful, EINVAL if this isn't a binary IMS file.
+ */
+int ims_bin_parse_header(const uint8_t header[IMS_BIN_HEADER_SIZE],
+                         uint32_t * num_ims,
+                         uint8_t fingerprint[IMS_BIN_FINGERPRINT_SIZE]);
+
+
+/**
+ * @brief Build a binary IMS file record
+ *
+ * @param record Where to build the IMS_BIN_RECORD_SIZE-byte record
+ * @param ims The IMS value
+ */
+void ims_bin_record(uint8_t record[IMS_BIN_RECORD_SIZE],
+                    const uint8_t ims[IMS_SIZE]);
+
+
+/**
+ * @brief Parse a binary IMS file record
+ *
+ * @param record The IMS_BIN_RECORD_SIZE-byte record
+ * @param ims Where to store the IMS value
+ *
+ * @returns Zero if successful, EIO if the record's CRC doesn't match.
+ */
+int ims_bin_parse_record(const uint8_t record[IMS_BIN_RECORD_SIZE],
+                         uint8_t ims[IMS_SIZE]);
+
 #endif /* !_IMS_COMMON_H */
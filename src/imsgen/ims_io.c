@@ -33,6 +33,8 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -62,6 +64,138 @@
 /*#define IMS_DEBUGMSG*/
 
 
+/**
+ * @brief Open an IMS file
+ *
+ * Maps the file and detects its format (text or binary) from its contents.
+ * The ims_file may be shared between threads.
+ *
+ * @param file The ims_file to initialize
+ * @param ims_filename The name of the IMS input file
+ *
+ * @returns 0 if successful, errno otherwise.
+ */
+int ims_file_open(ims_file * file, const char * ims_filename) {
+    int status = 0;
+    int fd;
+    struct stat ims_stat = {0};
+    void * map;
+    uint32_t num_records;
+
+    memset(file, 0, sizeof(*file));
+    fd = open(ims_filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: Can't open IMS file '%s'\n", ims_filename);
+        return errno;
+    }
+    if (fstat(fd, &ims_stat) != 0) {
+        status = errno;
+    } else if (ims_stat.st_size > 0) {
+        map = mmap(NULL, ims_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Can't map IMS file '%s' (err %d)\n",
+                    ims_filename, errno);
+            status = errno;
+        } else {
+            /* Samples are drawn at random, so don't bother reading ahead */
+            madvise(map, ims_stat.st_size, MADV_RANDOM);
+            file->map = map;
+            file->map_size = ims_stat.st_size;
+        }
+    }
+    /* The mapping stays valid without the descriptor */
+    close(fd);
+    if (status != 0) {
+        return status;
+    }
+
+    if ((file->map_size >= IMS_BIN_HEADER_SIZE) &&
+        (ims_bin_parse_header(file->map, &file->num_ims,
+                              file->fingerprint) == 0)) {
+        file->format = IMS_FORMAT_BIN;
+        file->records = file->map + IMS_BIN_HEADER_SIZE;
+        file->record_size = IMS_BIN_RECORD_SIZE;
+        num_records = (file->map_size - IMS_BIN_HEADER_SIZE) /
+                      IMS_BIN_RECORD_SIZE;
+        if (file->num_ims != num_records) {
+            /* e.g., imsgen didn't get to close the file */
+            fprintf(stderr,
+                    "Warning: IMS file header says %u IMS, file holds %u\n",
+                    file->num_ims, num_records);
+            file->num_ims = num_records;
+        }
+    } else {
+        file->format = IMS_FORMAT_TEXT;
+        file->records = file->map;
+        file->record_size = IMS_LINE_SIZE;
+        file->num_ims = file->map_size / IMS_LINE_SIZE;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Read the Nth IMS value from an IMS file
+ *
+ * @param file The open IMS file
+ * @param index Which IMS value to read (zero-based)
+ * @param ims Where to store the IMS
+ *
+ * @returns 0 if successful, errno otherwise.
+ */
+int ims_file_read(ims_file * file, uint32_t index, uint8_t ims[IMS_SIZE]) {
+    const uint8_t * record;
+
+    if (index >= file->num_ims) {
+        fprintf(stderr, "ERROR: IMS index %u is out of range 0..%u\n",
+                index, file->num_ims - 1);
+        return EINVAL;
+    }
+
+    record = file->records + (size_t)index * file->record_size;
+    if (file->format == IMS_FORMAT_BIN) {
+        return ims_bin_parse_record(record, ims);
+    } else {
+        return ims_parse((const char *)record, ims);
+    }
+}
+
+
+/**
+ * @brief Determine if an IMS file was generated from the current PRNG seed
+ *
+ * @param file The open IMS file
+ *
+ * @returns False if the file records a different seed, true otherwise
+ *          (text files don't record the seed).
+ */
+bool ims_file_seed_matches(ims_file * file) {
+    uint8_t fingerprint[IMS_BIN_FINGERPRINT_SIZE];
+
+    if (file->format != IMS_FORMAT_BIN) {
+        return true;
+    }
+    ims_seed_fingerprint(fingerprint);
+    return memcmp(fingerprint, file->fingerprint, sizeof(fingerprint)) == 0;
+}
+
+
+/**
+ * @brief Close an IMS file
+ *
+ * @param file The ims_file to close
+ */
+void ims_file_close(ims_file * file) {
+    if (file->map) {
+        munmap((void *)file->map, file->map_size);
+    }
+    file->map = NULL;
+    file->records = NULL;
+    file->num_ims = 0;
+}
+
+
 /**
  * @brief Determine how many IMS values are in an IMS file
  *
@@ -71,14 +205,12 @@
  *          Otherwise, a negative number.
  */
 int num_ims_in_file(const char * ims_filename) {
-    struct stat ims_stat = {0};
+    ims_file file;
     int num_ims = -1;
 
-    if (stat(ims_filename, &ims_stat) != 0) {
-        fprintf(stderr, "ERROR: Can't find IMS file '%s'\n", ims_filename);
-        num_ims = -1;
-    } else {
-        num_ims = ims_stat.st_size / (IMS_LINE_SIZE);
+    if (ims_file_open(&file, ims_filename) == 0) {
+        num_ims = file.num_ims;
+        ims_file_close(&file);
     }
 
     return num_ims;
@@ -92,7 +224,8 @@ int num_ims_in_file(const char * ims_filename) {
  * ignored. If ims_value is null, we use ims_filename and ims_index.
  *
  * @param ims_value (optional) The binascii string representation of the IMS
- * @param ims_filename (optional) The name of the IMS input file
+ * @param ims_filename (optional) The name of the IMS input file (text or
+ *        binary)
  * @param ims_index (optional) Which IMS value to use from ims_filename
  * @param ims Where to store the IMS
  *
@@ -103,6 +236,7 @@ int get_ims(const char * ims_binascii,
             const int    ims_index,
             uint8_t      ims[IMS_SIZE]) {
     int status = 0;
+    ims_file file;
 
     if (ims_binascii) {
         /* Parse the IMS from the string provided */
@@ -114,29 +248,20 @@ int get_ims(const char * ims_binascii,
         }
     } else {
         /* Extract the IMS from the Nth entry in the IMS file */
-        int  num_available_ims = num_ims_in_file(ims_filename);
-
-        if (num_available_ims <= 0) {
-            fprintf (stderr, "ERROR: No IMS in IMS file\n");
-        } else {
-            if ((ims_index < 0) ||(ims_index > num_available_ims)) {
+        status = ims_file_open(&file, ims_filename);
+        if (status == 0) {
+            if (file.num_ims == 0) {
+                fprintf (stderr, "ERROR: No IMS in IMS file\n");
+                status = -1;
+            } else if ((ims_index < 0) || ((uint32_t)ims_index >= file.num_ims)) {
                 fprintf(stderr,
                         "ERROR: ims-index must be in the range 0..%d\n",
-                        num_available_ims - 1);
+                        file.num_ims - 1);
                 status = EINVAL;
             } else {
-                int ims_fd;
-
-                off_t offset = ims_index * IMS_LINE_SIZE;
-                ims_fd = open(ims_filename, O_RDONLY);
-                if (ims_fd  == -1) {
-                    fprintf(stderr, "ERROR: Can't open IMS file '%s'\n", ims_filename);
-                    status = errno;
-                } else {
-                    status = ims_read(ims_fd, offset, ims);
-                    close(ims_fd);
-                }
+                status = ims_file_read(&file, ims_index, ims);
             }
+            ims_file_close(&file);
         }
     }
 
@@ -36,6 +36,67 @@
 #define _IMS_IO_H
 
 
+/**
+ * A read-only, memory-mapped view of an IMS file in either format (see
+ * ims_file_open). Records are only parsed when read, so any IMS value can
+ * be fetched in constant time without system calls.
+ */
+typedef struct {
+    const uint8_t * map;        /* The whole file */
+    size_t          map_size;
+    const uint8_t * records;    /* The first record */
+    size_t          record_size;
+    int             format;     /* IMS_FORMAT_xxx */
+    uint32_t        num_ims;
+    uint8_t         fingerprint[IMS_BIN_FINGERPRINT_SIZE];  /* (binary only) */
+} ims_file;
+
+
+/**
+ * @brief Open an IMS file
+ *
+ * Maps the file and detects its format (text or binary) from its contents.
+ * The ims_file may be shared between threads.
+ *
+ * @param file The ims_file to initialize
+ * @param ims_filename The name of the IMS input file
+ *
+ * @returns 0 if successful, errno otherwise.
+ */
+int ims_file_open(ims_file * file, const char * ims_filename);
+
+
+/**
+ * @brief Read the Nth IMS value from an IMS file
+ *
+ * @param file The open IMS file
+ * @param index Which IMS value to read (zero-based)
+ * @param ims Where to store the IMS
+ *
+ * @returns 0 if successful, errno otherwise.
+ */
+int ims_file_read(ims_file * file, uint32_t index, uint8_t ims[IMS_SIZE]);
+
+
+/**
+ * @brief Determine if an IMS file was generated from the current PRNG seed
+ *
+ * @param file The open IMS file
+ *
+ * @returns False if the file records a different seed, true otherwise
+ *          (text files don't record the seed).
+ */
+bool ims_file_seed_matches(ims_file * file);
+
+
+/**
+ * @brief Close an IMS file
+ *
+ * @param file The ims_file to close
+ */
+void ims_file_close(ims_file * file);
+
+
 /**
  * @brief Determine how many IMS values are in an IMS file
  *
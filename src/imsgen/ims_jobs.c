@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the multi-threaded IMS generation pipeline
+ * used by "imsgen".
+ *
+ * IMS generation is split into stages: candidate generation, the ERRK
+ * prime search, ECC key derivation and the output/DB sink. The work items
+ * are slots, each slot holding a complete ims_context for one IMS index.
+ * Slots move between the worker stages through bounded lock-free queues
+ * (see ims_queue.c); any worker will run any stage, taking the cheap
+ * stages first, so candidates are always ready for the prime search and
+ * finished IMS values never wait behind it. The calling thread is the
+ * sink: it takes the finished slots in index order, so the IMS file and
+ * the database are only ever touched from one thread.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <openssl/evp.h>
+#include "util.h"
+#include "mcl_arch.h"
+#include "mcl_oct.h"
+#include "mcl_ecdh.h"
+#include "mcl_rand.h"
+#include "mcl_rsa.h"
+#include "crypto.h"
+#include "ims_common.h"
+#include "ims.h"
+#include "ims_queue.h"
+#include "ims_metrics.h"
+#include "ims_jobs.h"
+
+/* Number of slots per worker (bounds how far the pipeline can run ahead) */
+#define IMS_SLOTS_PER_JOB   4
+
+/* A slot in the pipeline (ready is accessed atomically) */
+typedef struct {
+    uint32_t    index;
+    bool        seeded;     /* False until ctx is seeded for index */
+    int         ready;      /* Holds a finished IMS for the sink */
+    ims_context ctx;
+} ims_slot;
+
+/*
+ * Per-stage pipeline counters (updated atomically). The items and time of
+ * each stage are counted by ims_metrics, for the serial path too.
+ */
+typedef struct {
+    uint64_t    discards;   /* Items sent back to the candidate stage */
+    uint64_t    depth_sum;  /* Sum of queue depths sampled on each push */
+    uint64_t    depth_samples;
+    uint32_t    depth_max;
+} ims_stage_stats;
+
+/* Shared pipeline state */
+static ims_slot *       slots;
+static uint32_t         num_slots;
+static ims_queue        queues[IMS_NUM_WORKER_STAGES];
+static sem_t            work_sem;   /* Posted once per queued item */
+static sem_t            sink_sem;   /* Posted once per finished slot */
+static int              jobs_stop;
+static uint32_t         sink_depth; /* Finished slots awaiting the sink */
+
+/* Statistics for the last run */
+static ims_stage_stats  stats[IMS_NUM_STAGES];
+static uint64_t         jobs_idle_ns;
+static uint64_t         sink_wait_ns;
+static uint64_t         run_ns;
+static uint32_t         run_jobs;
+static uint32_t         run_stored;
+
+
+/**
+ * @brief Record a queue depth sample for a stage
+ *
+ * @param stage The stage whose queue was sampled
+ * @param depth The depth of the queue
+ */
+static void ims_stats_depth(int stage, uint32_t depth) {
+    ims_stage_stats * stage_stats = &stats[stage];
+    uint32_t depth_max;
+
+    __atomic_fetch_add(&stage_stats->depth_sum, depth, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stage_stats->depth_samples, 1, __ATOMIC_RELAXED);
+    depth_max = __atomic_load_n(&stage_stats->depth_max, __ATOMIC_RELAXED);
+    while ((depth > depth_max) &&
+           !__atomic_compare_exchange_n(&stage_stats->depth_max, &depth_max,
+                                        depth, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+
+/**
+ * @brief Hand a slot on to a stage
+ *
+ * @param stage The stage to process the slot next
+ * @param slot_num The slot
+ */
+static void ims_pipeline_push(int stage, uint32_t slot_num) {
+    if (stage == IMS_STAGE_SINK) {
+        ims_stats_depth(stage, __atomic_add_fetch(&sink_depth, 1,
+                                                  __ATOMIC_RELAXED));
+        __atomic_store_n(&slots[slot_num].ready, 1, __ATOMIC_RELEASE);
+        sem_post(&sink_sem);
+    } else {
+        /* Can't fail: each queue can hold every slot */
+        ims_queue_push(&queues[stage], slot_num);
+        ims_stats_depth(stage, ims_queue_depth(&queues[stage]));
+        sem_post(&work_sem);
+    }
+}
+
+
+/**
+ * @brief Wait on a semaphore, ignoring signal interruptions
+ *
+ * @param sem The semaphore to wait on
+ */
+static void ims_sem_wait(sem_t * sem) {
+    while ((sem_wait(sem) != 0) && (errno == EINTR)) {
+        ;
+    }
+}
+
+
+/**
+ * @brief Run one worker stage on a slot and pass it on
+ *
+ * @param stage The stage to run
+ * @param slot_num The slot to run it on
+ */
+static void ims_run_stage(int stage, uint32_t slot_num) {
+    ims_slot * slot = &slots[slot_num];
+    int next_stage = IMS_STAGE_CANDIDATE;
+
+    switch (stage) {
+    case IMS_STAGE_CANDIDATE:
+        /* A slot starting a new index begins on that index's PRNG streams */
+        if (!slot->seeded) {
+            ims_context_seed(&slot->ctx, slot->index);
+            slot->seeded = true;
+        }
+        ims_stage_candidate(&slot->ctx, false);
+
+        /* A taken EP_UID goes straight back for another candidate */
+        if (ims_is_unique(&slot->ctx)) {
+            next_stage = IMS_STAGE_ERRK;
+        }
+        break;
+
+    case IMS_STAGE_ERRK:
+        if (ims_stage_errk(&slot->ctx, false) == 0) {
+            next_stage = IMS_STAGE_ECC;
+        }
+        break;
+
+    case IMS_STAGE_ECC:
+        if (ims_stage_ecc(&slot->ctx, false) == 0) {
+            next_stage = IMS_STAGE_SINK;
+        }
+        break;
+    }
+
+    if (next_stage == IMS_STAGE_CANDIDATE) {
+        __atomic_fetch_add(&stats[stage].discards, 1, __ATOMIC_RELAXED);
+    }
+
+    ims_pipeline_push(next_stage, slot_num);
+}
+
+
+/**
+ * @brief Worker thread body
+ *
+ * Waits for queued work and runs it, taking the items from the latest
+ * cheap stage first: ECC derivation (which feeds the sink), then candidate
+ * generation (which feeds the prime search), then the prime search.
+ *
+ * @param arg Unused
+ *
+ * @returns NULL
+ */
+static void * ims_worker_thread(void * arg) {
+    static const int stage_order[IMS_NUM_WORKER_STAGES] = {
+        IMS_STAGE_ECC, IMS_STAGE_CANDIDATE, IMS_STAGE_ERRK
+    };
+    uint64_t start;
+    uint32_t slot_num;
+    int i;
+
+    (void)arg;
+    for (;;) {
+        start = ims_metrics_now_ns();
+        ims_sem_wait(&work_sem);
+        __atomic_fetch_add(&jobs_idle_ns, ims_metrics_now_ns() - start,
+                           __ATOMIC_RELAXED);
+        if (__atomic_load_n(&jobs_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        /**
+         * The semaphore count guarantees an item is queued for us, though
+         * a racing worker may briefly hold the one we see - so rescan
+         */
+        for (i = 0; !ims_queue_pop(&queues[stage_order[i]], &slot_num);
+             i = (i + 1) % IMS_NUM_WORKER_STAGES) {
+            ;
+        }
+        ims_run_stage(stage_order[i], slot_num);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief Generate a batch of IMS values with a pipeline of worker threads
+ *
+ * Workers generate IMS values and keys into slots, each IMS from the PRNG
+ * streams for its index (see ims_context_seed). A single sink (the calling
+ * thread) takes the finished values in index order, checks them for
+ * uniqueness and stores them in the IMS file and key database. The output
+ * is therefore identical to that of a single-threaded run over the same
+ * indices, whatever the number of jobs.
+ *
+ * @param first_index The (zero-based) index of the first IMS to generate
+ * @param num_ims The number of IMS values to generate
+ * @param num_jobs The number of worker threads
+ * @param num_generated Set to the number of IMS values actually stored
+ *
+ * @note ims_init must have been called first. Only the production form
+ *       of IMS is supported (the legacy sample stream is sequential).
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_generate_jobs(uint32_t first_index,
+                      uint32_t num_ims,
+                      uint32_t num_jobs,
+                      uint32_t * num_generated) {
+    int status = 0;
+    pthread_t * workers = NULL;
+    uint32_t num_started = 0;
+    uint32_t num_queues = 0;
+    bool sems_ready = false;
+    uint64_t run_start = ims_metrics_now_ns();
+    uint64_t start;
+    ims_slot * slot;
+    uint32_t slot_num;
+    uint32_t last_index = first_index + num_ims;
+    uint32_t index;
+    uint32_t i;
+
+    *num_generated = 0;
+    if ((num_jobs < 1) || (num_jobs > IMS_JOBS_MAX)) {
+        return EINVAL;
+    }
+
+    memset(stats, 0, sizeof(stats));
+    jobs_idle_ns = 0;
+    sink_wait_ns = 0;
+    sink_depth = 0;
+    jobs_stop = 0;
+    run_jobs = num_jobs;
+    run_stored = 0;
+
+    num_slots = num_jobs * IMS_SLOTS_PER_JOB;
+    slots = calloc(num_slots, sizeof(*slots));
+    workers = calloc(num_jobs, sizeof(*workers));
+    if (!slots || !workers) {
+        fprintf(stderr, "ERROR: Can't allocate %u IMS jobs\n", num_jobs);
+        status = ENOMEM;
+        goto ims_generate_jobs_err;
+    }
+    for (num_queues = 0; num_queues < IMS_NUM_WORKER_STAGES; num_queues++) {
+        status = ims_queue_init(&queues[num_queues], num_slots);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Can't allocate IMS pipeline queues\n");
+            goto ims_generate_jobs_err;
+        }
+    }
+    if ((sem_init(&work_sem, 0, 0) != 0) || (sem_init(&sink_sem, 0, 0) != 0)) {
+        fprintf(stderr, "ERROR: Can't create IMS pipeline semaphores\n");
+        status = errno;
+        goto ims_generate_jobs_err;
+    }
+    sems_ready = true;
+    for (i = 0; i < num_slots; i++) {
+        ims_context_init(&slots[i].ctx);
+    }
+
+    /* Prime the pipeline with the first indices */
+    for (index = first_index;
+         (index < last_index) && (index - first_index < num_slots); index++) {
+        slot_num = index % num_slots;
+        slots[slot_num].index = index;
+        ims_pipeline_push(IMS_STAGE_CANDIDATE, slot_num);
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        if (pthread_create(&workers[i], NULL, ims_worker_thread, NULL) != 0) {
+            fprintf(stderr, "ERROR: Can't start IMS job %u\n", i);
+            status = EAGAIN;
+            break;
+        }
+        num_started++;
+    }
+
+    /* Drain the slots in order, storing each IMS */
+    index = first_index;
+    while ((status == 0) && (index < last_index)) {
+        slot_num = index % num_slots;
+        slot = &slots[slot_num];
+
+        start = ims_metrics_now_ns();
+        while (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) {
+            ims_sem_wait(&sink_sem);
+        }
+        sink_wait_ns += ims_metrics_now_ns() - start;
+        slot->ready = 0;
+        __atomic_sub_fetch(&sink_depth, 1, __ATOMIC_RELAXED);
+
+        if (!ims_is_unique(&slot->ctx)) {
+            /**
+             * The EP_UID was stored from another slot while this one was
+             * in flight: carry on along the same index's streams.
+             */
+            stats[IMS_STAGE_SINK].discards++;
+            ims_pipeline_push(IMS_STAGE_CANDIDATE, slot_num);
+        } else {
+            printf("IMS %u/%u\n", index - first_index + 1, num_ims);
+            status = ims_store(&slot->ctx);
+            if (status == 0) {
+                (*num_generated)++;
+
+                /* Reuse the slot for the next index it is responsible for */
+                if (last_index - index > num_slots) {
+                    slot->index = index + num_slots;
+                    slot->seeded = false;
+                    ims_pipeline_push(IMS_STAGE_CANDIDATE, slot_num);
+                }
+                index++;
+            }
+        }
+    }
+    run_stored = *num_generated;
+
+    /* Stop the workers (any still busy finish their current stage first) */
+    __atomic_store_n(&jobs_stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < num_started; i++) {
+        sem_post(&work_sem);
+    }
+    for (i = 0; i < num_started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (i = 0; i < num_slots; i++) {
+        ims_context_deinit(&slots[i].ctx);
+    }
+
+ims_generate_jobs_err:
+    if (sems_ready) {
+        sem_destroy(&work_sem);
+        sem_destroy(&sink_sem);
+    }
+    while (num_queues > 0) {
+        ims_queue_deinit(&queues[--num_queues]);
+    }
+    free(workers);
+    free(slots);
+    slots = NULL;
+    run_ns = ims_metrics_now_ns() - run_start;
+
+    return status;
+}
+
+
+/**
+ * @brief Print the pipeline statistics of the last ims_generate_jobs run
+ *
+ * For each stage, shows the number of items discarded (sent back to the
+ * candidate stage) and the average and maximum depth of the queue feeding
+ * it; ims_metrics_print has the passes and time of each stage. The stage
+ * with the deepest queue is the one limiting the run.
+ *
+ * @param stream Where to print the statistics
+ */
+void ims_jobs_print_stats(FILE * stream) {
+    ims_stage_stats * stage_stats;
+    int stage;
+
+    fprintf(stream, "Pipeline: %u IMS in %.3f s (%.2f IMS/s), %u jobs, "
+            "%u slots\n", run_stored, run_ns / 1e9,
+            run_ns? run_stored / (run_ns / 1e9) : 0.0,
+            run_jobs, run_jobs * IMS_SLOTS_PER_JOB);
+    fprintf(stream, "%-10s %10s %10s %10s\n",
+            "stage", "discards", "queue avg", "queue max");
+    for (stage = 0; stage < IMS_NUM_STAGES; stage++) {
+        stage_stats = &stats[stage];
+        fprintf(stream, "%-10s %10llu %10.2f %10u\n",
+                ims_metrics_stage_name(stage),
+                (unsigned long long)stage_stats->discards,
+                stage_stats->depth_samples?
+                        (double)stage_stats->depth_sum /
+                                stage_stats->depth_samples : 0.0,
+                stage_stats->depth_max);
+    }
+    fprintf(stream, "Workers idle %.3f s, sink waited %.3f s\n",
+            jobs_idle_ns / 1e9, sink_wait_ns / 1e9);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the header information for the multi-threaded
+ * IMS generation pipeline used by "imsgen".
+ *
+ */
+
+#ifndef _IMS_JOBS_H
+#define _IMS_JOBS_H
+
+/* Upper limit on the number of worker threads */
+#define IMS_JOBS_MAX    256
+
+
+/**
+ * @brief Generate a batch of IMS values with a pipeline of worker threads
+ *
+ * Workers generate IMS values and keys into slots, each IMS from the PRNG
+ * streams for its index (see ims_context_seed). A single sink (the calling
+ * thread) takes the finished values in index order, checks them for
+ * uniqueness and stores them in the IMS file and key database. The output
+ * is therefore identical to that of a single-threaded run over the same
+ * indices, whatever the number of jobs.
+ *
+ * @param first_index The (zero-based) index of the first IMS to generate
+ * @param num_ims The number of IMS values to generate
+ * @param num_jobs The number of worker threads
+ * @param num_generated Set to the number of IMS values actually stored
+ *
+ * @note ims_init must have been called first. Only the production form
+ *       of IMS is supported (the legacy sample stream is sequential).
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_generate_jobs(uint32_t first_index,
+                      uint32_t num_ims,
+                      uint32_t num_jobs,
+                      uint32_t * num_generated);
+
+/**
+ * @brief Print the pipeline statistics of the last ims_generate_jobs run
+ *
+ * For each stage, shows the number of items discarded (sent back to the
+ * candidate stage) and the average and maximum depth of the queue feeding
+ * it; ims_metrics_print has the passes and time of each stage. The stage
+ * with the deepest queue is the one limiting the run.
+ *
+ * @param stream Where to print the statistics
+ */
+void ims_jobs_print_stats(FILE * stream);
+
+#endif /* !_IMS_JOBS_H */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file declares the per-curve MIRACL functions which imsgen
+ * calls by their decorated names.
+ *
+ * The MIRACL headers declare each function under its undecorated name,
+ * which DRFLAGS maps to a single curve, so calls into the other curve's
+ * copy need their own prototypes here.
+ *
+ */
+
+#ifndef _IMS_MCL_H
+#define _IMS_MCL_H
+
+/* Finite field arithmetic (ERRK primes are handled by the C25519 copy) */
+extern void MCL_FF_toOctet_C25519(mcl_octet * S, mcl_chunk x[][MCL_BS], int n);
+extern int MCL_FF_prime_test_C25519(mcl_chunk x[][MCL_BS], csprng * R,
+                                    int profile, int n);
+extern int MCL_FF_prime_batch_C25519(int r[], mcl_chunk (*x[])[MCL_BS], int m,
+                                     csprng * R, int profile, int n);
+
+/*
+ * imsgen declares the FFs it hands these functions with its own MCL_BS. The
+ * Makefile builds it with the MCL_CHUNK of MIRACL_cfg, as the library is,
+ * and at that chunk our BIG must be laid out as the library's 255-bit one.
+ */
+#if MCL_CHUNK == 16
+#define IMS_MCL_C25519_BASEBITS 13
+#elif MCL_CHUNK == 32
+#define IMS_MCL_C25519_BASEBITS 29
+#else
+#define IMS_MCL_C25519_BASEBITS 56
+#endif
+_Static_assert((MCL_BASEBITS == IMS_MCL_C25519_BASEBITS) &&
+               (MCL_BS == 1 + (255 - 1) / IMS_MCL_C25519_BASEBITS),
+               "imsgen's BIG layout differs from the C25519 library's");
+
+/* Montgomery backend selection, for the C25519 copy (ERRK and RSA2048) */
+extern void MCL_FF_backend_init_C25519(void);
+
+/* Fixed-base generator tables for EPVK (C448) and ESVK (C25519) */
+extern void MCL_ECP_generator_precompute_C448(void);
+extern void MCL_ECP_generator_precompute_C25519(void);
+
+#endif /* !_IMS_MCL_H */
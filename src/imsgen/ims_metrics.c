@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the IMS generation metrics used by "imsgen".
+ *
+ * The stages of IMS generation count the events which cost a candidate
+ * (EP_UID collisions, ERRK overflow, ECC key validation failures) and the
+ * time spent in each stage. Events and stage timings may come from any
+ * worker thread, so they are updated atomically; stored IMS values are
+ * only ever accounted for by the single thread which stores them, which
+ * also prints the periodic progress line.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include "ims.h"
+#include "ims_metrics.h"
+
+static const char * ims_stage_names[IMS_NUM_STAGES] = {
+    "candidate", "errk", "ecc", "sink"
+};
+
+static const char * ims_event_names[IMS_NUM_EVENTS] = {
+    "candidates", "uid_filter", "uid_db", "errk_overflow", "ecc_invalid"
+};
+
+/* Counters updated from any thread (atomically) */
+static uint64_t events[IMS_NUM_EVENTS];
+static uint64_t stage_items[IMS_NUM_STAGES];
+static uint64_t stage_ns[IMS_NUM_STAGES];
+
+/* Counters updated only by the storing thread */
+static uint32_t num_stored;
+static uint64_t prime_tests_sum;
+static uint32_t prime_tests_min;
+static uint32_t prime_tests_max;
+
+/* The run */
+static uint32_t run_done;       /* IMS values generated before the run */
+static uint32_t run_num_ims;
+static uint32_t run_interval;   /* Seconds between progress lines */
+static uint64_t run_start_ns;
+static uint64_t last_progress_ns;
+
+
+/**
+ * @brief Read the monotonic clock
+ *
+ * @returns The current time, in ns
+ */
+uint64_t ims_metrics_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Get the name of an IMS generation stage
+ *
+ * @param stage The stage (IMS_STAGE_xxx)
+ *
+ * @returns The stage name
+ */
+const char * ims_metrics_stage_name(int stage) {
+    return ((stage >= 0) && (stage < IMS_NUM_STAGES))?
+            ims_stage_names[stage] : "?";
+}
+
+
+/**
+ * @brief Reset the metrics at the start of a run
+ *
+ * @param num_done The number of IMS values of the run already generated
+ *        (by an earlier, resumed run)
+ * @param num_ims The total number of IMS values in the run
+ * @param progress_interval Seconds between progress lines (0 for none)
+ */
+void ims_metrics_start(uint32_t num_done, uint32_t num_ims,
+                       uint32_t progress_interval) {
+    int i;
+
+    for (i = 0; i < IMS_NUM_EVENTS; i++) {
+        events[i] = 0;
+    }
+    for (i = 0; i < IMS_NUM_STAGES; i++) {
+        stage_items[i] = 0;
+        stage_ns[i] = 0;
+    }
+    num_stored = 0;
+    prime_tests_sum = 0;
+    prime_tests_min = UINT32_MAX;
+    prime_tests_max = 0;
+
+    run_done = num_done;
+    run_num_ims = num_ims;
+    run_interval = progress_interval;
+    run_start_ns = ims_metrics_now_ns();
+    last_progress_ns = run_start_ns;
+}
+
+
+/**
+ * @brief Count an event
+ *
+ * May be called from any thread.
+ *
+ * @param event The event (IMS_EVENT_xxx)
+ */
+void ims_metrics_event(int event) {
+    __atomic_fetch_add(&events[event], 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Account for the time spent in one pass through a stage
+ *
+ * May be called from any thread.
+ *
+ * @param stage The stage (IMS_STAGE_xxx)
+ * @param start_ns When the stage started (from ims_metrics_now_ns)
+ */
+void ims_metrics_stage(int stage, uint64_t start_ns) {
+    __atomic_fetch_add(&stage_ns[stage], ims_metrics_now_ns() - start_ns,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stage_items[stage], 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Format a duration as hours, minutes and seconds
+ *
+ * @param buf Where to format the duration
+ * @param size The size of buf
+ * @param seconds The duration
+ *
+ * @returns buf
+ */
+static const char * ims_metrics_hms(char * buf, size_t size, double seconds) {
+    uint64_t s = (seconds > 0)? (uint64_t)(seconds + 0.5) : 0;
+
+    snprintf(buf, size, "%lluh%02um%02us", (unsigned long long)(s / 3600),
+             (unsigned)((s / 60) % 60), (unsigned)(s % 60));
+    return buf;
+}
+
+
+/**
+ * @brief Get the IMS values stored per second so far this run
+ *
+ * @param elapsed Set to the time since the run started, in s
+ *
+ * @returns The rate
+ */
+static double ims_metrics_rate(double * elapsed) {
+    *elapsed = (ims_metrics_now_ns() - run_start_ns) / 1e9;
+    return (*elapsed > 0)? num_stored / *elapsed : 0.0;
+}
+
+
+/**
+ * @brief Print the progress line
+ *
+ * @param stream Where to print it
+ */
+static void ims_metrics_progress(FILE * stream) {
+    uint32_t done = run_done + num_stored;
+    double elapsed;
+    double rate = ims_metrics_rate(&elapsed);
+    char eta[32];
+
+    fprintf(stream, "Progress: %u/%u IMS (%.1f%%), %.2f IMS/s, ETA %s, "
+            "%.1f prime tests/IMS, discards: uid %llu, errk %llu, ecc %llu\n",
+            done, run_num_ims,
+            run_num_ims? (100.0 * done) / run_num_ims : 100.0,
+            rate,
+            (rate > 0)? ims_metrics_hms(eta, sizeof(eta),
+                                        (run_num_ims - done) / rate) : "?",
+            num_stored? (double)prime_tests_sum / num_stored : 0.0,
+            (unsigned long long)(
+                __atomic_load_n(&events[IMS_EVENT_UID_FILTER],
+                                __ATOMIC_RELAXED) +
+                __atomic_load_n(&events[IMS_EVENT_UID_DB], __ATOMIC_RELAXED)),
+            (unsigned long long)__atomic_load_n(
+                &events[IMS_EVENT_ERRK_OVERFLOW], __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(
+                &events[IMS_EVENT_ECC_INVALID], __ATOMIC_RELAXED));
+    fflush(stream);
+}
+
+
+/**
+ * @brief Account for a stored IMS value
+ *
+ * Prints a progress line if one is due.
+ *
+ * @param prime_tests The number of primality tests the IMS needed
+ *        (including those of its discarded candidates)
+ */
+void ims_metrics_stored(uint32_t prime_tests) {
+    uint64_t now;
+
+    num_stored++;
+    prime_tests_sum += prime_tests;
+    if (prime_tests < prime_tests_min) {
+        prime_tests_min = prime_tests;
+    }
+    if (prime_tests > prime_tests_max) {
+        prime_tests_max = prime_tests;
+    }
+
+    if (run_interval > 0) {
+        now = ims_metrics_now_ns();
+        if (now - last_progress_ns >= (uint64_t)run_interval * 1000000000) {
+            last_progress_ns = now;
+            ims_metrics_progress(stdout);
+        }
+    }
+}
+
+
+/**
+ * @brief Print a summary of the run's metrics
+ *
+ * @param stream Where to print the summary
+ */
+void ims_metrics_print(FILE * stream) {
+    double elapsed;
+    double rate = ims_metrics_rate(&elapsed);
+    char hms[32];
+    int i;
+
+    fprintf(stream, "Generated %u IMS in %s (%.2f IMS/s)\n",
+            num_stored, ims_metrics_hms(hms, sizeof(hms), elapsed), rate);
+    fprintf(stream, "Events:");
+    for (i = 0; i < IMS_NUM_EVENTS; i++) {
+        fprintf(stream, " %s %llu", ims_event_names[i],
+                (unsigned long long)events[i]);
+    }
+    fprintf(stream, "\n");
+    fprintf(stream, "Prime tests per IMS: mean %.1f, min %u, max %u\n",
+            num_stored? (double)prime_tests_sum / num_stored : 0.0,
+            num_stored? prime_tests_min : 0, prime_tests_max);
+    fprintf(stream, "%-10s %10s %12s %12s\n",
+            "stage", "passes", "time (s)", "ms/pass");
+    for (i = 0; i < IMS_NUM_STAGES; i++) {
+        fprintf(stream, "%-10s %10llu %12.3f %12.3f\n",
+                ims_stage_names[i],
+                (unsigned long long)stage_items[i],
+                stage_ns[i] / 1e9,
+                stage_items[i]? (stage_ns[i] / 1e6) / stage_items[i] : 0.0);
+    }
+}
+
+
+/**
+ * @brief Write a summary of the run's metrics as a JSON object
+ *
+ * @param filename The name of the file to write
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_metrics_write_json(const char * filename) {
+    FILE * fp;
+    double elapsed;
+    double rate = ims_metrics_rate(&elapsed);
+    int i;
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "ERROR: Can't create metrics file '%s'\n", filename);
+        return errno;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"ims_total\": %u,\n", run_num_ims);
+    fprintf(fp, "  \"ims_resumed\": %u,\n", run_done);
+    fprintf(fp, "  \"ims_stored\": %u,\n", num_stored);
+    fprintf(fp, "  \"elapsed_s\": %.3f,\n", elapsed);
+    fprintf(fp, "  \"ims_per_s\": %.3f,\n", rate);
+    fprintf(fp, "  \"events\": {");
+    for (i = 0; i < IMS_NUM_EVENTS; i++) {
+        fprintf(fp, "%s\n    \"%s\": %llu", i? "," : "", ims_event_names[i],
+                (unsigned long long)events[i]);
+    }
+    fprintf(fp, "\n  },\n");
+    fprintf(fp, "  \"prime_tests\": {\n");
+    fprintf(fp, "    \"total\": %llu,\n", (unsigned long long)prime_tests_sum);
+    fprintf(fp, "    \"per_ims_mean\": %.3f,\n",
+            num_stored? (double)prime_tests_sum / num_stored : 0.0);
+    fprintf(fp, "    \"per_ims_min\": %u,\n", num_stored? prime_tests_min : 0);
+    fprintf(fp, "    \"per_ims_max\": %u\n", prime_tests_max);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"stages\": {");
+    for (i = 0; i < IMS_NUM_STAGES; i++) {
+        fprintf(fp, "%s\n    \"%s\": { \"passes\": %llu, \"time_s\": %.6f }",
+                i? "," : "", ims_stage_names[i],
+                (unsigned long long)stage_items[i], stage_ns[i] / 1e9);
+    }
+    fprintf(fp, "\n  }\n");
+    fprintf(fp, "}\n");
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "ERROR: Can't write metrics file '%s'\n", filename);
+        return EIO;
+    }
+    return 0;
+}
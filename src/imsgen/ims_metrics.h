@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the header information for the IMS generation
+ * metrics (event counts, stage timings and progress) used by "imsgen".
+ *
+ */
+
+#ifndef _IMS_METRICS_H
+#define _IMS_METRICS_H
+
+/* Counted events */
+#define IMS_EVENT_CANDIDATE     0   /* A candidate IMS was drawn */
+#define IMS_EVENT_UID_FILTER    1   /* EP_UID rejected by the EP_UID filter */
+#define IMS_EVENT_UID_DB        2   /* EP_UID already in the key database */
+#define IMS_EVENT_ERRK_OVERFLOW 3   /* No ERRK P & Q found (EOVERFLOW) */
+#define IMS_EVENT_ECC_INVALID   4   /* EPVK or ESVK failed validation */
+#define IMS_NUM_EVENTS          5
+
+
+/**
+ * @brief Read the monotonic clock
+ *
+ * @returns The current time, in ns
+ */
+uint64_t ims_metrics_now_ns(void);
+
+/**
+ * @brief Get the name of an IMS generation stage
+ *
+ * @param stage The stage (IMS_STAGE_xxx)
+ *
+ * @returns The stage name
+ */
+const char * ims_metrics_stage_name(int stage);
+
+/**
+ * @brief Reset the metrics at the start of a run
+ *
+ * @param num_done The number of IMS values of the run already generated
+ *        (by an earlier, resumed run)
+ * @param num_ims The total number of IMS values in the run
+ * @param progress_interval Seconds between progress lines (0 for none)
+ */
+void ims_metrics_start(uint32_t num_done, uint32_t num_ims,
+                       uint32_t progress_interval);
+
+/**
+ * @brief Count an event
+ *
+ * May be called from any thread.
+ *
+ * @param event The event (IMS_EVENT_xxx)
+ */
+void ims_metrics_event(int event);
+
+/**
+ * @brief Account for the time spent in one pass through a stage
+ *
+ * May be called from any thread.
+ *
+ * @param stage The stage (IMS_STAGE_xxx)
+ * @param start_ns When the stage started (from ims_metrics_now_ns)
+ */
+void ims_metrics_stage(int stage, uint64_t start_ns);
+
+/**
+ * @brief Account for a stored IMS value
+ *
+ * Prints a progress line if one is due.
+ *
+ * @param prime_tests The number of primality tests the IMS needed
+ *        (including those of its discarded candidates)
+ */
+void ims_metrics_stored(uint32_t prime_tests);
+
+/**
+ * @brief Print a summary of the run's metrics
+ *
+ * @param stream Where to print the summary
+ */
+void ims_metrics_print(FILE * stream);
+
+/**
+ * @brief Write a summary of the run's metrics as a JSON object
+ *
+ * @param filename The name of the file to write
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_metrics_write_json(const char * filename);
+
+#endif /* !_IMS_METRICS_H */
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the bounded lock-free queues connecting the
+ * stages of the "imsgen" pipeline.
+ *
+ * Each cell carries a sequence number which tells producers and consumers
+ * whether it is free for the current lap of the ring (D. Vyukov's bounded
+ * MPMC queue). Producers and consumers only contend on their own counter,
+ * claimed with a compare-and-swap, so no thread ever blocks another.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "ims_queue.h"
+
+
+/**
+ * @brief Initialize a queue
+ *
+ * @param queue The queue to initialize
+ * @param min_capacity The minimum number of values the queue must hold
+ *        (rounded up to a power of 2)
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_queue_init(ims_queue * queue, uint32_t min_capacity) {
+    uint32_t capacity = 2;
+    uint32_t i;
+
+    while (capacity < min_capacity) {
+        if (capacity >= 0x80000000) {
+            return EINVAL;
+        }
+        capacity <<= 1;
+    }
+
+    queue->cells = calloc(capacity, sizeof(*queue->cells));
+    if (!queue->cells) {
+        return ENOMEM;
+    }
+    for (i = 0; i < capacity; i++) {
+        queue->cells[i].sequence = i;
+    }
+    queue->mask = capacity - 1;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+
+    return 0;
+}
+
+
+/**
+ * @brief Release the resources held by a queue
+ *
+ * @param queue The queue to release
+ */
+void ims_queue_deinit(ims_queue * queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+
+/**
+ * @brief Append a value to a queue
+ *
+ * @param queue The queue to append to
+ * @param value The value to append
+ *
+ * @returns True if the value was appended, false if the queue was full.
+ */
+bool ims_queue_push(ims_queue * queue, uint32_t value) {
+    ims_queue_cell * cell;
+    uint32_t pos;
+    uint32_t sequence;
+    int32_t diff;
+
+    pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        diff = (int32_t)(sequence - pos);
+        if (diff == 0) {
+            /* The cell is free on this lap: try to claim it */
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* The cell still holds last lap's value: the queue is full */
+            return false;
+        } else {
+            /* Another producer got here first */
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Publish the value to the consumers */
+    cell->value = value;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/**
+ * @brief Remove the oldest value from a queue
+ *
+ * @param queue The queue to remove from
+ * @param value Set to the removed value
+ *
+ * @returns True if a value was removed, false if the queue was empty.
+ */
+bool ims_queue_pop(ims_queue * queue, uint32_t * value) {
+    ims_queue_cell * cell;
+    uint32_t pos;
+    uint32_t sequence;
+    int32_t diff;
+
+    pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        diff = (int32_t)(sequence - (pos + 1));
+        if (diff == 0) {
+            /* The cell holds a value for this lap: try to claim it */
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Nothing has been pushed into the cell yet: the queue is empty */
+            return false;
+        } else {
+            /* Another consumer got here first */
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Hand the cell back to the producers for the next lap */
+    *value = cell->value;
+    __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/**
+ * @brief Get the (approximate) number of values in a queue
+ *
+ * @param queue The queue to examine
+ *
+ * @returns The number of values pushed but not yet popped. This is only a
+ *          snapshot if other threads are using the queue.
+ */
+uint32_t ims_queue_depth(ims_queue * queue) {
+    uint32_t enqueued = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    uint32_t dequeued = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+
+    return (int32_t)(enqueued - dequeued) > 0? enqueued - dequeued : 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the header information for the bounded
+ * lock-free queues connecting the stages of the "imsgen" pipeline.
+ *
+ */
+
+#ifndef _IMS_QUEUE_H
+#define _IMS_QUEUE_H
+
+/* Cache line size, used to keep the producer and consumer counters apart */
+#define IMS_QUEUE_CACHE_LINE    64
+
+/* A queue cell (sequence is accessed atomically) */
+typedef struct {
+    uint32_t    sequence;
+    uint32_t    value;
+} ims_queue_cell;
+
+/**
+ * A bounded multi-producer/multi-consumer queue of 32-bit values. The
+ * enqueue_pos and dequeue_pos counters are accessed atomically.
+ */
+typedef struct {
+    ims_queue_cell *    cells;
+    uint32_t            mask;
+    uint8_t             pad0[IMS_QUEUE_CACHE_LINE];
+    uint32_t            enqueue_pos;
+    uint8_t             pad1[IMS_QUEUE_CACHE_LINE];
+    uint32_t            dequeue_pos;
+    uint8_t             pad2[IMS_QUEUE_CACHE_LINE];
+} ims_queue;
+
+
+/**
+ * @brief Initialize a queue
+ *
+ * @param queue The queue to initialize
+ * @param min_capacity The minimum number of values the queue must hold
+ *        (rounded up to a power of 2)
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+int ims_queue_init(ims_queue * queue, uint32_t min_capacity);
+
+/**
+ * @brief Release the resources held by a queue
+ *
+ * @param queue The queue to release
+ */
+void ims_queue_deinit(ims_queue * queue);
+
+/**
+ * @brief Append a value to a queue
+ *
+ * @param queue The queue to append to
+ * @param value The value to append
+ *
+ * @returns True if the value was appended, false if the queue was full.
+ */
+bool ims_queue_push(ims_queue * queue, uint32_t value);
+
+/**
+ * @brief Remove the oldest value from a queue
+ *
+ * @param queue The queue to remove from
+ * @param value Set to the removed value
+ *
+ * @returns True if a value was removed, false if the queue was empty.
+ */
+bool ims_queue_pop(ims_queue * queue, uint32_t * value);
+
+/**
+ * @brief Get the (approximate) number of values in a queue
+ *
+ * @param queue The queue to examine
+ *
+ * @returns The number of values pushed but not yet popped. This is only a
+ *          snapshot if other threads are using the queue.
+ */
+uint32_t ims_queue_depth(ims_queue * queue);
+
+#endif /* !_IMS_QUEUE_H */
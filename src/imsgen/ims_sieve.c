@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the small-prime sieve used by the IMS ERRK
+ * P & Q prime search.
+ *
+ * The P & Q searches each walk a fixed window of 4096 candidates
+ * (base + k * step). Rather than trial-dividing each candidate, the residue
+ * of the base modulo each small prime is computed once, and every candidate
+ * that prime divides is struck out of a bitmap of the whole window.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include "util.h"
+#include "mcl_arch.h"
+#include "mcl_oct.h"
+#include "mcl_ecdh.h"
+#include "mcl_rand.h"
+#include "mcl_rsa.h"
+#include "crypto.h"
+#include "ims_common.h"
+#include "ims_sieve.h"
+#include "ims_mcl.h"
+
+/* Odd primes below IMS_SIEVE_LIMIT */
+static uint32_t sieve_primes[IMS_SIEVE_MAX_PRIMES];
+static uint32_t num_sieve_primes;
+
+
+/**
+ * @brief Build the table of small sieving primes
+ *
+ * Must be called once before ims_sieve_window (the table is read-only
+ * afterwards, so it may be shared between threads).
+ */
+void ims_sieve_init(void) {
+    static uint8_t composite[IMS_SIEVE_LIMIT];
+    uint32_t i;
+    uint32_t j;
+
+    if (num_sieve_primes != 0) {
+        return;
+    }
+
+    /* Sieve of Eratosthenes over the odd numbers */
+    for (i = 3; i < IMS_SIEVE_LIMIT; i += 2) {
+        if (!composite[i]) {
+            sieve_primes[num_sieve_primes++] = i;
+            for (j = i * i; j < IMS_SIEVE_LIMIT; j += 2 * i) {
+                composite[j] = 1;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Calculate the modular inverse of a small number
+ *
+ * @param a The number to invert
+ * @param m The (prime) modulus
+ *
+ * @returns a^-1 mod m
+ */
+static uint32_t inverse_mod(uint32_t a, uint32_t m) {
+    int64_t t = 0;
+    int64_t new_t = 1;
+    int64_t r = m;
+    int64_t new_r = a % m;
+    int64_t q;
+    int64_t temp;
+
+    while (new_r != 0) {
+        q = r / new_r;
+        temp = t - q * new_t;
+        t = new_t;
+        new_t = temp;
+        temp = r - q * new_r;
+        r = new_r;
+        new_r = temp;
+    }
+
+    return (uint32_t)((t < 0)? t + m : t);
+}
+
+
+/**
+ * @brief Sieve a window of prime candidates
+ *
+ * Marks each index k (0 <= k < IMS_SIEVE_WINDOW) for which
+ * base + (k * step) has a small prime factor. Unmarked indices are the
+ * only ones worth a primality test.
+ *
+ * @param base The first candidate in the window
+ * @param n size of base in MCL_BIGs
+ * @param step The (even) distance between candidates
+ * @param composite_map The IMS_SIEVE_WORDS-word bitmap of composite indices
+ */
+void ims_sieve_window(mcl_chunk base[][MCL_BS],
+                      int n,
+                      uint32_t step,
+                      uint64_t composite_map[IMS_SIEVE_WORDS]) {
+    uint8_t   base_buf[MCL_FFLEN * MCL_MODBYTES];
+    mcl_octet base_octet = {0, sizeof(base_buf), (char *)base_buf};
+    uint32_t  prime;
+    uint32_t  residue;
+    uint32_t  word;
+    uint32_t  k;
+    uint32_t  i;
+    int       j;
+
+    memset(composite_map, 0, IMS_SIEVE_WORDS * sizeof(uint64_t));
+
+    /* Get the base as a big-endian byte string */
+    MCL_FF_toOctet_C25519(&base_octet, base, n);
+
+    for (i = 0; i < num_sieve_primes; i++) {
+        prime = sieve_primes[i];
+
+        /* Reduce the base mod prime, 32 bits at a time */
+        residue = 0;
+        for (j = 0; j < base_octet.len; j += 4) {
+            word = ((uint32_t)base_buf[j] << 24) |
+                   ((uint32_t)base_buf[j + 1] << 16) |
+                   ((uint32_t)base_buf[j + 2] << 8) |
+                   (uint32_t)base_buf[j + 3];
+            residue = (uint32_t)((((uint64_t)residue << 32) | word) % prime);
+        }
+
+        /**
+         * base + k * step == 0 (mod prime) for
+         * k == -residue / step (mod prime), and every prime'th k after it
+         */
+        k = (uint32_t)(((uint64_t)(prime - residue) % prime) *
+                       inverse_mod(step, prime) % prime);
+        for (; k < IMS_SIEVE_WINDOW; k += prime) {
+            IMS_SIEVE_SET(composite_map, k);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ *
+ * @brief: This file contains the header information for the small-prime
+ * sieve used by the IMS ERRK P & Q prime search.
+ *
+ */
+
+#ifndef _IMS_SIEVE_H
+#define _IMS_SIEVE_H
+
+/* Sieve with all odd primes below this limit */
+#define IMS_SIEVE_LIMIT         65536
+#define IMS_SIEVE_MAX_PRIMES    6542
+
+/* The sieve window covers every P or Q bias index (0..4095) */
+#define IMS_SIEVE_WINDOW        (1 << P_Q_BIAS_BITS)
+#define IMS_SIEVE_WORDS         (IMS_SIEVE_WINDOW / 64)
+
+/* Test/set offset index k of a window bitmap */
+#define IMS_SIEVE_TEST(map, k) \
+    (((map)[(k) / 64] >> ((k) % 64)) & 1)
+#define IMS_SIEVE_SET(map, k) \
+    ((map)[(k) / 64] |= (uint64_t)1 << ((k) % 64))
+
+/* Test whether offset index k of a sieved window is known to be composite */
+#define IMS_SIEVE_IS_COMPOSITE(map, k)  IMS_SIEVE_TEST(map, k)
+
+
+/**
+ * @brief Build the table of small sieving primes
+ *
+ * Must be called once before ims_sieve_window (the table is read-only
+ * afterwards, so it may be shared between threads).
+ */
+void ims_sieve_init(void);
+
+
+/**
+ * @brief Sieve a window of prime candidates
+ *
+ * Marks each index k (0 <= k < IMS_SIEVE_WINDOW) for which
+ * base + (k * step) has a small prime factor. Unmarked indices are the
+ * only ones worth a primality test.
+ *
+ * @param base The first candidate in the window
+ * @param n size of base in MCL_BIGs
+ * @param step The (even) distance between candidates
+ * @param composite_map The IMS_SIEVE_WORDS-word bitmap of composite indices
+ */
+void ims_sieve_window(mcl_chunk base[][MCL_BS],
+                      int n,
+                      uint32_t step,
+                      uint64_t composite_map[IMS_SIEVE_WORDS]);
+
+#endif /* !_IMS_SIEVE_H */
@@ -47,6 +47,7 @@
 #include <time.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <openssl/evp.h>
 #include <sqlite3.h>
 #include "util.h"
@@ -61,10 +62,34 @@
 #include "ims_io.h"
 #include "ims_test_core.h"
 #include "ims_test.h"
+#include "ims_mcl.h"
 
 /* Uncomment the following define to enable IMS diagnostic messages */
 /*#define IMS_DEBUGMSG*/
 
+/* Size of the seed drawn from the main PRNG for each worker's PRNG */
+#define TEST_JOB_SEED_SIZE  32
+
+/* A verification worker thread */
+typedef struct {
+    pthread_t   thread;
+    ims_context ctx;
+    db_reader * db;
+} test_job;
+
+/* The main thread's keys and PRNG (the latter draws the random samples) */
+static ims_context test_ctx;
+static const char * test_database_name;
+
+/* Shared verification work queue (protected by test_lock) */
+static pthread_mutex_t  test_lock = PTHREAD_MUTEX_INITIALIZER;
+static ims_file *       test_file;
+static const uint32_t * test_indices;   /* NULL: verify 0..test_count-1 */
+static uint32_t         test_count;
+static uint32_t         test_next;
+static int              test_status;
+static bool             test_compatibility;
+
 
 /**
  * @brief Initialize the IMS generation subsystem
@@ -97,9 +122,14 @@ int ims_init(const char * prng_seed_file,
     if (status != 0) {
         goto ims_init_err;
     }
-    MCL_RAND_seed(&rng, prng_seed_length, prng_seed_buffer);
+
+    /* We're auditing, so fully validate every regenerated EPVK/ESVK */
+    ims_set_key_validation(true);
+    ims_context_init(&test_ctx);
+    MCL_RAND_seed(&test_ctx.rng, prng_seed_length, prng_seed_buffer);
 
     /* Open the key database */
+    test_database_name = database_name;
     status = db_init(database_name);
     if (status != 0) {
         goto ims_init_err;
@@ -120,28 +150,118 @@ void ims_deinit(void) {
     /* Close the key database */
     db_deinit();
 
+    ims_context_deinit(&test_ctx);
     ims_common_deinit();
 }
 
 
+/* The RFC 2409 Oakley group 2 modulus, a known 1024-bit prime */
+static const uint8_t known_prime[128] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xc9, 0x0f, 0xda, 0xa2, 0x21, 0x68, 0xc2, 0x34,
+    0xc4, 0xc6, 0x62, 0x8b, 0x80, 0xdc, 0x1c, 0xd1,
+    0x29, 0x02, 0x4e, 0x08, 0x8a, 0x67, 0xcc, 0x74,
+    0x02, 0x0b, 0xbe, 0xa6, 0x3b, 0x13, 0x9b, 0x22,
+    0x51, 0x4a, 0x08, 0x79, 0x8e, 0x34, 0x04, 0xdd,
+    0xef, 0x95, 0x19, 0xb3, 0xcd, 0x3a, 0x43, 0x1b,
+    0x30, 0x2b, 0x0a, 0x6d, 0xf2, 0x5f, 0x14, 0x37,
+    0x4f, 0xe1, 0x35, 0x6d, 0x6d, 0x51, 0xc2, 0x45,
+    0xe4, 0x85, 0xb5, 0x76, 0x62, 0x5e, 0x7e, 0xc6,
+    0xf4, 0x4c, 0x42, 0xe9, 0xa6, 0x37, 0xed, 0x6b,
+    0x0b, 0xff, 0x5c, 0xb6, 0xf4, 0x06, 0xb7, 0xed,
+    0xee, 0x38, 0x6b, 0xfb, 0x5a, 0x89, 0x9f, 0xa5,
+    0xae, 0x9f, 0x24, 0x11, 0x7c, 0x4b, 0x1f, 0xe6,
+    0x49, 0x28, 0x66, 0x51, 0xec, 0xe6, 0x53, 0x81,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+/**
+ * known_prime plus each of these is composite, but has no factor below 20,
+ * so gets past the trial division to a primality test lane
+ */
+static const uint8_t known_composite_offset[] = {
+    2, 6, 12, 20, 24, 26, 30, 32
+};
+
+/* Candidates run through test_prime_verdicts, alternately composite & prime */
+#define IMS_PRIME_CHECK     (2 * sizeof(known_composite_offset))
+
+
+/**
+ * @brief Check that batched primality verdicts match single ones
+ *
+ * The ERRK search tests its P & Q candidates with MCL_FF_prime_batch, so
+ * check it against MCL_FF_prime_test, under each test profile, on
+ * candidates with known answers. There are more candidates than lanes,
+ * all past trial division, so the prime is tested in every other lane and
+ * again in the lanes refilled as the composites fail.
+ *
+ * @returns Zero if every verdict is right, EIO otherwise.
+ */
+int test_prime_verdicts(void) {
+    static const int profiles[] = { MCL_FF_PRIME_MR, MCL_FF_PRIME_BPSW };
+    mcl_chunk candidates[IMS_PRIME_CHECK][MCL_FFLEN][MCL_BS];
+    mcl_chunk (*batch[IMS_PRIME_CHECK])[MCL_BS];
+    mcl_chunk single[MCL_FFLEN][MCL_BS];
+    int batch_prime[IMS_PRIME_CHECK];
+    int single_prime;
+    mcl_octet prime = {sizeof(known_prime), sizeof(known_prime),
+                       (char *)known_prime};
+    char seed[] = "test_prime_verdicts";
+    csprng check_rng;
+    int status = 0;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < IMS_PRIME_CHECK; i++) {
+        MCL_FF_fromOctet_C25519(candidates[i], &prime, MCL_HFLEN);
+        if ((i % 2) == 0) {
+            MCL_FF_inc_C25519(candidates[i], known_composite_offset[i / 2],
+                              MCL_HFLEN);
+        }
+        batch[i] = candidates[i];
+    }
+
+    MCL_RAND_seed(&check_rng, sizeof(seed), seed);
+    for (j = 0; j < sizeof(profiles) / sizeof(profiles[0]); j++) {
+        MCL_FF_prime_batch_C25519(batch_prime, batch, IMS_PRIME_CHECK,
+                                  &check_rng, profiles[j], MCL_HFLEN);
+        for (i = 0; i < IMS_PRIME_CHECK; i++) {
+            MCL_FF_copy_C25519(single, candidates[i], MCL_HFLEN);
+            single_prime = MCL_FF_prime_test_C25519(single, &check_rng,
+                                                    profiles[j], MCL_HFLEN);
+            if ((batch_prime[i] != single_prime) ||
+                (single_prime != (int)(i % 2))) {
+                fprintf(stderr, "ERROR: Primality verdicts for profile %d "
+                        "candidate %u: batch %d, single %d, expected %u\n",
+                        profiles[j], i, batch_prime[i], single_prime, i % 2);
+                status = EIO;
+            }
+        }
+    }
+    MCL_RAND_clean(&check_rng);
+
+    return status;
+}
+
+
 /**
  * @brief Test that the RSA-2048 sign/verify works
  *
  * Sign a string with the public key and verify it with the private key.
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_rsa.c
  *
- * @param private_key A pointer to the RSA private key
- * @param public_key A pointer to the RSA public key
+ * @param ctx The context holding the keys
  *
  * @returns Zero if successful, -1 otherwise.
  */
-static int test_rsa_sign_roundtrip(void) {
+static int test_rsa_sign_roundtrip(ims_context * ctx) {
     int status = 0;
     char * test_string = "Hello world";
-    static char m[MCL_RFS];
-    static char c[MCL_RFS];
-    static char s[MCL_RFS];
-    static char ml[MCL_RFS];
+    char m[RSA_OCTET_SIZE];
+    char c[RSA_OCTET_SIZE];
+    char s[RSA_OCTET_SIZE];
+    char ml[RSA_OCTET_SIZE];
     mcl_octet M={0, sizeof(m), m};
     mcl_octet S={0,sizeof(s),s};
     mcl_octet C={0, sizeof(c), c};
@@ -156,10 +276,10 @@ static int test_rsa_sign_roundtrip(void) {
         status = -1;
     } else {
         /* create signature in S */
-        MCL_RSA_DECRYPT_RSA2048(&rsa_private, &C, &S);
+        MCL_RSA_DECRYPT_RSA2048(&ctx->rsa_private, &C, &S);
 
         /* Verify the signature */
-        MCL_RSA_ENCRYPT_RSA2048(&rsa_public, &S, &ML);
+        MCL_RSA_ENCRYPT_RSA2048(&ctx->rsa_public, &S, &ML);
         if (MCL_OCT_comp(&C,&ML)) {
           status = 0;
         } else {
@@ -171,9 +291,9 @@ static int test_rsa_sign_roundtrip(void) {
         }
     }
 #else
-    status = rsa_sign_message(&M, &S);
+    status = rsa_sign_message(ctx, &M, &S);
     if (status == 0) {
-        status = rsa_verify_message(&M, &S);
+        status = rsa_verify_message(ctx, &M, &S);
     }
 #endif
 
@@ -187,19 +307,18 @@ static int test_rsa_sign_roundtrip(void) {
  * Encrypt a string with the public key and decrypt it with the private key.
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_rsa.c
  *
- * @param private_key A pointer to the RSA private key
- * @param public_key A pointer to the RSA public key
+ * @param ctx The context holding the keys and the PRNG for the padding
  *
  * @returns Zero if successful, -1 otherwise.
  */
-static int test_rsa_encryption_roundtrip(void) {
+static int test_rsa_encryption_roundtrip(ims_context * ctx) {
     int status = 0;
     int test_len;
     char * test_string = "Hello world";
-    static char m[MCL_RFS];
-    static char e[MCL_RFS];
-    static char c[MCL_RFS];
-    static char ml[MCL_RFS];
+    char m[RSA_OCTET_SIZE];
+    char e[RSA_OCTET_SIZE];
+    char c[RSA_OCTET_SIZE];
+    char ml[RSA_OCTET_SIZE];
     mcl_octet M={0, sizeof(m), m};
     mcl_octet E={0, sizeof(e), e};
     mcl_octet C={0, sizeof(c), c};
@@ -207,14 +326,14 @@ static int test_rsa_encryption_roundtrip(void) {
 
     MCL_OCT_jstring(&M, test_string);
     /* OAEP encode message m -> e  */
-    MCL_OAEP_ENCODE_RSA2048(MCL_HASH_TYPE_RSA, &M, rng, NULL, &E);
+    MCL_OAEP_ENCODE_RSA2048(MCL_HASH_TYPE_RSA, &M, &ctx->rng, NULL, &E);
 
 
     /* encrypt encoded message e -> c */
-    MCL_RSA_ENCRYPT_RSA2048(&rsa_public, &E, &C);
+    MCL_RSA_ENCRYPT_RSA2048(&ctx->rsa_public, &E, &C);
 
     /* decrypt encrypted message c -> ml */
-    MCL_RSA_DECRYPT_RSA2048(&rsa_private, &C, &ML);
+    MCL_RSA_DECRYPT_RSA2048(&ctx->rsa_private, &C, &ML);
 
     /* decode decrypted message ml -> ml */
     MCL_OAEP_DECODE_RSA2048(MCL_HASH_TYPE_RSA, NULL, &ML);
@@ -240,19 +359,18 @@ static int test_rsa_encryption_roundtrip(void) {
  * verification key.
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_ecdh.c
  *
- * @param pub A pointer to the public key
- * @param priv A pointer to the private key
- * @param test_string The string to encode/decode
+ * @param ctx The context holding the keys and the PRNG for the signature
+ * @param primary If true, use EPSK/EPVK, if false, use ESSK/ESVK
  *
  * @returns Zero if successful, -1 otherwise.
  */
-static int test_ecc_sign_roundtrip(bool primary) {
+static int test_ecc_sign_roundtrip(ims_context * ctx, bool primary) {
     int status = 0;
     int i;
     /* NOTE: CS, DS need to be sized to max(EPSK_SIZE, ESSK_SIZE) */
-    static char m[32];
-    static char cs[128];
-    static char ds[128];
+    char m[32];
+    char cs[128];
+    char ds[128];
     mcl_octet M={0,sizeof(m),m};
     mcl_octet CS={0,sizeof(cs),cs};
     mcl_octet DS={0,sizeof(ds),ds};
@@ -265,9 +383,9 @@ static int test_ecc_sign_roundtrip(bool primary) {
         M.val[i] = i;
     }
 
-    status = ecc_sign_message(&M, &CS, &DS, primary);
+    status = ecc_sign_message(ctx, &M, &CS, &DS, primary);
     if (status == 0) {
-        status = ecc_verify_message(&M, &CS, &DS, primary);
+        status = ecc_verify_message(ctx, &M, &CS, &DS, primary);
     }
 #else
     status = -1;
@@ -282,7 +400,9 @@ static int test_ecc_sign_roundtrip(bool primary) {
  *
  * Test an IMS value...
  *
- * @param ims A pointer to the IMS
+ * @param ctx The context holding the IMS, in which to extract the keys
+ * @param db (Optional) The database connection to compare the keys
+ *        against. If NULL, the connection opened by ims_init is used.
  * @param ims_sample_compatibility If true, extracted keys are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, extracted keys use
@@ -290,11 +410,11 @@ static int test_ecc_sign_roundtrip(bool primary) {
  *
  * @returns Zero if successful, errno otherwise.
  */
-int test_ims(uint8_t * ims, bool ims_sample_compatibility) {
+int test_ims(ims_context * ctx, db_reader * db, bool ims_sample_compatibility) {
     int status = 0;
-    static uint8_t  epvk_buf_db[EPVK_SIZE];
-    static uint8_t  esvk_buf_db[ESVK_SIZE];
-    static uint8_t  erpk_mod_buf_db[ERRK_PQ_SIZE*2];
+    uint8_t  epvk_buf_db[EPVK_SIZE];
+    uint8_t  esvk_buf_db[ESVK_SIZE];
+    uint8_t  erpk_mod_buf_db[ERRK_PQ_SIZE*2];
     mcl_octet epvk_db = {0, sizeof(epvk_buf_db), epvk_buf_db};
     mcl_octet esvk_db = {0, sizeof(esvk_buf_db), esvk_buf_db};
     mcl_octet erpk_mod_db = {0, sizeof(erpk_mod_buf_db), erpk_mod_buf_db};
@@ -303,31 +423,37 @@ int test_ims(uint8_t * ims, bool ims_sample_compatibility) {
      * Calculate the Endpoint Unique ID (EP_UID) from the IMS and the
      * private/public keys.
      */
-    calculate_keys(ims, ims_sample_compatibility);
+    calculate_keys(ctx, ims_sample_compatibility);
 
     /* Compare the calculated public keys with those from the database */
-    status = db_get_keyset(&ep_uid, &epvk_db, &esvk_db, &erpk_mod_db);
+    if (db) {
+        status = db_reader_get_keyset(db, &ctx->ep_uid, &epvk_db, &esvk_db,
+                                      &erpk_mod_db);
+    } else {
+        status = db_get_keyset(&ctx->ep_uid, &epvk_db, &esvk_db,
+                               &erpk_mod_db);
+    }
     if (status != SQLITE_OK) {
         fprintf(stderr, "ERROR: Can't find EP_UID in db\n");
-        display_binary_data(ep_uid.val, ep_uid.len, true, "epu_id ");
+        display_binary_data(ctx->ep_uid.val, ctx->ep_uid.len, true, "epu_id ");
         status = -1;
     } else {
-        if (!MCL_OCT_comp(&epvk, &epvk_db)) {
+        if (!MCL_OCT_comp(&ctx->epvk, &epvk_db)) {
             fprintf(stderr, "ERROR: extracted EPVK doesn't match db:\n");
-            display_binary_data(ep_uid.val, ep_uid.len, true, "epu_id ");
-            display_binary_data(epvk.val, epvk.len, true, "epvk     ");
+            display_binary_data(ctx->ep_uid.val, ctx->ep_uid.len, true, "epu_id ");
+            display_binary_data(ctx->epvk.val, ctx->epvk.len, true, "epvk     ");
             status = -1;
         }
-        if (!MCL_OCT_comp(&esvk, &esvk_db)) {
+        if (!MCL_OCT_comp(&ctx->esvk, &esvk_db)) {
             fprintf(stderr, "ERROR: extracted ESVK doesn't match db:\n");
-            display_binary_data(ep_uid.val, ep_uid.len, true, "epu_id ");
-            display_binary_data(esvk.val, esvk.len, true, "esvk     ");
+            display_binary_data(ctx->ep_uid.val, ctx->ep_uid.len, true, "epu_id ");
+            display_binary_data(ctx->esvk.val, ctx->esvk.len, true, "esvk     ");
             status = -1;
         }
-        if (!MCL_OCT_comp(&erpk_mod, &erpk_mod_db)) {
+        if (!MCL_OCT_comp(&ctx->erpk_mod, &erpk_mod_db)) {
             fprintf(stderr, "ERROR: extracted ERPK_MOD doesn't match db\n");
-            display_binary_data(ep_uid.val, ep_uid.len, true, "epu_id ");
-            display_binary_data(erpk_mod.val, erpk_mod.len, true, "erpk_mod ");
+            display_binary_data(ctx->ep_uid.val, ctx->ep_uid.len, true, "epu_id ");
+            display_binary_data(ctx->erpk_mod.val, ctx->erpk_mod.len, true, "erpk_mod ");
             status = -1;
         }
     }
@@ -336,13 +462,13 @@ int test_ims(uint8_t * ims, bool ims_sample_compatibility) {
      * Verify RSA and primary and secondary ECC signing work
      */
     if (status == 0) {
-        status = test_rsa_sign_roundtrip();
+        status = test_rsa_sign_roundtrip(ctx);
     }
     if (status == 0) {
-        status = test_ecc_sign_roundtrip(true);
+        status = test_ecc_sign_roundtrip(ctx, true);
     }
     if (status == 0) {
-        status = test_ecc_sign_roundtrip(false);
+        status = test_ecc_sign_roundtrip(ctx, false);
     }
 
     return status;
@@ -352,7 +478,9 @@ int test_ims(uint8_t * ims, bool ims_sample_compatibility) {
 /**
  * @brief Read and verify an IMS value
  *
- * @param ims_fd The file descriptor of the IMS file
+ * @param ctx The context in which to read and verify the IMS
+ * @param db (Optional) The database connection to use (see test_ims)
+ * @param file The open IMS file
  * @param index Which IMS value to verify (zero-based)
  * @param sample_compatibility_mode If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
@@ -361,22 +489,185 @@ int test_ims(uint8_t * ims, bool ims_sample_compatibility) {
  *
  * @returns Zero if the IMS value verified, errno or -1 otherwise.
  */
-int read_verify_ims(const int ims_fd, const uint32_t index,
-                 bool sample_compatibility_mode) {
-    off_t offset;
+static int read_verify_ims(ims_context * ctx, db_reader * db,
+                           ims_file * file, const uint32_t index,
+                           bool sample_compatibility_mode) {
     int status;
 
-    offset = index * IMS_LINE_SIZE;
     printf("IMS[%u]\n", index);
-    status = ims_read(ims_fd, offset, ims);
+    status = ims_file_read(file, index, ctx->ims);
     if (status == 0) {
-        status = test_ims(ims, sample_compatibility_mode);
+        status = test_ims(ctx, db, sample_compatibility_mode);
     }
 
     return status;
 }
 
 
+/**
+ * @brief Verify IMS values from the work queue until it is empty
+ *
+ * Stops early (without claiming any more work) once any IMS has failed.
+ *
+ * @param ctx The context in which to verify
+ * @param db (Optional) The database connection to use (see test_ims)
+ */
+static void test_drain_queue(ims_context * ctx, db_reader * db) {
+    int status;
+    uint32_t index;
+
+    for (;;) {
+        pthread_mutex_lock(&test_lock);
+        if ((test_status != 0) || (test_next >= test_count)) {
+            pthread_mutex_unlock(&test_lock);
+            break;
+        }
+        index = test_indices? test_indices[test_next] : test_next;
+        test_next++;
+        pthread_mutex_unlock(&test_lock);
+
+        status = read_verify_ims(ctx, db, test_file, index,
+                                 test_compatibility);
+        if (status != 0) {
+            pthread_mutex_lock(&test_lock);
+            if (test_status == 0) {
+                test_status = status;
+            }
+            pthread_mutex_unlock(&test_lock);
+        }
+    }
+}
+
+
+/**
+ * @brief Worker thread body
+ *
+ * @param arg The worker's test_job
+ *
+ * @returns NULL
+ */
+static void * test_worker_thread(void * arg) {
+    test_job * job = arg;
+
+    test_drain_queue(&job->ctx, job->db);
+
+    return NULL;
+}
+
+
+/**
+ * @brief Verify the queued IMS values
+ *
+ * With one job, the IMS values are verified in order on the calling
+ * thread. Otherwise, a pool of worker threads share the queue, each with
+ * its own context, PRNG (seeded from the main PRNG) and database
+ * connection.
+ *
+ * @param num_jobs The number of worker threads
+ *
+ * @returns Zero if all IMS values verified, errno or -1 otherwise.
+ */
+static int test_run_queue(uint32_t num_jobs) {
+    int status = 0;
+    test_job * jobs = NULL;
+    uint32_t num_started = 0;
+    uint8_t seed[TEST_JOB_SEED_SIZE];
+    uint32_t i;
+
+    test_next = 0;
+    test_status = 0;
+
+    if (num_jobs > test_count) {
+        num_jobs = test_count;
+    }
+    if (num_jobs <= 1) {
+        test_drain_queue(&test_ctx, NULL);
+        return test_status;
+    }
+
+    jobs = calloc(num_jobs, sizeof(*jobs));
+    if (!jobs) {
+        fprintf(stderr, "ERROR: Can't allocate %u test jobs\n", num_jobs);
+        return ENOMEM;
+    }
+
+    for (i = 0; (status == 0) && (i < num_jobs); i++) {
+        ims_context_init(&jobs[i].ctx);
+        MCL_RAND_bytes(&test_ctx.rng, (char *)seed, sizeof(seed));
+        MCL_RAND_seed(&jobs[i].ctx.rng, sizeof(seed), (char *)seed);
+        status = db_reader_open(test_database_name, &jobs[i].db);
+    }
+
+    for (i = 0; (status == 0) && (i < num_jobs); i++) {
+        if (pthread_create(&jobs[i].thread, NULL, test_worker_thread,
+                           &jobs[i]) != 0) {
+            fprintf(stderr, "ERROR: Can't start test job %u\n", i);
+            status = EAGAIN;
+            break;
+        }
+        num_started++;
+    }
+
+    /* If we couldn't start them all, the ones we did start drain the queue */
+    for (i = 0; i < num_started; i++) {
+        pthread_join(jobs[i].thread, NULL);
+    }
+    if ((status == 0) || (num_started > 0)) {
+        status = test_status;
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+        db_reader_close(jobs[i].db);
+        ims_context_deinit(&jobs[i].ctx);
+    }
+    free(jobs);
+
+    return status;
+}
+
+
+/**
+ * @brief Draw a random sample of unique IMS indices
+ *
+ * Uses Floyd's algorithm, with a bitmap of the indices drawn so far, so the
+ * cost is linear in the sample size regardless of how many indices repeat.
+ *
+ * @param num_available The number of indices to draw from
+ * @param num_samples The number of indices to draw (<= num_available)
+ * @param samples Where to store the drawn indices
+ *
+ * @returns Zero if successful, errno otherwise.
+ */
+static int test_draw_sample(uint32_t num_available, uint32_t num_samples,
+                            uint32_t * samples) {
+    uint8_t * drawn;
+    uint32_t i;
+    uint32_t j;
+    uint32_t r;
+
+    drawn = calloc((num_available + 7) / 8, 1);
+    if (!drawn) {
+        return ENOMEM;
+    }
+
+    /**
+     * For each j in [N-n, N), draw r from [0, j]; if r was already drawn,
+     * take j instead (which can't have been, as all earlier draws are < j).
+     */
+    for (i = 0, j = num_available - num_samples; i < num_samples; i++, j++) {
+        r = rand32(&test_ctx) % (j + 1);
+        if (drawn[r / 8] & (1 << (r % 8))) {
+            r = j;
+        }
+        drawn[r / 8] |= 1 << (r % 8);
+        samples[i] = r;
+    }
+
+    free(drawn);
+    return 0;
+}
+
+
 /**
  * @brief Test a representative sample of IMS values
  *
@@ -386,6 +677,7 @@ int read_verify_ims(const int ims_fd, const uint32_t index,
  *
  * @param ims_filename The name of the IMS input file
  * @param num_ims The number of IMS values to test
+ * @param num_jobs The number of worker threads to verify with
  * @param sample_compatibility_mode If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, generate the IMS value using
@@ -394,27 +686,21 @@ int read_verify_ims(const int ims_fd, const uint32_t index,
  * @returns Zero if all tested IMS values verify, errno or -1 otherwise.
  */
 int test_ims_set(const char * ims_filename, uint32_t num_ims,
-                 bool sample_compatibility_mode) {
+                 uint32_t num_jobs, bool sample_compatibility_mode) {
     int status = 0;
-    int ims_fd;
-    uint32_t i;
-    uint32_t j;
-    uint32_t index;
-    uint32_t r;
-    bool unique;
-    off_t offset;
+    ims_file file;
     int num_available_ims;
-    int * test_set = NULL;
-    struct stat ims_stat = {0};
+    uint32_t * test_set = NULL;
 
-    ims_fd = open(ims_filename, O_RDONLY);
-    if (ims_fd  == -1) {
-        fprintf(stderr, "ERROR: Can't open IMS file '%s'\n", ims_filename);
-        status = errno;
-    } else {
+    status = ims_file_open(&file, ims_filename);
+    if (status == 0) {
         /* Determine how many IMS values are in the file. */
-        num_available_ims = num_ims_in_file(ims_filename);
-        if (num_available_ims > 0) {
+        num_available_ims = file.num_ims;
+        if (!ims_file_seed_matches(&file)) {
+            fprintf(stderr,
+                    "ERROR: IMS file was generated from a different seed\n");
+            status = EINVAL;
+        } else if (num_available_ims > 0) {
             if (num_ims > num_available_ims) {
                 fprintf(stderr, "Warning: IMS file only contains %d entr%s\n",
                         num_available_ims,
@@ -427,54 +713,35 @@ int test_ims_set(const char * ims_filename, uint32_t num_ims,
                             " (compatible with initial 100 IMS samples)" :
                             "");
 
-            if (num_ims >= num_available_ims) {
-                /* Sequentially scan all IMS */
-                for (i = 0; (i < num_ims) && (status == 0); i++) {
-                    status = read_verify_ims(ims_fd, i,
-                                             sample_compatibility_mode);
-                }
-            } else {
-                /* Randomly draw and verify N IMS values from the IMS file */
+            if (num_ims < (uint32_t)num_available_ims) {
+                /* Randomly draw N unique IMS values from the IMS file */
                 test_set = calloc(num_ims, sizeof(*test_set));
-                if (test_set) {
-                    /* Randomly draw N unique IMS values */
-                    /* Create a set of unique indices */
-                    for (i = 0; (i < num_ims) && (status == 0); i++) {
-                        do {
-                            unique = true;
-                            /* Draw a random index and check for uniqueness */
-                            r = rand32() % num_available_ims;
-                            for (j = 0; j < i; j++) {
-                                if (r == test_set[j]) {
-                                    /* Duplicate, draw again */
-                                    unique = false;
-                                    break;
-                                }
-                            }
-                        } while (!unique);
-                        test_set[i] = r;
-                    }
-                    /* Process the set of unique indices */
-                    for (i = 0; (i < num_ims) && (status == 0); i++) {
-                        status = read_verify_ims(ims_fd, test_set[i],
-                                                 sample_compatibility_mode);
-                    }
-                    free(test_set);
+                if (!test_set) {
+                    status = ENOMEM;
                 } else {
-                    /* Draw N IMS values, with some risk of duplication */
-                    fprintf(stderr,
-                            "Warning: random sampling may have duplicates\n");
-                    for (i = 0; (i < num_ims) && (status == 0); i++) {
-                        /* Randomly draw IMS */
-                        status = read_verify_ims(ims_fd,
-                                                 rand32() % num_available_ims,
-                                                 sample_compatibility_mode);
-                     }
+                    status = test_draw_sample(num_available_ims, num_ims,
+                                              test_set);
                 }
+                if (status != 0) {
+                    fprintf(stderr, "ERROR: Can't draw %u IMS samples\n",
+                            num_ims);
+                }
+            }
+
+            /* Verify the sample (or sequentially scan all IMS) */
+            if (status == 0) {
+                test_file = &file;
+                test_indices = test_set;
+                test_count = num_ims;
+                test_compatibility = sample_compatibility_mode;
+                status = test_run_queue(num_jobs);
+                test_file = NULL;
+                test_indices = NULL;
             }
+            free(test_set);
         }
 
-        close (ims_fd);
+        ims_file_close(&file);
     }
 
     return status;
@@ -36,6 +36,8 @@
 #ifndef _IMS_TEST_H
 #define _IMS_TEST_H
 
+/* Upper limit on the number of verification threads */
+#define IMS_TEST_JOBS_MAX   256
 
 
 /**
@@ -64,6 +66,17 @@ int ims_init(const char * prng_seed_file,
 void ims_deinit(void);
 
 
+/**
+ * @brief Check that batched primality verdicts match single ones
+ *
+ * Runs candidates with known answers through MCL_FF_prime_batch and
+ * MCL_FF_prime_test under each test profile.
+ *
+ * @returns Zero if every verdict is right, EIO otherwise.
+ */
+int test_prime_verdicts(void);
+
+
 /**
  * @brief Test a representative sample of IMS values
  *
@@ -73,6 +86,8 @@ void ims_deinit(void);
  *
  * @param ims_filename The name of the IMS input file
  * @param num_ims The number of IMS values to test
+ * @param num_jobs The number of worker threads to verify with (each with
+ *        its own database connection)
  * @param ims_sample_compatibility If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, generate the IMS value using
@@ -81,6 +96,6 @@ void ims_deinit(void);
  * @returns Zero if all tested IMS values verify, errno otherwise.
  */
 int test_ims_set(const char * ims_filename, uint32_t num_ims,
-                 bool ims_sample_compatibility);
+                 uint32_t num_jobs, bool ims_sample_compatibility);
 
 #endif /* !_IMS_TEST_H */
@@ -65,6 +65,9 @@
 /* Uncomment the following define to enable IMS diagnostic messages */
 /*#define IMS_DEBUGMSG*/
 
+/* The IMS, keys and PRNG being tested */
+static ims_context test_ctx;
+
 
 /**
  * @brief Initialize the IMS generation subsystem
@@ -91,7 +94,8 @@ int ims_init(const char * prng_seed_file,
     if (status != 0) {
         goto ims_init_err;
     }
-    MCL_RAND_seed(&rng, prng_seed_length, prng_seed_buffer);
+    ims_context_init(&test_ctx);
+    MCL_RAND_seed(&test_ctx.rng, prng_seed_length, prng_seed_buffer);
 
     /* Open the key database */
     if (database_name) {
@@ -116,6 +120,7 @@ void ims_deinit(void) {
     /* Close the key database */
     db_deinit();
 
+    ims_context_deinit(&test_ctx);
     ims_common_deinit();
 }
 
@@ -132,12 +137,12 @@ void ims_deinit(void) {
  */
 static int rsa_sign_save(mcl_octet * message) {
     int status = 0;
-    static char c[MCL_RFS];
-    static char s[MCL_RFS];
+    static char c[RSA_OCTET_SIZE];
+    static char s[RSA_OCTET_SIZE];
     mcl_octet S={0,sizeof(s),s};
     mcl_octet C={0, sizeof(c), c};
 
-    status = rsa_sign_message(message, &S);
+    status = rsa_sign_message(&test_ctx, message, &S);
     if (status == 0) {
         /* write the signature to a file */
         status = write_octets(FNAME_RSA_SIG, &S, 1);
@@ -166,7 +171,8 @@ static int ecc_sign_save(mcl_octet * message, bool primary) {
     mcl_octet CS_DS[2] = {{0, sizeof(cs),cs}, {0, sizeof(ds),ds}};
 
 #if MCL_CURVETYPE!=MCL_MONTGOMERY
-    status = ecc_sign_message(message, &CS_DS[0], &CS_DS[1], primary);
+    status = ecc_sign_message(&test_ctx, message, &CS_DS[0], &CS_DS[1],
+                              primary);
     if (status == 0) {
         /* Write the CS & CDS signature buffers to a file */
         status = write_octets(primary? FNAME_ECC_PRIMARY_SIG :
@@ -210,7 +216,7 @@ int test_ims_signing(const char * message_filename,
     mcl_octet message={0, 0, NULL};
 
     /* Obtain the IMS value */
-    status = get_ims(ims_binascii, ims_filename, ims_index, ims);
+    status = get_ims(ims_binascii, ims_filename, ims_index, test_ctx.ims);
 
     /* Read in the message to be signed */
     if (status == 0) {
@@ -220,15 +226,16 @@ int test_ims_signing(const char * message_filename,
     /* Extract our signing keys from the IMS and use them to sign the message */
     if (status == 0) {
         /* RSA signing */
-        calculate_keys(ims, sample_compatibility_mode);
-        status = write_octets(FNAME_EP_UID, &ep_uid, 1);
+        calculate_keys(&test_ctx, sample_compatibility_mode);
+        status = write_octets(FNAME_EP_UID, &test_ctx.ep_uid, 1);
 
-        display_binary_data(ep_uid.val, ep_uid.len, true, "ep_uid ");
+        display_binary_data(test_ctx.ep_uid.val, test_ctx.ep_uid.len, true,
+                            "ep_uid ");
 #if 0
         /* optionally print the keys for debugging */
-        display_binary_data(epvk.val, epvk.len, true, "epvk   ");
-        display_binary_data(esvk.val, esvk.len, true, "esvk   ");
-        display_binary_data(erpk_mod.val, erpk_mod.len, true, "erpk   ");
+        display_binary_data(test_ctx.epvk.val, test_ctx.epvk.len, true, "epvk   ");
+        display_binary_data(test_ctx.esvk.val, test_ctx.esvk.len, true, "esvk   ");
+        display_binary_data(test_ctx.erpk_mod.val, test_ctx.erpk_mod.len, true, "erpk   ");
 #endif
 
     }
@@ -65,6 +65,9 @@
 /* Uncomment the following define to enable IMS diagnostic messages */
 /*#define IMS_DEBUGMSG*/
 
+/* The IMS, keys and PRNG being tested */
+static ims_context test_ctx;
+
 
 /**
  * @brief Initialize the IMS generation subsystem
@@ -102,7 +105,8 @@ int ims_init(const char * prng_seed_file,
     if (status != 0) {
         goto ims_init_err;
     }
-    MCL_RAND_seed(&rng, prng_seed_length, prng_seed_buffer);
+    ims_context_init(&test_ctx);
+    MCL_RAND_seed(&test_ctx.rng, prng_seed_length, prng_seed_buffer);
 
     /* Open the key database */
     if (database_name) {
@@ -126,6 +130,7 @@ void ims_deinit(void) {
     /* Close the key database */
     db_deinit();
 
+    ims_context_deinit(&test_ctx);
     ims_common_deinit();
 }
 
@@ -145,12 +150,12 @@ void ims_deinit(void) {
  */
 static int rsa_read_verify(const char * fname, mcl_octet * message) {
     int status = 0;
-    static char s[MCL_RFS];
+    static char s[RSA_OCTET_SIZE];
     mcl_octet S={0, sizeof(s), s};
 
     status = read_octets(fname, &S, 1);
     if (status == 0) {
-        status = rsa_verify_message(message, &S);
+        status = rsa_verify_message(&test_ctx, message, &S);
         if (status == 0) {
             printf("ERRK verified OK\n");
         } else {
@@ -184,7 +189,8 @@ static int ecc_read_verify(const char * fname, mcl_octet * message, bool primary
     read_octets(fname, CS_DS, 2);
     if (status == 0) {
 #if MCL_CURVETYPE!=MCL_MONTGOMERY
-        status = ecc_verify_message(message, &CS_DS[0], &CS_DS[1], primary);
+        status = ecc_verify_message(&test_ctx, message, &CS_DS[0], &CS_DS[1],
+                                    primary);
         if (status == 0) {
             printf("%s verified OK\n", primary? "EPSK/EPVK" : "ESSK/ESVK");
         } else {
@@ -228,21 +234,23 @@ int test_ims_verify(const char * message_filename,
 
     /* Read in the EP_UID */
     if (status == 0) {
-        status = read_octets(ep_uid_filename, &ep_uid, 1);
+        status = read_octets(ep_uid_filename, &test_ctx.ep_uid, 1);
     }
 
     /* Use the EP_UID to fetch the key set from the database */
     if (status == 0) {
-        status = db_get_keyset(&ep_uid, &epvk, &esvk, &erpk_mod);
-        rsa_public.e = ERPK_EXPONENT;
-        MCL_FF_fromOctet_C25519(rsa_public.n, &erpk_mod, MCL_FFLEN);
+        status = db_get_keyset(&test_ctx.ep_uid, &test_ctx.epvk,
+                               &test_ctx.esvk, &test_ctx.erpk_mod);
+        test_ctx.rsa_public.e = ERPK_EXPONENT;
+        MCL_FF_fromOctet_C25519(test_ctx.rsa_public.n, &test_ctx.erpk_mod,
+                                MCL_FFLEN);
    }
 #if 0
     /* Optionally display the ep_uid & keys for debugging */
-    display_binary_data(ep_uid.val, ep_uid.len, true, "ep_uid ");
-    display_binary_data(epvk.val, epvk.len, true, "epvk   ");
-    display_binary_data(esvk.val, esvk.len, true, "esvk   ");
-    display_binary_data(erpk_mod.val, erpk_mod.len, true, "erpk   ");
+    display_binary_data(test_ctx.ep_uid.val, test_ctx.ep_uid.len, true, "ep_uid ");
+    display_binary_data(test_ctx.epvk.val, test_ctx.epvk.len, true, "epvk   ");
+    display_binary_data(test_ctx.esvk.val, test_ctx.esvk.len, true, "esvk   ");
+    display_binary_data(test_ctx.erpk_mod.val, test_ctx.erpk_mod.len, true, "erpk   ");
 #endif
 
     /* Read in the message to be signed */
@@ -59,6 +59,7 @@
 #include "db.h"
 #include "ims_common.h"
 #include "ims_io.h"
+#include "ims_test_core.h"
 #include "ims_test.h"
 
 /* Uncomment the following define to enable IMS diagnostic messages */
@@ -68,10 +69,8 @@
 /**
  * @brief Calculate the Endpoint Rsa pRivate Key (ERRK)
  *
- * @param y2 A pointer to the Y2 term used by all
- * @param ims A pointer to the ims (the upper 3 bytes will be modified)
- * @param erpk_mod A pointer to a buffer to store the modulus for ERPK
- * @param errk_d A pointer to a buffer to store the  ERPK decryption exponent
+ * @param ctx The context holding the IMS and Y2, in which to store the
+ *        ERRK/ERPK
  * @param ims_sample_compatibility If true, generate IMS values that are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, generate the IMS value using
@@ -79,10 +78,7 @@
  *
  * @returns Zero if successful, errno otherwise.
  */
-static int calc_errk(uint8_t * y2,
-                     uint8_t * ims,
-                     mcl_octet * erpk_mod,
-                     mcl_octet * errk_d,
+static int calc_errk(ims_context * ctx,
                      bool ims_sample_compatibility) {
     int status = 0;
     uint32_t p_bias;
@@ -108,30 +104,31 @@ static int calc_errk(uint8_t * y2,
      *  ERRK_Q[0] |= 0x01
      *    :
      */
-    calc_errk_pq_bias_odd(y2, ims, &errk_p, &errk_q, ims_sample_compatibility);
+    calc_errk_pq_bias_odd(ctx->y2, ctx->ims, &ctx->errk_p, &ctx->errk_q,
+                          ims_sample_compatibility);
 
 
     /* Convert P & Q to FF format */
     if (ims_sample_compatibility) {
         /* Used in first 100 IMS samples */
-        ff_from_big_endian_octet(p_ff, &errk_p, MCL_HFLEN);
-        ff_from_big_endian_octet(q_ff, &errk_q, MCL_HFLEN);
+        ff_from_big_endian_octet(ctx->p_ff, &ctx->errk_p, MCL_HFLEN);
+        ff_from_big_endian_octet(ctx->q_ff, &ctx->errk_q, MCL_HFLEN);
     } else {
         /* Used subsequent to the first 100 IMS samples */
-        ff_from_little_endian_octet(p_ff, &errk_p, MCL_HFLEN);
-        ff_from_little_endian_octet(q_ff, &errk_q, MCL_HFLEN);
+        ff_from_little_endian_octet(ctx->p_ff, &ctx->errk_p, MCL_HFLEN);
+        ff_from_little_endian_octet(ctx->q_ff, &ctx->errk_q, MCL_HFLEN);
     }
 
 
     /* Extract the P & Q bias from IMS[32:34] */
-    pq_bias = ims[32] | (ims[33] << 8) | (ims[34] << 16);
+    pq_bias = ctx->ims[32] | (ctx->ims[33] << 8) | (ctx->ims[34] << 16);
     p_bias = ((pq_bias / 4096) * odd_mod);
     q_bias = ((pq_bias % 4096) * odd_mod);
 
 
     /* Bias P & Q */
-    MCL_FF_inc_C25519(p_ff, p_bias, MCL_HFLEN);
-    MCL_FF_inc_C25519(q_ff, q_bias, MCL_HFLEN);
+    MCL_FF_inc_C25519(ctx->p_ff, p_bias, MCL_HFLEN);
+    MCL_FF_inc_C25519(ctx->q_ff, q_bias, MCL_HFLEN);
 
     /**
      * Generate the public and private exponents
@@ -149,12 +146,13 @@ static int calc_errk(uint8_t * y2,
      *   - priv_key.dq  decrypting exponent mod (q-1)
      *   - priv_key.c   1/p mod q
      */
-    MCL_FF_copy_C25519(rsa_private.p, p_ff, MCL_HFLEN);
-    MCL_FF_copy_C25519(rsa_private.q, q_ff, MCL_HFLEN);
-    rsa_secret(&rsa_private, &rsa_public, ERPK_EXPONENT, ims_sample_compatibility);
+    MCL_FF_copy_C25519(ctx->rsa_private.p, ctx->p_ff, MCL_HFLEN);
+    MCL_FF_copy_C25519(ctx->rsa_private.q, ctx->q_ff, MCL_HFLEN);
+    rsa_secret(&ctx->rsa_private, &ctx->rsa_public, ERPK_EXPONENT,
+               ims_sample_compatibility);
 
     /* Convert the calculated FF nums back into octets for later use */
-    MCL_FF_toOctet_C25519(erpk_mod, rsa_public.n, MCL_FFLEN);
+    MCL_FF_toOctet_C25519(&ctx->erpk_mod, ctx->rsa_public.n, MCL_FFLEN);
 
     return status;
 }
@@ -163,7 +161,7 @@ static int calc_errk(uint8_t * y2,
 /**
  * @brief Calculate the EP_UID and our keys.
  *
- * @param ims A pointer to the IMS
+ * @param ctx The context holding the IMS, in which to store the keys
  * @param ims_sample_compatibility If true, extracted keys are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, extracted keys use
@@ -171,25 +169,25 @@ static int calc_errk(uint8_t * y2,
  *
  * @returns Zero if successful, errno otherwise.
  */
-void calculate_keys(uint8_t ims[IMS_SIZE],
+void calculate_keys(ims_context * ctx,
                     bool ims_sample_compatibility) {
 
     /**
      * Calculate the Endpoint Unique ID (EP_UID) from the IMS and the
      * private/public keys.
      */
-    calculate_epuid_es3(ims, &ep_uid);
-    ep_uid.len = EP_UID_SIZE;
+    calculate_epuid_es3(ctx->ims, &ctx->ep_uid);
+    ctx->ep_uid.len = EP_UID_SIZE;
 
     /* Calculate "Y2", used in generating EPSK, MPDK, ERRK, EPCK, ERGS */
-    calculate_y2(ims, y2);
+    calculate_y2(ctx->ims, ctx->y2);
 
     /* Calculate ERRK/ERPK, EPSK/EPVK and  ESSK/ESVK */
-    calc_epsk(y2, &epsk);
-    calc_epvk(&epsk, &epvk);
-    calc_essk(y2, &essk, ims_sample_compatibility);
-    calc_esvk(&essk, &esvk);
-    calc_errk(y2, ims, &erpk_mod, &errk_d, ims_sample_compatibility);
+    calc_epsk(ctx->y2, &ctx->epsk);
+    calc_epvk(&ctx->epsk, &ctx->epvk);
+    calc_essk(ctx->y2, &ctx->essk, ims_sample_compatibility);
+    calc_esvk(&ctx->essk, &ctx->esvk);
+    calc_errk(ctx, ims_sample_compatibility);
 }
 
 
@@ -199,16 +197,18 @@ void calculate_keys(uint8_t ims[IMS_SIZE],
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_rsa.c
  *
+ * @param ctx The context holding the keys (see calculate_keys)
  * @param message The message to sign
  * @param signature The generated signature (must point to a
- *        MCL_RFS-byte buffer)
+ *        RSA_OCTET_SIZE-byte buffer)
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int rsa_sign_message(mcl_octet * message,
+int rsa_sign_message(ims_context * ctx,
+                     mcl_octet * message,
                      mcl_octet * signature) {
     int status = 0;
-    static char c[MCL_RFS];
+    char c[RSA_OCTET_SIZE];
     mcl_octet C={0,sizeof(c),c};
 
     /* PKCS V1.5 padding of a message prior to RSA signature M -> C */
@@ -217,7 +217,7 @@ int rsa_sign_message(mcl_octet * message,
         status = -1;
     } else {
         /* create signature C -> S */
-        MCL_RSA_DECRYPT_RSA2048(&rsa_private, &C, signature);
+        MCL_RSA_DECRYPT_RSA2048(&ctx->rsa_private, &C, signature);
     }
 
     return status;
@@ -229,16 +229,18 @@ int rsa_sign_message(mcl_octet * message,
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_rsa.c
  *
+ * @param ctx The context holding the keys (see calculate_keys)
  * @param message The message to verify
  * @param signature The signature for the message
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int rsa_verify_message(mcl_octet * message,
+int rsa_verify_message(ims_context * ctx,
+                       mcl_octet * message,
                        mcl_octet * signature) {
     int status = 0;
-    static char c[MCL_RFS];
-    static char ml[MCL_RFS];
+    char c[RSA_OCTET_SIZE];
+    char ml[RSA_OCTET_SIZE];
     mcl_octet ML={0, sizeof(ml), ml};
     mcl_octet C={0,sizeof(c),c};
 
@@ -249,7 +251,7 @@ int rsa_verify_message(mcl_octet * message,
         status = -1;
     } else {
         /* Verify the signature */
-        MCL_RSA_ENCRYPT_RSA2048(&rsa_public, signature, &ML);
+        MCL_RSA_ENCRYPT_RSA2048(&ctx->rsa_public, signature, &ML);
         if (MCL_OCT_comp(&C, &ML)) {
             status = 0;
         } else {
@@ -269,6 +271,7 @@ int rsa_verify_message(mcl_octet * message,
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_ecdh.c
  *
+ * @param ctx The context holding the keys and the PRNG for the signature
  * @param message The message to sign
  * @param signature_c The generated signature (must point to an
  *        EPSK_SIZE-byte buffer for primary signing,  or an
@@ -280,7 +283,8 @@ int rsa_verify_message(mcl_octet * message,
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int ecc_sign_message(mcl_octet * message,
+int ecc_sign_message(ims_context * ctx,
+             mcl_octet * message,
              mcl_octet * signature_c,
              mcl_octet * signature_d,
              bool primary) {
@@ -296,15 +300,15 @@ int ecc_sign_message(mcl_octet * message,
      */
     if (primary) {
         mcl_status = MCL_ECPSP_DSA_C448(MCL_HASH_TYPE_ECC,
-                                        &rng,
-                                        &epsk,
+                                        &ctx->rng,
+                                        &ctx->epsk,
                                         message,
                                         signature_c,
                                         signature_d);
     } else {
         mcl_status = MCL_ECPSP_DSA_C25519(MCL_HASH_TYPE_ECC,
-                                          &rng,
-                                          &essk,
+                                          &ctx->rng,
+                                          &ctx->essk,
                                           message,
                                           signature_c,
                                           signature_d);
@@ -327,6 +331,7 @@ int ecc_sign_message(mcl_octet * message,
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_ecdh.c
  *
+ * @param ctx The context holding the keys (see calculate_keys)
  * @param message The message to verify
  * @param signature_c The generated signature (must point to an
  *        EPSK_SIZE-byte buffer for primary signing,  or an
@@ -338,7 +343,8 @@ int ecc_sign_message(mcl_octet * message,
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int ecc_verify_message(mcl_octet * message,
+int ecc_verify_message(ims_context * ctx,
+               mcl_octet * message,
                mcl_octet * signature_c,
                mcl_octet * signature_d,
                bool primary) {
@@ -347,9 +353,9 @@ int ecc_verify_message(mcl_octet * message,
     int i;
     char * key_name = primary? "Primary" : "Secondary";
     /* NOTE: CS, DS need to be sized to max(EPSK_SIZE, ESSK_SIZE) */
-    static char m[32];
-    static char cs[128];
-    static char ds[128];
+    char m[32];
+    char cs[128];
+    char ds[128];
     mcl_octet M={0,sizeof(m),m};
     mcl_octet CS={0,sizeof(cs),cs};
     mcl_octet DS={0,sizeof(ds),ds};
@@ -361,13 +367,13 @@ int ecc_verify_message(mcl_octet * message,
      */
     if (primary) {
         mcl_status = MCL_ECPVP_DSA_C448(MCL_HASH_TYPE_ECC,
-                                        &epvk,
+                                        &ctx->epvk,
                                         message,
                                         signature_c,
                                         signature_d);
     } else {
         mcl_status = MCL_ECPVP_DSA_C25519(MCL_HASH_TYPE_ECC,
-                                          &esvk,
+                                          &ctx->esvk,
                                           message,
                                           signature_c,
                                           signature_d);
@@ -400,13 +406,17 @@ int ecc_verify_message(mcl_octet * message,
 /**
  * @brief Generate a cryptographically good 32-bit random number
  *
+ * @param ctx The context whose PRNG to draw from
+ *
  * @returns 32 wonderfully random bits
  */
-uint32_t rand32(void) {
+uint32_t rand32(ims_context * ctx) {
     uint32_t r;
 
-    r = (MCL_RAND_byte(&rng) << 24) |
-        (MCL_RAND_byte(&rng) << 16) |
-        (MCL_RAND_byte(&rng) << 8) |
-        MCL_RAND_byte(&rng);
+    r = (MCL_RAND_byte(&ctx->rng) << 24) |
+        (MCL_RAND_byte(&ctx->rng) << 16) |
+        (MCL_RAND_byte(&ctx->rng) << 8) |
+        MCL_RAND_byte(&ctx->rng);
+
+    return r;
 }
@@ -44,31 +44,10 @@
 #define FNAME_ECC_SECONDARY_SIG "ESVK.sig"
 
 
-/**
- * @brief Calculate the Endpoint Rsa pRivate Key (ERRK)
- *
- * @param y2 A pointer to the Y2 term used by all
- * @param ims A pointer to the ims (the upper 3 bytes will be modified)
- * @param erpk_mod A pointer to a buffer to store the modulus for ERPK
- * @param errk_d A pointer to a buffer to store the  ERPK decryption exponent
- * @param ims_sample_compatibility If true, generate IMS values that are
- *        compatible with the original (incorrect) 100 sample values sent
- *        to Toshiba 2016/01/14. If false, generate the IMS value using
- *        the correct form.
- *
- * @returns Zero if successful, errno otherwise.
- */
-int calc_errk(uint8_t * y2,
-              uint8_t * ims,
-              mcl_octet * erpk_mod,
-              mcl_octet * errk_d,
-              bool ims_sample_compatibility);
-
-
 /**
  * @brief Calculate the EP_UID and our keys.
  *
- * @param ims A pointer to the IMS
+ * @param ctx The context holding the IMS, in which to store the keys
  * @param ims_sample_compatibility If true, extracted keys are
  *        compatible with the original (incorrect) 100 sample values sent
  *        to Toshiba 2016/01/14. If false, extracted keys use
@@ -76,7 +55,7 @@ int calc_errk(uint8_t * y2,
  *
  * @returns Zero if successful, errno otherwise.
  */
-void calculate_keys(uint8_t ims[IMS_SIZE],
+void calculate_keys(ims_context * ctx,
                     bool ims_sample_compatibility);
 
 
@@ -85,13 +64,15 @@ void calculate_keys(uint8_t ims[IMS_SIZE],
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_rsa.c
  *
+ * @param ctx The context holding the keys (see calculate_keys)
  * @param message The message to sign
  * @param signature The generated signature (must point to a
- *        MCL_RFS-byte buffer)
+ *        RSA_OCTET_SIZE-byte buffer)
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int rsa_sign_message(mcl_octet * message,
+int rsa_sign_message(ims_context * ctx,
+                     mcl_octet * message,
                      mcl_octet * signature);
 
 
@@ -100,12 +81,14 @@ int rsa_sign_message(mcl_octet * message,
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_rsa.c
  *
+ * @param ctx The context holding the keys (see calculate_keys)
  * @param message The message to verify
  * @param signature The signature for the message
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int rsa_verify_message(mcl_octet * message,
+int rsa_verify_message(ims_context * ctx,
+                       mcl_octet * message,
                        mcl_octet * signature);
 
 
@@ -114,6 +97,7 @@ int rsa_verify_message(mcl_octet * message,
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_ecdh.c
  *
+ * @param ctx The context holding the keys and the PRNG for the signature
  * @param message The message to sign
  * @param signature_c The generated signature (must point to an
  *        EPSK_SIZE-byte buffer for primary signing,  or an
@@ -125,7 +109,8 @@ int rsa_verify_message(mcl_octet * message,
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int ecc_sign_message(mcl_octet * message,
+int ecc_sign_message(ims_context * ctx,
+             mcl_octet * message,
              mcl_octet * signature_c,
              mcl_octet * signature_d,
              bool primary);
@@ -136,6 +121,7 @@ int ecc_sign_message(mcl_octet * message,
  *
  * This code is borrowed from MIRACL's ...MIRACL/src/tests/test_ecdh.c
  *
+ * @param ctx The context holding the keys (see calculate_keys)
  * @param message The message to verify
  * @param signature_c The generated signature (must point to an
  *        EPSK_SIZE-byte buffer for primary signing,  or an
@@ -147,7 +133,8 @@ int ecc_sign_message(mcl_octet * message,
  *
  * @returns Zero if successful, -1 otherwise.
  */
-int ecc_verify_message(mcl_octet * message,
+int ecc_verify_message(ims_context * ctx,
+               mcl_octet * message,
                mcl_octet * signature_c,
                mcl_octet * signature_d,
                bool primary);
@@ -156,8 +143,10 @@ int ecc_verify_message(mcl_octet * message,
 /**
  * @brief Generate a cryptographically good 32-bit random number
  *
+ * @param ctx The context whose PRNG to draw from
+ *
  * @returns 32 wonderfully random bits
  */
-uint32_t rand32(void);
+uint32_t rand32(ims_context * ctx);
 
 #endif /* !_IMS_TEST_CORE_H */
@@ -48,10 +48,19 @@
 #include <time.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <openssl/evp.h>    /* for EVP_MAX_MD_SIZE */
 #include "util.h"
 #include "parse_support.h"
+#include "mcl_arch.h"
+#include "mcl_oct.h"
+#include "mcl_ecdh.h"
+#include "mcl_rand.h"
+#include "mcl_rsa.h"
 #include "crypto.h"
+#include "ims_common.h"
 #include "ims.h"
+#include "ims_jobs.h"
+#include "ims_metrics.h"
 
 
 /* Program return values */
@@ -63,17 +72,59 @@
 /* Parsing args */
 static int      sample_compatibility_mode = 0;
 static int      num_ims;
+static int      num_jobs;
+static int      db_batch_size;
+static int      db_wal_mode = 0;
+static int      print_stats = 0;
+static int      resume = 0;
+static int      progress_interval;
+static char *   metrics_json_filename;
 static char *   database_name;
 static char *   ims_filename;
 static char *   prng_seed_filename;
 static char *   prng_seed_string;
+static char *   shard_string;
+static char *   uid_filter_filename;
+static char *   ims_format_name;
+static uint32_t ims_format = IMS_FORMAT_TEXT;
+static char *   prime_test_name;
+static uint32_t prime_test = MCL_FF_PRIME_BPSW;
+
+static const parse_entry ims_formats[] = {
+    { "text", IMS_FORMAT_TEXT },
+    { "bin",  IMS_FORMAT_BIN },
+    { NULL, 0 }
+};
+
+static const parse_entry prime_tests[] = {
+    { "bpsw", MCL_FF_PRIME_BPSW },
+    { "mr",   MCL_FF_PRIME_MR },
+    { NULL, 0 }
+};
+
+/* The range of IMS indices this run generates (see --shard) */
+static uint32_t shard_index;
+static uint32_t num_shards = 1;
+static uint32_t first_ims;
+static uint32_t shard_num_ims;
 
 static char *   sample_compatibility_mode_names[] = { "compatibility", NULL };
 static char *   num_ims_names[] = { "num", "num-ims", NULL };
+static char *   num_jobs_names[] = { "jobs", NULL };
+static char *   db_batch_size_names[] = { "db-batch", NULL };
+static char *   db_wal_mode_names[] = { "db-wal", NULL };
+static char *   print_stats_names[] = { "stats", NULL };
+static char *   resume_names[] = { "resume", NULL };
+static char *   progress_interval_names[] = { "progress", NULL };
+static char *   metrics_json_names[] = { "metrics-json", NULL };
 static char *   database_name_names[] = { "db", "database", NULL };
 static char *   ims_filename_names[] = { "out", "ims", NULL };
 static char *   prng_seed_filename_names[] = { "seed-file", NULL };
 static char *   prng_seed_string_names[] = { "seed", NULL };
+static char *   shard_names[] = { "shard", NULL };
+static char *   uid_filter_names[] = { "uid-filter", NULL };
+static char *   ims_format_names[] = { "format", NULL };
+static char *   prime_test_names[] = { "prime-test", NULL };
 
 
 /* Parsing table */
@@ -81,6 +132,22 @@ static struct optionx parse_table[] = {
     { 'n', num_ims_names, NULL,
       &num_ims, 0, REQUIRED, &store_hex, false,
       "The number of IMS values to generate" },
+    { 'j', num_jobs_names, NULL,
+      &num_jobs, 1, DEFAULT_VAL, &store_hex, false,
+      "The number of IMS generation threads (default 1)" },
+    { 'S', print_stats_names, NULL,
+      &print_stats, 0, STORE_TRUE, NULL, false,
+      "Print the run's metrics at the end of the run (and, with --jobs, "
+      "the pipeline's queue statistics)" },
+    { 'p', progress_interval_names, "seconds",
+      &progress_interval, 60, DEFAULT_VAL, &store_hex, false,
+      "Seconds between progress (rate & ETA) lines, 0 for none (default 60)" },
+    { 'M', metrics_json_names, NULL,
+      &metrics_json_filename, 0, OPTIONAL, &store_str, false,
+      "Write a JSON summary of the run's metrics to this file" },
+    { 'r', resume_names, NULL,
+      &resume, 0, STORE_TRUE, NULL, false,
+      "Continue an interrupted run from the database's last checkpoint" },
     { 'c', sample_compatibility_mode_names, NULL,
       &sample_compatibility_mode, 0, STORE_TRUE, NULL, false,
       "100-IMS sample backward compatibility" },
@@ -96,10 +163,31 @@ static struct optionx parse_table[] = {
     { 'd', database_name_names, NULL,
       &database_name, 0, REQUIRED, &store_str, false,
       "The name of the certificate database" },
+    { 'b', db_batch_size_names, NULL,
+      &db_batch_size, 1, DEFAULT_VAL, &store_hex, false,
+      "The number of keysets to commit to the database at once (default 1)" },
+    { 'w', db_wal_mode_names, NULL,
+      &db_wal_mode, 0, STORE_TRUE, NULL, false,
+      "Use WAL journaling with synchronous=NORMAL for the database" },
+    { 'k', shard_names, "k/N",
+      &shard_string, 0, OPTIONAL, &store_str, false,
+      "Generate only shard k (0..N-1) of N of the --num IMS values. Each "
+      "shard checks EP_UIDs only against its own database, so check the "
+      "merged shard databases for duplicate EP_UIDs before use" },
+    { 'u', uid_filter_names, NULL,
+      &uid_filter_filename, 0, OPTIONAL, &store_str, false,
+      "EP_UID filter (from imsgen_filter) of historical databases to avoid" },
+    { 'F', ims_format_names, "text|bin",
+      &ims_format_name, 0, OPTIONAL, &store_str, false,
+      "The IMS output file format (default text)" },
+    { 'P', prime_test_names, "bpsw|mr",
+      &prime_test_name, 0, OPTIONAL, &store_str, false,
+      "The ERRK P & Q primality test: bpsw (base 2 & strong Lucas, then 2 "
+      "Miller-Rabin rounds) or mr (10 Miller-Rabin rounds) (default bpsw)" },
      { 0, NULL, NULL, NULL, 0, 0, NULL, 0, NULL }
 };
 
-static char all_args[] = "s:o:d:n:c";
+static char all_args[] = "s:o:d:n:j:k:b:u:F:P:p:M:wcSr";
 
 
 /**
@@ -122,12 +210,72 @@ int postprocess_args(int argc) {
         status = PROGRAM_ERROR;
     }
 
+    if ((num_jobs < 1) || (num_jobs > IMS_JOBS_MAX)) {
+        fprintf(stderr, "ERROR: --jobs must be between 1 and %d\n",
+                IMS_JOBS_MAX);
+        status = PROGRAM_ERROR;
+    }
+
+    if (progress_interval < 0) {
+        fprintf(stderr, "ERROR: --progress must be >= 0\n");
+        status = PROGRAM_ERROR;
+    }
+
+    if (db_batch_size < 1) {
+        fprintf(stderr, "ERROR: --db-batch must be >= 1\n");
+        status = PROGRAM_ERROR;
+    }
+
     if ((prng_seed_filename && prng_seed_string) ||
         (!prng_seed_filename && !prng_seed_string)) {
         fprintf(stderr, "ERROR: You must specify one of --seed or --seed-file\n");
         status = PROGRAM_ERROR;
     }
 
+    if (ims_format_name) {
+        ims_format = kw_to_token(ims_format_name, ims_formats);
+        if (ims_format == TOKEN_NOT_FOUND) {
+            fprintf(stderr, "ERROR: --format must be 'text' or 'bin'\n");
+            status = PROGRAM_ERROR;
+        }
+    }
+
+    if (prime_test_name) {
+        prime_test = kw_to_token(prime_test_name, prime_tests);
+        if (prime_test == TOKEN_NOT_FOUND) {
+            fprintf(stderr, "ERROR: --prime-test must be 'bpsw' or 'mr'\n");
+            status = PROGRAM_ERROR;
+        }
+    }
+
+    if (shard_string) {
+        if ((sscanf(shard_string, "%u/%u", &shard_index, &num_shards) != 2) ||
+            (num_shards < 1) || (shard_index >= num_shards)) {
+            fprintf(stderr, "ERROR: --shard must be k/N, with 0 <= k < N\n");
+            status = PROGRAM_ERROR;
+        }
+    }
+
+    /**
+     * The per-index PRNG streams that make threads and shards reproducible
+     * don't exist for the original samples, which used one sequential stream.
+     */
+    if (sample_compatibility_mode &&
+            ((num_jobs > 1) || (num_shards > 1) || resume)) {
+        fprintf(stderr, "ERROR: --jobs, --shard and --resume can't "
+                "be used with --compatibility\n");
+        status = PROGRAM_ERROR;
+    }
+
+    /**
+     * Shard k of N generates the k'th contiguous run of the IMS indices.
+     * The shards don't see each other's databases, so an EP_UID can still
+     * turn up in two of them; that needs checking when they are merged.
+     */
+    first_ims = ((uint64_t)num_ims * shard_index) / num_shards;
+    shard_num_ims = (((uint64_t)num_ims * (shard_index + 1)) / num_shards) -
+                    first_ims;
+
     return status;
 }
 
@@ -143,6 +291,7 @@ int main(int argc, char * argv[]) {
     bool success = true;
     struct argparse * parse_tbl = NULL;
     int program_status = PROGRAM_SUCCESS;
+    uint32_t next_ims;
     uint32_t count;
 
     /* Parse the command line arguments */
@@ -166,21 +315,70 @@ int main(int argc, char * argv[]) {
                 sample_compatibility_mode?
                         " (compatible with initial 100 IMS samples)" :
                         "");
+        if ((num_shards > 1) && (shard_num_ims > 0)) {
+            printf("Shard %u/%u: IMS values %u..%u\n",
+                   shard_index, num_shards,
+                   first_ims, first_ims + shard_num_ims - 1);
+        }
         /* Open the DB, IMS file, etc.  */
-        if (ims_init(prng_seed_filename, prng_seed_string, ims_filename, database_name) != 0) {
+        ims_set_prime_test(prime_test);
+        if (ims_init(prng_seed_filename, prng_seed_string, ims_filename,
+                     database_name, db_batch_size, db_wal_mode,
+                     ims_format, resume) != 0) {
             fprintf(stderr, "ERROR: IMS generation initialization failed\n");
             program_status = PROGRAM_ERROR;
+        } else if (ims_set_run(first_ims, shard_num_ims, &next_ims) != 0) {
+            program_status = PROGRAM_ERROR;
+            ims_deinit();
+        } else if (uid_filter_filename &&
+                   (ims_set_uid_filter(uid_filter_filename) != 0)) {
+            fprintf(stderr, "ERROR: can't load EP_UID filter '%s'\n",
+                    uid_filter_filename);
+            program_status = PROGRAM_ERROR;
+            ims_deinit();
         } else {
-            /* Generate N IMS values */
-            for (count = 0; count < num_ims; count++) {
-                printf("IMS %d/%d\n", count + 1, num_ims);
-                if (ims_generate(sample_compatibility_mode) != 0) {
+            if (next_ims > first_ims) {
+                printf("Resuming after %u IMS values\n", next_ims - first_ims);
+            }
+            ims_metrics_start(next_ims - first_ims, shard_num_ims,
+                              progress_interval);
+
+            if (num_jobs > 1) {
+                /* Generate N IMS values with a pipeline of worker threads */
+                if (ims_generate_jobs(next_ims,
+                                      first_ims + shard_num_ims - next_ims,
+                                      num_jobs, &count) != 0) {
                     fprintf(stderr,
                             "ERROR: created only %u of %u IMS values\n",
-                            count, num_ims);
+                            next_ims - first_ims + count, shard_num_ims);
                     program_status = PROGRAM_ERROR;
-                    break;
                 }
+            } else {
+                /* Generate N IMS values */
+                for (count = next_ims - first_ims; count < shard_num_ims;
+                     count++) {
+                    printf("IMS %d/%d\n", count + 1, shard_num_ims);
+                    if (ims_generate(first_ims + count,
+                                     sample_compatibility_mode) != 0) {
+                        fprintf(stderr,
+                                "ERROR: created only %u of %u IMS values\n",
+                                count, shard_num_ims);
+                        program_status = PROGRAM_ERROR;
+                        break;
+                    }
+                }
+            }
+
+            if (print_stats) {
+                ims_metrics_print(stdout);
+                if (num_jobs > 1) {
+                    ims_jobs_print_stats(stdout);
+                }
+            }
+            if (metrics_json_filename &&
+                (ims_metrics_write_json(metrics_json_filename) != 0) &&
+                (program_status == PROGRAM_SUCCESS)) {
+                program_status = PROGRAM_WARNINGS;
             }
 
             /* Close the DB, IMS file */
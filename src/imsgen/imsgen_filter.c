@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2015 Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ *
+ * @brief: This file contains the code for "imsgen_filter"
+ *
+ * This builds an EP_UID filter from the pub_keys tables of any number of
+ * (historical) key databases, for "imsgen --uid-filter" to keep newly
+ * generated EP_UIDs unique across all of them.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include "util.h"
+#include "parse_support.h"
+#include "mcl_arch.h"
+#include "mcl_oct.h"
+#include "db.h"
+#include "ep_uid_filter.h"
+
+
+/* Program return values */
+#define PROGRAM_SUCCESS     0
+#define PROGRAM_WARNINGS    1
+#define PROGRAM_ERROR       2
+
+
+/* Parsing args */
+static char *   filter_filename;
+
+static char *   filter_filename_names[] = { "out", "filter", NULL };
+
+
+/* Parsing table */
+static struct optionx parse_table[] = {
+    { 'o', filter_filename_names, NULL,
+      &filter_filename, 0, REQUIRED, &store_str, false,
+      "The name of the EP_UID filter file to create" },
+     { 0, NULL, NULL, NULL, 0, 0, NULL, 0, NULL }
+};
+
+static char all_args[] = "o:";
+
+
+/**
+ * @brief db_scan_ep_uids callback to count the EP_UIDs
+ */
+static int count_ep_uid(const uint8_t * ep_uid, void * context) {
+    (void)ep_uid;
+    (*(uint64_t *)context)++;
+    return 0;
+}
+
+
+/**
+ * @brief db_scan_ep_uids callback to add an EP_UID to the filter
+ */
+static int add_ep_uid(const uint8_t * ep_uid, void * context) {
+    ep_uid_filter_add((ep_uid_filter *)context, ep_uid);
+    return 0;
+}
+
+
+/**
+ * @brief Post-process and validate the command line args
+ *
+ * @param argc The number of elements in argv or parsed_argv (std. unix argc)
+ *
+ * @returns 0 on success, 1 if there were warnings, 2 on failure
+ */
+int postprocess_args(int argc) {
+    int status = PROGRAM_SUCCESS;
+
+    if (optind >= argc) {
+        fprintf(stderr, "ERROR: no key databases specified\n");
+        status = PROGRAM_ERROR;
+    }
+
+    return status;
+}
+
+
+/**
+ * @brief Entry point for the imsgen_filter application
+ *
+ * @param argc The number of elements in argv or parsed_argv (std. unix argc)
+ * @param argv The unix argument vector - an array of pointers to strings.
+ *
+ * @returns 0 on success, 1 if there were warnings, 2 on failure
+ */
+int main(int argc, char * argv[]) {
+    struct argparse * parse_tbl = NULL;
+    int program_status = PROGRAM_SUCCESS;
+    int first_db;
+    int i;
+    uint64_t num_uids = 0;
+    ep_uid_filter filter = { 0 };
+
+    /* Parse the command line arguments */
+    parse_tbl = new_argparse(parse_table, argv[0], NULL, NULL, "<db>...", NULL);
+    if (parse_tbl) {
+        if (!parse_args(argc, argv, all_args, parse_tbl)) {
+            program_status = parser_help? PROGRAM_SUCCESS : PROGRAM_ERROR;
+        }
+        parse_tbl = free_argparse(parse_tbl);
+
+        /* Perform any argument validation/post-processing */
+        if (program_status == PROGRAM_SUCCESS) {
+            program_status = postprocess_args(argc);
+        }
+    } else {
+        program_status = PROGRAM_ERROR;
+    }
+    first_db = optind;
+
+    /* Size the filter for all the EP_UIDs, then fill it */
+    for (i = first_db; (program_status == PROGRAM_SUCCESS) && (i < argc); i++) {
+        if (db_scan_ep_uids(argv[i], count_ep_uid, &num_uids) != 0) {
+            program_status = PROGRAM_ERROR;
+        }
+    }
+    if (program_status == PROGRAM_SUCCESS) {
+        if (ep_uid_filter_create(&filter, num_uids) != 0) {
+            program_status = PROGRAM_ERROR;
+        }
+    }
+    for (i = first_db; (program_status == PROGRAM_SUCCESS) && (i < argc); i++) {
+        if (db_scan_ep_uids(argv[i], add_ep_uid, &filter) != 0) {
+            program_status = PROGRAM_ERROR;
+        }
+    }
+
+    if (program_status == PROGRAM_SUCCESS) {
+        if (ep_uid_filter_save(&filter, filter_filename) != 0) {
+            program_status = PROGRAM_ERROR;
+        } else {
+            printf("%llu EP_UIDs from %d databases: %llu byte filter\n",
+                   (unsigned long long)filter.num_uids, argc - first_db,
+                   (unsigned long long)(filter.num_bits / 8));
+        }
+    }
+    ep_uid_filter_free(&filter);
+
+    return program_status;
+}
@@ -63,6 +63,7 @@
 /* Parsing args */
 static int      sample_compatibility_mode = 0;
 static int      num_ims;
+static int      num_jobs;
 static char *   database_name;
 static char *   ims_filename;
 static char *   prng_seed_filename;
@@ -70,6 +71,7 @@ static char *   prng_seed_string;
 
 static char *   sample_compatibility_mode_names[] = { "compatibility", NULL };
 static char *   num_ims_names[] = { "num", "num-ims", NULL };
+static char *   num_jobs_names[] = { "jobs", NULL };
 static char *   database_name_names[] = { "db", "database", NULL };
 static char *   ims_filename_names[] = { "in", "ims", NULL };
 static char *   prng_seed_filename_names[] = { "seed-file", NULL };
@@ -93,13 +95,16 @@ static struct optionx parse_table[] = {
     { 'n', num_ims_names, NULL,
       &num_ims, 0, REQUIRED, &store_hex, false,
       "The number of IMS values to test" },
+    { 'j', num_jobs_names, NULL,
+      &num_jobs, 1, DEFAULT_VAL, &store_hex, false,
+      "The number of IMS verification threads (default 1)" },
     { 'c', sample_compatibility_mode_names, NULL,
       &sample_compatibility_mode, 0, STORE_TRUE, NULL, false,
       "100-IMS sample backward compatibility" },
     { 0, NULL, NULL, NULL, 0, 0, NULL, 0, NULL }
 };
 
-static char all_args[] = "s:i:n:d:c";
+static char all_args[] = "s:i:n:d:j:c";
 
 
 /**
@@ -122,6 +127,12 @@ int postprocess_args(int argc) {
         status = PROGRAM_ERROR;
     }
 
+    if ((num_jobs < 1) || (num_jobs > IMS_TEST_JOBS_MAX)) {
+        fprintf(stderr, "ERROR: --jobs must be between 1 and %d\n",
+                IMS_TEST_JOBS_MAX);
+        status = PROGRAM_ERROR;
+    }
+
     if ((prng_seed_filename && prng_seed_string) ||
         (!prng_seed_filename && !prng_seed_string)) {
         fprintf(stderr, "ERROR: You must specify one of --seed or --seed-file\n");
@@ -169,11 +180,18 @@ int main(int argc, char * argv[]) {
             fprintf(stderr, "ERROR: IMS generation initialization failed\n");
             program_status = PROGRAM_ERROR;
         } else {
-            /* Test N IMS values */
-            status = test_ims_set(ims_filename, num_ims, sample_compatibility_mode);
+            /* Check the ERRK primality tests, then test N IMS values */
+            status = test_prime_verdicts();
             if (status != 0) {
-                fprintf(stderr, "ERROR: Failed IMS verification (err %d)\n", status);
+                fprintf(stderr, "ERROR: Failed primality test check\n");
                 program_status = PROGRAM_ERROR;
+            } else {
+                status = test_ims_set(ims_filename, num_ims, num_jobs,
+                                      sample_compatibility_mode);
+                if (status != 0) {
+                    fprintf(stderr, "ERROR: Failed IMS verification (err %d)\n", status);
+                    program_status = PROGRAM_ERROR;
+                }
             }
 
             /* Close the DB, IMS file */
@@ -112,6 +112,8 @@ DRFLAGS+= -D MCL_ECP_dbl=MCL_ECP_dbl_$(DREC)
 DRFLAGS+= -D MCL_ECP_pinmul=MCL_ECP_pinmul_$(DREC)
 DRFLAGS+= -D MCL_ECP_mul=MCL_ECP_mul_$(DREC)
 DRFLAGS+= -D MCL_ECP_mul2=MCL_ECP_mul2_$(DREC)
+DRFLAGS+= -D MCL_ECP_generator_precompute=MCL_ECP_generator_precompute_$(DREC)
+DRFLAGS+= -D MCL_ECP_generator_mul=MCL_ECP_generator_mul_$(DREC)
 DRFLAGS+= -D MCL_FF_copy=MCL_FF_copy_$(DREC)
 DRFLAGS+= -D MCL_FF_init=MCL_FF_init_$(DREC)
 DRFLAGS+= -D MCL_FF_zero=MCL_FF_zero_$(DREC)
@@ -143,7 +145,16 @@ DRFLAGS+= -D MCL_FF_power=MCL_FF_power_$(DREC)
 DRFLAGS+= -D MCL_FF_pow=MCL_FF_pow_$(DREC)
 DRFLAGS+= -D MCL_FF_cfactor=MCL_FF_cfactor_$(DREC)
 DRFLAGS+= -D MCL_FF_prime=MCL_FF_prime_$(DREC)
+DRFLAGS+= -D MCL_FF_prime_test=MCL_FF_prime_test_$(DREC)
+DRFLAGS+= -D MCL_FF_prime_batch=MCL_FF_prime_batch_$(DREC)
 DRFLAGS+= -D MCL_FF_pow2=MCL_FF_pow2_$(DREC)
+DRFLAGS+= -D MCL_FF_backend_init=MCL_FF_backend_init_$(DREC)
+DRFLAGS+= -D MCL_FF_mont_init=MCL_FF_mont_init_$(DREC)
+DRFLAGS+= -D MCL_FF_mont_nres=MCL_FF_mont_nres_$(DREC)
+DRFLAGS+= -D MCL_FF_mont_redc=MCL_FF_mont_redc_$(DREC)
+DRFLAGS+= -D MCL_FF_mont_mul=MCL_FF_mont_mul_$(DREC)
+DRFLAGS+= -D MCL_FF_mont_sqr=MCL_FF_mont_sqr_$(DREC)
+DRFLAGS+= -D MCL_FF_mont_pow=MCL_FF_mont_pow_$(DREC)
 DRFLAGS+= -D MCL_FP_iszilch=MCL_FP_iszilch_$(DREC)
 DRFLAGS+= -D MCL_FP_nres=MCL_FP_nres_$(DREC)
 DRFLAGS+= -D MCL_FP_redc=MCL_FP_redc_$(DREC)
@@ -242,6 +242,21 @@ extern void MCL_ECP_pinmul(MCL_ECP *P,int i,int b);
 
  */
 extern void MCL_ECP_mul(MCL_ECP *P,MCL_BIG b);
+/**	@brief Builds the fixed base tables for multiplying the curve generator
+ *
+	Costs roughly 8 point additions per 4-bit window, once. Not thread safe -
+	call before any concurrent use of MCL_ECP_generator_mul.
+ */
+extern void MCL_ECP_generator_precompute(void);
+/**	@brief Multiplies the curve generator by a MCL_BIG, side-channel resistant
+ *
+	Uses the tables built by MCL_ECP_generator_precompute, which removes all
+	of the doublings from the fixed sized window method. Falls back to
+	MCL_ECP_mul if the tables have not been built. Not for Montgomery curves.
+	@param P MCL_ECP instance, on exit =e*G
+	@param e MCL_BIG number multiplier, 0 <= e < curve order
+ */
+extern void MCL_ECP_generator_mul(MCL_ECP *P,MCL_BIG e);
 /**	@brief Calculates double multiplication P=e*P+f*Q, side-channel resistant
  *
 	@param P MCL_ECP instance, on exit =e*P+f*Q
@@ -63,6 +63,35 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.             *
 
 #include "mcl_oct.h"
 
+#define MCL_FF_PRIME_LANES 8 /**< Candidates in flight in MCL_FF_prime_batch */
+
+#define MCL_FF_PRIME_MR 0	/**< Probable prime test profile - 10 random base Miller-Rabin rounds, as MCL_FF_prime */
+#define MCL_FF_PRIME_BPSW 1	/**< Probable prime test profile - base 2 Miller-Rabin, strong Lucas, then 2 random base rounds */
+
+/** 64-bit words per value in a full radix Montgomery backend - enough 52-bit limbs for 2^MCL_FF_BITS, in whole AVX-512 vectors */
+#define MCL_FF_MONT_LIMBS ((((8*(1+(MCL_MBITS-1)/8))*MCL_FFLEN+52)/52+7)/8*8)
+
+/**
+	@brief Montgomery context - the values that depend only on the modulus
+
+	On x86-64, if the CPU allows it, the context uses a full radix backend (64-bit
+	mulx/adx words, or 52-bit AVX-512 IFMA limbs) with its own R. Values in
+	Montgomery form must only be used with the context that made them.
+*/
+typedef struct {
+int n; /**< size of the modulus in MCL_BIGs */
+mcl_chunk p[MCL_FFLEN][MCL_BS]; /**< the modulus */
+mcl_chunk ND[MCL_FFLEN][MCL_BS]; /**< Montgomery constant -1/p mod R */
+mcl_chunk R2[MCL_FFLEN][MCL_BS]; /**< R^2 mod p, for conversion to Montgomery form */
+mcl_chunk one[MCL_FFLEN][MCL_BS]; /**< 1 in Montgomery form, R mod p */
+int backend; /**< full radix backend in use, 0 for none */
+int nw; /**< number of words/limbs in the backend representation */
+unsign64 k0; /**< -1/p mod the backend word size */
+unsign64 pw[MCL_FF_MONT_LIMBS]; /**< p in the backend representation */
+unsign64 R2w[MCL_FF_MONT_LIMBS]; /**< R^2 mod p in the backend representation */
+unsign64 onew[MCL_FF_MONT_LIMBS]; /**< R mod p in the backend representation */
+} MCL_FF_mont;
+
 /* Finite Field Prototypes */
 /**	@brief Copy one FF element of given length to another
  *
@@ -248,6 +277,7 @@ extern void MCL_FF_random(mcl_chunk x[][MCL_BS],csprng *R,int n);
 extern void MCL_FF_randomnum(mcl_chunk x[][MCL_BS],mcl_chunk y[][MCL_BS],csprng *R,int n);
 /**	@brief Calculate r=x^e mod m, side channel resistant
  *
+	Uses fixed 4-bit windows with a constant time table lookup
 	@param r FF instance, on exit = x^e mod p
 	@param x FF instance
 	@param e FF exponent
@@ -277,6 +307,7 @@ extern void MCL_FF_skspow(mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],MCL_BIG e,
 extern void MCL_FF_power(mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],int e,mcl_chunk m[][MCL_BS],int n);
 /**	@brief Calculate r=x^e mod m
  *
+	Uses 5-bit sliding windows, not side channel resistant
 	@param r FF instance, on exit = x^e mod p
 	@param x FF instance
 	@param e FF exponent
@@ -301,6 +332,84 @@ extern int MCL_FF_cfactor(mcl_chunk x[][MCL_BS],sign32 s,int n);
 	@return 1 if x is (almost certainly) prime, else return 0
  */
 extern int MCL_FF_prime(mcl_chunk x[][MCL_BS],csprng *R,int n);
+/**	@brief Test if an FF is prime, with a choice of test
+ *
+	MCL_FF_PRIME_BPSW rejects most composites with a single base 2 Miller-Rabin
+	round, and needs fewer random base rounds for primes than MCL_FF_PRIME_MR
+	@param x FF instance to be tested
+	@param R an instance of a Cryptographically Secure Random Number Generator
+	@param profile MCL_FF_PRIME_MR or MCL_FF_PRIME_BPSW
+	@param n size of FF in MCL_BIGs
+	@return 1 if x is (almost certainly) prime, else return 0
+ */
+extern int MCL_FF_prime_test(mcl_chunk x[][MCL_BS],csprng *R,int profile,int n);
+/**	@brief Test many FFs for primality in one pass
+ *
+	Uses the same tests as MCL_FF_prime_test, with the rounds of up to
+	MCL_FF_PRIME_LANES candidates interleaved. On x86-64 CPUs with AVX-512 IFMA
+	the lanes are multiplied together in SIMD.
+	The FFs are passed by pointer, so the caller's own array layout (which
+	need not match this build's MCL_FFLEN and MCL_BS) never matters.
+	@param r on exit r[i]=1 if x[i] is (almost certainly) prime, else 0
+	@param x array of m pointers to the FF instances to be tested, all of size n
+	@param m number of FFs to test
+	@param R an instance of a Cryptographically Secure Random Number Generator
+	@param profile MCL_FF_PRIME_MR or MCL_FF_PRIME_BPSW
+	@param n size of each FF in MCL_BIGs
+	@return the number of (almost certain) primes found
+ */
+extern int MCL_FF_prime_batch(int r[],mcl_chunk (*x[])[MCL_BS],int m,csprng *R,int profile,int n);
+/**	@brief Pick the Montgomery arithmetic backend for this CPU
+ *
+	Otherwise the first context picks it. Call this before using FF functions from several threads at once
+ */
+extern void MCL_FF_backend_init(void);
+/**	@brief Set up a Montgomery context for an odd modulus
+ *
+	Does the expensive per-modulus setup once, for reuse by the MCL_FF_mont_ functions
+	@param M the Montgomery context to initialise
+	@param p FF modulus, must be odd
+	@param n size of FF in MCL_BIGs, at most MCL_FFLEN
+ */
+extern void MCL_FF_mont_init(MCL_FF_mont *M,mcl_chunk p[][MCL_BS],int n);
+/**	@brief Convert an FF to Montgomery form
+ *
+	@param M the Montgomery context
+	@param a FF instance, 0 <= a < p, on exit = a.R mod p, fully reduced
+ */
+extern void MCL_FF_mont_nres(MCL_FF_mont *M,mcl_chunk a[][MCL_BS]);
+/**	@brief Convert an FF from Montgomery form
+ *
+	@param M the Montgomery context
+	@param a FF instance in Montgomery form, on exit = a/R mod p, fully reduced
+ */
+extern void MCL_FF_mont_redc(MCL_FF_mont *M,mcl_chunk a[][MCL_BS]);
+/**	@brief Montgomery multiplication z=x.y/R mod p
+ *
+	The result is not fully reduced - use MCL_FF_mod before comparing it
+	@param M the Montgomery context
+	@param z FF instance, on exit = x.y/R mod p
+	@param x FF instance in Montgomery form
+	@param y FF instance in Montgomery form
+ */
+extern void MCL_FF_mont_mul(MCL_FF_mont *M,mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk y[][MCL_BS]);
+/**	@brief Montgomery squaring z=x^2/R mod p
+ *
+	The result is not fully reduced - use MCL_FF_mod before comparing it
+	@param M the Montgomery context
+	@param z FF instance, on exit = x^2/R mod p
+	@param x FF instance in Montgomery form
+ */
+extern void MCL_FF_mont_sqr(MCL_FF_mont *M,mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS]);
+/**	@brief Calculate r=x^e mod p in Montgomery form
+ *
+	Uses 5-bit sliding windows, not side channel resistant. The result is not fully reduced.
+	@param M the Montgomery context
+	@param r FF instance, on exit = x^e mod p, in Montgomery form
+	@param x FF instance in Montgomery form
+	@param e FF exponent
+ */
+extern void MCL_FF_mont_pow(MCL_FF_mont *M,mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk e[][MCL_BS]);
 /**	@brief Calculate r=x^e.y^f mod m
  *
 	@param r FF instance, on exit = x^e.y^f mod p
@@ -115,12 +115,29 @@ extern void MCL_HASH256_init(mcl_hash256 *H);
 	@param b byte to be included in hash
  */
 extern void MCL_HASH256_process(mcl_hash256 *H,int b);
+/**	@brief Add a run of bytes to the hash
+ *
+	@param H an instance SHA256
+	@param b the bytes to be included in hash
+	@param n the number of bytes
+ */
+extern void MCL_HASH256_update(mcl_hash256 *H,const char *b,int n);
 /**	@brief Generate 32-byte hash
  *
 	@param H an instance SHA256
 	@param h is the output 32-byte hash
  */
 extern void MCL_HASH256_hash(mcl_hash256 *H,char *h);
+/**	@brief Generate the 32-byte hashes of several messages of the same length
+ *
+ * Uses the multi-buffer backend when the CPU has one (see mcl_hash.c).
+ *
+	@param n the number of messages
+	@param m the messages
+	@param len the length of each message in bytes
+	@param h the 32-byte output hash for each message
+ */
+extern void MCL_HASH256_batch(int n,const char *const *m,int len,char *const *h);
 
 
 /**	@brief Initialise an instance of SHA384
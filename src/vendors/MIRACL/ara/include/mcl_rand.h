@@ -96,5 +96,14 @@ extern void MCL_RAND_clean(csprng *R);
 	@return a random byte
  */
 extern int MCL_RAND_byte(csprng *R);
+/**	@brief Fill a buffer with random bytes from a random number generator
+ *
+	Returns the same bytes as n successive calls to MCL_RAND_byte, but
+	copies them straight out of the pool
+	@param R an instance of a Cryptographically Secure Random Number Generator
+	@param b the buffer to fill
+	@param n the number of bytes required
+ */
+extern void MCL_RAND_bytes(csprng *R,char *b,int n);
 
 #endif
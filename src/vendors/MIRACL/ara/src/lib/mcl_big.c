@@ -1131,12 +1131,14 @@ int MCL_BIG_lastbits(MCL_BIG a,int n)
 void MCL_BIG_random(MCL_BIG m,csprng *rng)
 {
 	int i,b,j=0,r=0;
+	char bytes[MCL_MODBYTES];
 
 	MCL_BIG_zero(m);
+	MCL_RAND_bytes(rng,bytes,MCL_MODBYTES);
 /* generate random MCL_BIG */ 
 	for (i=0;i<8*MCL_MODBYTES;i++) 
 	{
-		if (j==0) r=MCL_RAND_byte(rng);
+		if (j==0) r=bytes[i/8]&0xff;
 		else r>>=1;
 		b=r&1;
 		MCL_BIG_shl(m,1); m[0]+=b; 
@@ -1154,11 +1156,13 @@ void MCL_BIG_randomnum(MCL_BIG m,MCL_BIG q,csprng *rng)
 {
 	int i,b,j=0,r=0;
 	mcl_chunk d[DMCL_BS];
+	char bytes[2*MCL_MODBYTES];
 	MCL_BIG_dzero(d);
+	MCL_RAND_bytes(rng,bytes,2*MCL_MODBYTES);
 /* generate random DMCL_BIG */ 
 	for (i=0;i<16*MCL_MODBYTES;i++)
 	{
-		if (j==0) r=MCL_RAND_byte(rng);
+		if (j==0) r=bytes[i/8]&0xff;
 		else r>>=1;
 		b=r&1;
 		MCL_BIG_dshl(d,1); d[0]+=b; 
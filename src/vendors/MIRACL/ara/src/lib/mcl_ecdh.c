@@ -68,7 +68,8 @@ static void hashit(int sha,mcl_octet *p,int n,mcl_octet *x,mcl_octet *y,mcl_octe
     
 	hlen=sha;
 
-    if (p!=NULL) for (i=0;i<p->len;i++)
+    if (p!=NULL && sha==MCL_SHA256) MCL_HASH256_update(&sha256,p->val,p->len);
+    else if (p!=NULL) for (i=0;i<p->len;i++)
 	{
 		switch(sha)
 		{
@@ -103,7 +104,8 @@ static void hashit(int sha,mcl_octet *p,int n,mcl_octet *x,mcl_octet *y,mcl_octe
 			}
 		}
     }
-    if (x!=NULL) for (i=0;i<x->len;i++)
+    if (x!=NULL && sha==MCL_SHA256) MCL_HASH256_update(&sha256,x->val,x->len);
+    else if (x!=NULL) for (i=0;i<x->len;i++)
 	{
 		switch(sha)
 		{
@@ -117,7 +119,8 @@ static void hashit(int sha,mcl_octet *p,int n,mcl_octet *x,mcl_octet *y,mcl_octe
 			MCL_HASH512_process(&sha512,x->val[i]); break;
 		}
 	}
-    if (y!=NULL) for (i=0;i<y->len;i++)
+    if (y!=NULL && sha==MCL_SHA256) MCL_HASH256_update(&sha256,y->val,y->len);
+    else if (y!=NULL) for (i=0;i<y->len;i++)
 	{
 		switch(sha)
 		{
@@ -371,11 +374,8 @@ int MCL_ECP_KEY_PAIR_GENERATE(csprng *RNG,mcl_octet* S,mcl_octet *W)
     mcl_chunk r[MCL_BS],gx[MCL_BS],gy[MCL_BS],s[MCL_BS];
     MCL_ECP G;
     int res=0;
+#if MCL_CURVETYPE==MCL_MONTGOMERY
 	MCL_BIG_rcopy(gx,MCL_CURVE_Gx);
-#if MCL_CURVETYPE!=MCL_MONTGOMERY
-	MCL_BIG_rcopy(gy,MCL_CURVE_Gy);
-    MCL_ECP_set(&G,gx,gy);
-#else
     MCL_ECP_set(&G,gx);
 #endif
 
@@ -388,10 +388,11 @@ int MCL_ECP_KEY_PAIR_GENERATE(csprng *RNG,mcl_octet* S,mcl_octet *W)
 		MCL_BIG_mod(s,r);
 	}
 
-    MCL_ECP_mul(&G,s);
 #if MCL_CURVETYPE!=MCL_MONTGOMERY
+    MCL_ECP_generator_mul(&G,s);
     MCL_ECP_get(gx,gy,&G);
 #else
+    MCL_ECP_mul(&G,s);
     MCL_ECP_get(gx,&G);
 #endif
     if (RNG!=NULL) 
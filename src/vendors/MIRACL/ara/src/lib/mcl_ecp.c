@@ -986,6 +986,103 @@ void MCL_ECP_mul(MCL_ECP *P,MCL_BIG e)
 	MCL_ECP_affine(P);
 }
 
+#if MCL_CURVETYPE!=MCL_MONTGOMERY
+/* Fixed base multiplication by the curve generator */
+/* ECP_gtab[i][j]=(2j+1).16^i.G, one table of odd multiples per signed 4-bit window */
+#define ECP_GWINDOWS (2+(MCL_MBITS+4)/4)
+
+static MCL_ECP ECP_gtab[ECP_GWINDOWS][8];
+static int ECP_gtab_ready=0;
+
+/* Build the generator tables - not thread safe, call once before any concurrent use */
+void MCL_ECP_generator_precompute(void)
+{
+	int i,j;
+	mcl_chunk gx[MCL_BS],gy[MCL_BS];
+	MCL_ECP B,D;
+#if MCL_CURVETYPE==MCL_WEIERSTRASS
+	mcl_chunk work[8][MCL_BS];
+#endif
+	if (ECP_gtab_ready) return;
+
+	MCL_BIG_rcopy(gx,MCL_CURVE_Gx);
+	MCL_BIG_rcopy(gy,MCL_CURVE_Gy);
+	MCL_ECP_set(&B,gx,gy);
+
+	for (i=0;i<ECP_GWINDOWS;i++)
+	{
+		MCL_ECP_copy(&D,&B);
+		MCL_ECP_dbl(&D);
+		MCL_ECP_copy(&ECP_gtab[i][0],&B);
+		for (j=1;j<8;j++)
+		{
+			MCL_ECP_copy(&ECP_gtab[i][j],&ECP_gtab[i][j-1]);
+			MCL_ECP_add(&ECP_gtab[i][j],&D);
+		}
+#if MCL_CURVETYPE==MCL_WEIERSTRASS
+		ECP_multiaffine(8,ECP_gtab[i],work);
+#else
+		for (j=0;j<8;j++) MCL_ECP_affine(&ECP_gtab[i][j]);
+#endif
+		for (j=0;j<4;j++) MCL_ECP_dbl(&B);
+	}
+	ECP_gtab_ready=1;
+}
+
+/* Set P=e*G. Same signed window recoding as MCL_ECP_mul, but every window
+   has its own table so no doublings are needed. Falls back to MCL_ECP_mul
+   if the tables have not been built */
+void MCL_ECP_generator_mul(MCL_ECP *P,MCL_BIG e)
+{
+	int i,s,ns;
+	mcl_chunk mt[MCL_BS],t[MCL_BS],gx[MCL_BS],gy[MCL_BS];
+	MCL_ECP Q,C;
+	sign8 w[ECP_GWINDOWS];
+
+	if (!ECP_gtab_ready)
+	{
+		MCL_BIG_rcopy(gx,MCL_CURVE_Gx);
+		MCL_BIG_rcopy(gy,MCL_CURVE_Gy);
+		MCL_ECP_set(P,gx,gy);
+		MCL_ECP_mul(P,e);
+		return;
+	}
+	if (MCL_BIG_iszilch(e))
+	{
+		MCL_ECP_inf(P);
+		MCL_ECP_affine(P);
+		return;
+	}
+
+/* make exponent odd - add 2G if even, G if odd */
+	MCL_BIG_copy(t,e);
+	s=MCL_BIG_parity(t);
+	MCL_BIG_inc(t,1); MCL_BIG_norm(t); ns=MCL_BIG_parity(t); MCL_BIG_copy(mt,t); MCL_BIG_inc(mt,1); MCL_BIG_norm(mt);
+	MCL_BIG_cmove(t,mt,s);
+	MCL_ECP_copy(&C,&ECP_gtab[0][1]);
+	MCL_ECP_sub(&C,&ECP_gtab[0][0]);
+	ECP_cmove(&C,&ECP_gtab[0][0],ns);
+
+/* convert exponent to signed 4-bit windows - fixed count, so constant time */
+	for (i=0;i<ECP_GWINDOWS-1;i++)
+	{
+		w[i]=MCL_BIG_lastbits(t,5)-16;
+		MCL_BIG_dec(t,w[i]); MCL_BIG_norm(t);
+		MCL_BIG_fshr(t,4);
+	}
+	w[ECP_GWINDOWS-1]=MCL_BIG_lastbits(t,5);
+
+	ECP_select(P,ECP_gtab[ECP_GWINDOWS-1],w[ECP_GWINDOWS-1]);
+	for (i=ECP_GWINDOWS-2;i>=0;i--)
+	{
+		ECP_select(&Q,ECP_gtab[i],w[i]);
+		MCL_ECP_add(P,&Q);
+	}
+	MCL_ECP_sub(P,&C); /* apply correction */
+	MCL_ECP_affine(P);
+}
+#endif
+
 #if MCL_CURVETYPE!=MCL_MONTGOMERY
 /* Set P=eP+fQ double multiplication */
 /* constant time - as useful for GLV method in pairings */
@@ -46,6 +46,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.             *
 #include "mcl_big.h"
 #include "mcl_ff.h"
 
+/* x86-64 full radix Montgomery backends, picked at run time (see ff_cpu_features) */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MCL_FF_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #define MCL_MODBYTES (1+(MCL_MBITS-1)/8) /**< Number of bytes in MCL_Modulus */
 #define MCL_NLEN (1+((MCL_MBITS-1)/MCL_BASEBITS))	/**< Number of words in MCL_BIG. */
 #define MCL_BIGBITS (MCL_MODBYTES*8) /**< Number of bits representable in a MCL_BIG */
@@ -417,6 +424,15 @@ static void FF_cswap(mcl_chunk a[][MCL_BS],mcl_chunk b[][MCL_BS],int d,int n)
 	return;
 }
 
+/* conditional move of b to a - side channel resistant */
+static void FF_cmove(mcl_chunk a[][MCL_BS],mcl_chunk b[][MCL_BS],int d,int n)
+{
+	int i;
+	for (i=0;i<n;i++)
+		MCL_BIG_cmove(a[i],b[i],d);
+	return;
+}
+
 /* z=x*y, t is workspace */
 static void FF_karmul(mcl_chunk z[][MCL_BS],int zp,mcl_chunk x[][MCL_BS],int xp,mcl_chunk y[][MCL_BS],int yp,mcl_chunk t[][MCL_BS],int tp,int n)
 {
@@ -813,34 +829,474 @@ static void MCL_FF_modsqr(mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk
 	FF_reduce(z,d,p,ND,n);
 }
 
-/* r=x^e mod p using side-channel resistant Montgomery Ladder, for large e */
+/* Window sizes for the large exponent powering functions */
+#define FF_SKWINDOW 4	/* fixed window, table of all 2^FF_SKWINDOW powers */
+#define FF_WINDOW 5		/* sliding window, table of 2^(FF_WINDOW-1) odd powers */
+
+/* return 1 if b==c, no branching */
+static int FF_teq(sign32 b,sign32 c)
+{
+	sign32 x=b^c;
+	x-=1;  // if x=0, x now -1
+	return (int)((x>>31)&1);
+}
+
+/* extract exponent bits i..i-k+1 as an integer */
+static int FF_ebits(mcl_chunk e[][MCL_BS],int i,int k)
+{
+	int j,v=0;
+	for (j=i;j>i-k;j--)
+		v=2*v+MCL_BIG_bit(e[j/MCL_BIGBITS],j%MCL_BIGBITS);
+	return v;
+}
+
+#ifdef MCL_FF_X86
+
+/* The MCL_BIG representation has only 29 or 56 useful bits per word, which
+   wastes most of each 64x64 multiply. These backends convert once to full
+   radix - 64-bit words for mulx/adx, 52-bit limbs for AVX-512 IFMA - and do
+   all of the Montgomery arithmetic of a context there. Their results are
+   always fully reduced, and the final subtraction is branch free, so they
+   can also serve MCL_FF_skpow */
+
+#define FF_CPU_ADX  1
+#define FF_CPU_IFMA 2
+
+#define FF_M52 (((unsign64)1<<52)-1)
+
+/* Which of the x86 backends this CPU can run */
+static int ff_cpu_features(void)
+{
+	unsigned int a,b,c,d,xcr0_lo,xcr0_hi;
+	int osxsave,features=0;
+
+	if (!__get_cpuid(1,&a,&b,&c,&d)) return 0;
+	osxsave=(c>>27)&1;
+	if (!__get_cpuid_count(7,0,&a,&b,&c,&d)) return 0;
+
+	if (((b>>8)&1) && ((b>>19)&1)) features|=FF_CPU_ADX; /* BMI2 and ADX */
+	if (osxsave && ((b>>16)&1) && ((b>>21)&1))
+	{ /* AVX-512F and IFMA - the OS must also save the opmask and ZMM registers */
+		__asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		if ((xcr0_lo&0xe6)==0xe6) features|=FF_CPU_IFMA;
+	}
+	return features;
+}
+
+/* -1 until MCL_FF_backend_init, or failing that the first context, asks */
+static int ff_cpu=-1;
+
+static int ff_select(void)
+{
+	int cpu=__atomic_load_n(&ff_cpu,__ATOMIC_RELAXED);
+	if (cpu<0)
+	{
+		cpu=ff_cpu_features();
+		__atomic_store_n(&ff_cpu,cpu,__ATOMIC_RELAXED);
+	}
+	return cpu;
+}
+
+/* x (normalised, 0 <= x < 2^(MCL_BIGBITS*n)) to nw full radix 64-bit words */
+static void FF_to64(unsign64 w[],int nw,mcl_chunk x[][MCL_BS],int n)
+{
+	int i,j,b,sh,width;
+	unsign64 c;
+	for (i=0;i<nw;i++) w[i]=0;
+	for (i=0;i<n;i++)
+		for (j=0;j<MCL_NLEN;j++)
+		{
+			b=i*MCL_BIGBITS+j*MCL_BASEBITS;
+			width=MCL_BIGBITS-j*MCL_BASEBITS;
+			if (width>MCL_BASEBITS) width=MCL_BASEBITS;
+			c=(unsign64)x[i][j];
+			sh=b%64;
+			w[b/64]|=c<<sh;
+			if (sh+width>64) w[b/64+1]|=c>>(64-sh);
+		}
+}
+
+/* full radix 64-bit words to a normalised x */
+static void FF_from64(mcl_chunk x[][MCL_BS],int n,const unsign64 w[])
+{
+	int i,j,b,sh,width;
+	unsign64 c;
+	MCL_FF_zero(x,n);
+	for (i=0;i<n;i++)
+		for (j=0;j<MCL_NLEN;j++)
+		{
+			b=i*MCL_BIGBITS+j*MCL_BASEBITS;
+			width=MCL_BIGBITS-j*MCL_BASEBITS;
+			if (width>MCL_BASEBITS) width=MCL_BASEBITS;
+			sh=b%64;
+			c=w[b/64]>>sh;
+			if (sh+width>64) c|=w[b/64+1]<<(64-sh);
+			x[i][j]=(mcl_chunk)(c&(((unsign64)1<<width)-1));
+		}
+}
+
+/* nw 64-bit words to nl 52-bit limbs */
+static void FF_64to52(unsign64 l[],int nl,const unsign64 w[],int nw)
+{
+	int i,q,sh;
+	unsign64 v;
+	for (i=0;i<nl;i++)
+	{
+		q=(52*i)/64; sh=(52*i)%64;
+		v=(q<nw)?(w[q]>>sh):0;
+		if (sh>12 && q+1<nw) v|=w[q+1]<<(64-sh);
+		l[i]=v&FF_M52;
+	}
+}
+
+/* nl 52-bit limbs to nw 64-bit words */
+static void FF_52to64(unsign64 w[],int nw,const unsign64 l[],int nl)
+{
+	int i,q,sh;
+	for (i=0;i<nw;i++) w[i]=0;
+	for (i=0;i<nl;i++)
+	{
+		q=(52*i)/64; sh=(52*i)%64;
+		if (q<nw) w[q]|=l[i]<<sh;
+		if (sh>12 && q+1<nw) w[q+1]|=l[i]>>(64-sh);
+	}
+}
+
+/* x=2^k mod p, for L-word p - by doubling up from the top bit of p */
+static void FF_pow2mod64(unsign64 x[],int k,const unsign64 p[],int L)
+{
+	int i,nb;
+	unsign64 c,t,b;
+	for (nb=64*L-1;nb>0 && ((p[nb/64]>>(nb%64))&1)==0;nb--);
+	for (i=0;i<L;i++) x[i]=0;
+	if (k<nb) nb=k; /* 2^nb < p */
+	x[nb/64]=(unsign64)1<<(nb%64);
+	for (k-=nb;k>0;k--)
+	{
+		c=x[L-1]>>63;
+		for (i=L-1;i>0;i--) x[i]=(x[i]<<1)|(x[i-1]>>63);
+		x[0]<<=1;
+		if (!c)
+		{ /* is x>=p? */
+			for (i=L-1;i>0 && x[i]==p[i];i--);
+			if (x[i]<p[i]) continue;
+		}
+		for (b=0,i=0;i<L;i++)
+		{
+			t=x[i]-p[i]-b;
+			b=(x[i]<p[i]) || (x[i]==p[i] && b);
+			x[i]=t;
+		}
+	}
+}
+
+/* z=x.y/2^(64L) mod p, fully reduced. Operand scanning, with the mulx
+   products going into two carry chains, so GCC can use adcx and adox.
+   After row i the sum is below (x+p).2^(64(i+1)) < 2^(64(L+i+1)+1), so the
+   final carries always stop in word i+L+1 - no loop depends on the data */
+__attribute__((target("bmi2,adx")))
+static void FF_mul_adx(unsign64 z[],const unsign64 x[],const unsign64 y[],const unsign64 p[],unsign64 k0,int L)
+{
+	int i,j;
+	unsigned long long t[2*MCL_FF_MONT_LIMBS+2],d[MCL_FF_MONT_LIMBS],lo,hi,m,mask;
+	unsigned char c1,c2;
+
+	for (i=0;i<2*L+2;i++) t[i]=0;
+	for (i=0;i<L;i++)
+	{
+/* t+=x.y[i].2^(64i) */
+		c1=c2=0;
+		for (j=0;j<L;j++)
+		{
+			lo=_mulx_u64(x[j],y[i],&hi);
+			c1=_addcarryx_u64(c1,t[i+j],lo,&t[i+j]);
+			c2=_addcarryx_u64(c2,t[i+j+1],hi,&t[i+j+1]);
+		}
+		c1=_addcarryx_u64(c1,t[i+L],0,&t[i+L]);
+		_addcarryx_u64(c1,t[i+L+1],c2,&t[i+L+1]);
+/* t+=m.p.2^(64i), clearing word i */
+		m=t[i]*k0;
+		c1=c2=0;
+		for (j=0;j<L;j++)
+		{
+			lo=_mulx_u64(p[j],m,&hi);
+			c1=_addcarryx_u64(c1,t[i+j],lo,&t[i+j]);
+			c2=_addcarryx_u64(c2,t[i+j+1],hi,&t[i+j+1]);
+		}
+		c1=_addcarryx_u64(c1,t[i+L],0,&t[i+L]);
+		_addcarryx_u64(c1,t[i+L+1],c2,&t[i+L+1]);
+	}
+
+/* t/2^(64L) < 2p, so subtract p unless that borrows */
+	c1=0;
+	for (j=0;j<L;j++) c1=_subborrow_u64(c1,t[L+j],p[j],&d[j]);
+	c1=_subborrow_u64(c1,t[2*L],0,&lo);
+	mask=0-(unsigned long long)c1;
+	for (j=0;j<L;j++) z[j]=(t[L+j]&mask)|(d[j]&~mask);
+}
+
+/* z=x.y/2^(52K) mod p, fully reduced, on K 52-bit limbs (arrays padded with
+   zeros to a multiple of 8). The sum is kept as lo and hi halves of the
+   products, hi one limb up, and a limb is shifted out each step */
+__attribute__((target("avx512f,avx512ifma")))
+static void FF_mul_ifma(unsign64 z[],const unsign64 x[],const unsign64 y[],const unsign64 p[],unsign64 k0,int K)
+{
+	int i,v,V=(K+7)/8;
+	__m512i lo[MCL_FF_MONT_LIMBS/8],hi[MCL_FF_MONT_LIMBS/8],yv[MCL_FF_MONT_LIMBS/8],pv[MCL_FF_MONT_LIMBS/8];
+	__m512i xi,mi,zero=_mm512_setzero_si512();
+	unsign64 t[MCL_FF_MONT_LIMBS],d[MCL_FF_MONT_LIMBS],lo0,m,c,b,mask;
+
+	for (v=0;v<V;v++)
+	{
+		yv[v]=_mm512_loadu_si512((const void *)&y[8*v]);
+		pv[v]=_mm512_loadu_si512((const void *)&p[8*v]);
+		lo[v]=zero;
+	}
+	for (i=0;i<K;i++)
+	{
+		xi=_mm512_set1_epi64((long long)x[i]);
+		for (v=0;v<V;v++) lo[v]=_mm512_madd52lo_epu64(lo[v],xi,yv[v]);
+		lo0=(unsign64)_mm_cvtsi128_si64(_mm512_castsi512_si128(lo[0]));
+		m=(lo0*k0)&FF_M52;
+		mi=_mm512_set1_epi64((long long)m);
+		for (v=0;v<V;v++)
+		{
+			lo[v]=_mm512_madd52lo_epu64(lo[v],mi,pv[v]);
+			hi[v]=_mm512_madd52hi_epu64(zero,xi,yv[v]);
+			hi[v]=_mm512_madd52hi_epu64(hi[v],mi,pv[v]);
+		}
+		c=(lo0+((m*p[0])&FF_M52))>>52; /* limb 0 is now a multiple of 2^52 */
+		for (v=0;v<V-1;v++) lo[v]=_mm512_alignr_epi64(lo[v+1],lo[v],1);
+		lo[V-1]=_mm512_alignr_epi64(zero,lo[V-1],1);
+		for (v=0;v<V;v++) lo[v]=_mm512_add_epi64(lo[v],hi[v]);
+		lo[0]=_mm512_mask_add_epi64(lo[0],1,lo[0],_mm512_set1_epi64((long long)c));
+	}
+
+	for (v=0;v<V;v++) _mm512_storeu_si512((void *)&t[8*v],lo[v]);
+	for (c=0,i=0;i<8*V;i++)
+	{
+		t[i]+=c; c=t[i]>>52; t[i]&=FF_M52;
+	}
+/* t < 2p, so subtract p unless that borrows */
+	for (b=0,i=0;i<K;i++)
+	{
+		d[i]=t[i]-p[i]-b;
+		b=d[i]>>63;
+		d[i]&=FF_M52;
+	}
+	mask=0-b;
+	for (i=0;i<K;i++) z[i]=(t[i]&mask)|(d[i]&~mask);
+	for (;i<8*V;i++) z[i]=0;
+}
+
+static void FF_wcopy(unsign64 x[],const unsign64 y[])
+{
+	int i;
+	for (i=0;i<MCL_FF_MONT_LIMBS;i++) x[i]=y[i];
+}
+
+/* z=x.y/R mod p on the context's backend */
+static void FF_mont_mulw(MCL_FF_mont *M,unsign64 z[],const unsign64 x[],const unsign64 y[])
+{
+	if (M->backend==FF_CPU_IFMA) FF_mul_ifma(z,x,y,M->pw,M->k0,M->nw);
+	else FF_mul_adx(z,x,y,M->pw,M->k0,M->nw);
+}
+
+/* w=x in the context's backend representation */
+static void FF_mont_load(MCL_FF_mont *M,unsign64 w[],mcl_chunk x[][MCL_BS])
+{
+	unsign64 t[MCL_FF_MONT_LIMBS];
+	MCL_FF_norm(x,M->n);
+	if (M->backend==FF_CPU_IFMA)
+	{
+		FF_to64(t,MCL_FF_MONT_LIMBS,x,M->n);
+		FF_64to52(w,MCL_FF_MONT_LIMBS,t,MCL_FF_MONT_LIMBS);
+	}
+	else FF_to64(w,MCL_FF_MONT_LIMBS,x,M->n);
+}
+
+/* x=w from the context's backend representation */
+static void FF_mont_store(MCL_FF_mont *M,mcl_chunk x[][MCL_BS],const unsign64 w[])
+{
+	unsign64 t[MCL_FF_MONT_LIMBS];
+	if (M->backend==FF_CPU_IFMA)
+	{
+		FF_52to64(t,MCL_FF_MONT_LIMBS,w,MCL_FF_MONT_LIMBS);
+		FF_from64(x,M->n,t);
+	}
+	else FF_from64(x,M->n,w);
+}
+
+/* Set up the backend half of a context, given M->p and M->n */
+static void FF_mont_init_backend(MCL_FF_mont *M)
+{
+	int i,L=(MCL_BIGBITS*M->n+63)/64,Rbits,t,k;
+	unsign64 p64[MCL_FF_MONT_LIMBS],w[MCL_FF_MONT_LIMBS],inv;
+
+	FF_to64(p64,MCL_FF_MONT_LIMBS,M->p,M->n);
+/* -1/p mod 2^64, by Newton iteration */
+	inv=p64[0];
+	for (i=0;i<5;i++) inv*=2-p64[0]*inv;
+
+	if (ff_select()&FF_CPU_IFMA)
+	{
+		M->backend=FF_CPU_IFMA;
+		M->nw=(MCL_BIGBITS*M->n+52)/52; /* room for 2p */
+		M->k0=(0-inv)&FF_M52;
+		FF_64to52(M->pw,MCL_FF_MONT_LIMBS,p64,L);
+		Rbits=52*M->nw;
+	}
+	else
+	{
+		M->backend=FF_CPU_ADX;
+		M->nw=L;
+		M->k0=0-inv;
+		FF_wcopy(M->pw,p64);
+		Rbits=64*L;
+	}
+
+/* 1 in Montgomery form is R mod p */
+	FF_pow2mod64(w,Rbits,p64,L);
+	for (i=L;i<MCL_FF_MONT_LIMBS;i++) w[i]=0;
+	if (M->backend==FF_CPU_IFMA) FF_64to52(M->onew,MCL_FF_MONT_LIMBS,w,L);
+	else FF_wcopy(M->onew,w);
+	FF_mont_store(M,M->one,M->onew);
+
+/* R^2 mod p - R.2^t squared k times, where t.2^k=Rbits */
+	for (t=Rbits,k=0;(t&1)==0 && t>64;t>>=1,k++);
+	FF_pow2mod64(w,Rbits+t,p64,L);
+	for (i=L;i<MCL_FF_MONT_LIMBS;i++) w[i]=0;
+	if (M->backend==FF_CPU_IFMA) FF_64to52(M->R2w,MCL_FF_MONT_LIMBS,w,L);
+	else FF_wcopy(M->R2w,w);
+	for (i=0;i<k;i++) FF_mont_mulw(M,M->R2w,M->R2w,M->R2w);
+	FF_mont_store(M,M->R2,M->R2w);
+}
+
+/* r=x^e using sliding windows, on the backend - x and r in Montgomery form */
+static void FF_mont_pow_backend(MCL_FF_mont *M,unsign64 r[],const unsign64 x[],mcl_chunk e[][MCL_BS])
+{
+	int i,j,k,f=1;
+	unsign64 tab[1<<(FF_WINDOW-1)][MCL_FF_MONT_LIMBS],x2[MCL_FF_MONT_LIMBS];
+
+	FF_wcopy(tab[0],x);
+	FF_mont_mulw(M,x2,tab[0],tab[0]);
+	for (j=1;j<(1<<(FF_WINDOW-1));j++)
+		FF_mont_mulw(M,tab[j],tab[j-1],x2);
+
+	FF_wcopy(r,M->onew);
+	for (i=8*MCL_MODBYTES*M->n-1;i>=0;)
+	{
+		if (MCL_BIG_bit(e[i/MCL_BIGBITS],i%MCL_BIGBITS)==0)
+		{
+			if (!f) FF_mont_mulw(M,r,r,r);
+			i--;
+			continue;
+		}
+		j=i-FF_WINDOW+1;
+		if (j<0) j=0;
+		while (MCL_BIG_bit(e[j/MCL_BIGBITS],j%MCL_BIGBITS)==0) j++;
+
+		if (f) FF_wcopy(r,tab[FF_ebits(e,i,i-j+1)/2]);
+		else
+		{
+			for (k=i;k>=j;k--)
+				FF_mont_mulw(M,r,r,r);
+			FF_mont_mulw(M,r,r,tab[FF_ebits(e,i,i-j+1)/2]);
+		}
+		f=0;
+		i=j-1;
+	}
+}
+
+/* r=x^e using side-channel resistant fixed windows, on the backend */
+static void FF_mont_skpow_backend(MCL_FF_mont *M,unsign64 r[],const unsign64 x[],mcl_chunk e[][MCL_BS])
+{
+	int i,j,k,w;
+	unsign64 tab[1<<FF_SKWINDOW][MCL_FF_MONT_LIMBS],t[MCL_FF_MONT_LIMBS],mask;
+
+	FF_wcopy(tab[0],M->onew);
+	FF_wcopy(tab[1],x);
+	for (j=2;j<(1<<FF_SKWINDOW);j++)
+		FF_mont_mulw(M,tab[j],tab[j-1],tab[1]);
+
+	for (i=8*MCL_MODBYTES*M->n-1;i>=0;i-=FF_SKWINDOW)
+	{
+		w=FF_ebits(e,i,FF_SKWINDOW);
+		FF_wcopy(t,tab[0]);
+		for (j=1;j<(1<<FF_SKWINDOW);j++)
+		{
+			mask=0-(unsign64)FF_teq(j,w);
+			for (k=0;k<MCL_FF_MONT_LIMBS;k++) t[k]=(t[k]&~mask)|(tab[j][k]&mask);
+		}
+		if (i==8*MCL_MODBYTES*M->n-1)
+		{
+			FF_wcopy(r,t);
+			continue;
+		}
+		for (k=0;k<FF_SKWINDOW;k++)
+			FF_mont_mulw(M,r,r,r);
+		FF_mont_mulw(M,r,r,t);
+	}
+}
+
+#endif /* MCL_FF_X86 */
+
+/* r=x^e mod p using side-channel resistant fixed windows, for large e */
+/* The table is scanned in full for every window, so the memory access pattern does not depend on e */
 void MCL_FF_skpow(mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk e[][MCL_BS],mcl_chunk p[][MCL_BS],int n)
 {
-	int i,b;
+	int i,j,k,w;
 #ifndef C99
-	mcl_chunk R0[MCL_FFLEN][MCL_BS],R1[MCL_FFLEN][MCL_BS],ND[MCL_FFLEN][MCL_BS];
+	mcl_chunk t[MCL_FFLEN][MCL_BS],ND[MCL_FFLEN][MCL_BS];
+	mcl_chunk tab[1<<FF_SKWINDOW][MCL_FFLEN][MCL_BS];
 #else
-	mcl_chunk R0[n][MCL_BS],R1[n][MCL_BS],ND[n][MCL_BS];
+	mcl_chunk t[n][MCL_BS],ND[n][MCL_BS];
+	mcl_chunk tab[1<<FF_SKWINDOW][n][MCL_BS];
+#endif
+#ifdef MCL_FF_X86
+	MCL_FF_mont M;
+	unsign64 wx[MCL_FF_MONT_LIMBS],wr[MCL_FF_MONT_LIMBS];
+	if (ff_select()!=0 && MCL_BIG_parity(p[0])==1)
+	{
+		MCL_FF_mont_init(&M,p,n);
+		MCL_FF_copy(t,x,n);
+		MCL_FF_mod(t,M.p,n);
+		MCL_FF_mont_nres(&M,t);
+		FF_mont_load(&M,wx,t);
+		FF_mont_skpow_backend(&M,wr,wx,e);
+		FF_mont_store(&M,r,wr);
+		MCL_FF_mont_redc(&M,r);
+		return;
+	}
 #endif
 	FF_invmod2m(ND,p,n);	
 
-	MCL_FF_one(R0,n);
-	MCL_FF_copy(R1,x,n);
-	FF_nres(R0,p,n);
-	FF_nres(R1,p,n);
+/* tab[j]=x^j, in Montgomery form */
+	MCL_FF_one(tab[0],n);
+	MCL_FF_copy(tab[1],x,n);
+	FF_nres(tab[0],p,n);
+	FF_nres(tab[1],p,n);
+	for (j=2;j<(1<<FF_SKWINDOW);j++)
+	{ /* fully reduce the table, so multiplying by it never needs a mid-loop MCL_FF_mod */
+		MCL_FF_modmul(tab[j],tab[j-1],tab[1],p,ND,n);
+		MCL_FF_mod(tab[j],p,n);
+	}
 
-	for (i=8*MCL_MODBYTES*n-1;i>=0;i--)
+	for (i=8*MCL_MODBYTES*n-1;i>=0;i-=FF_SKWINDOW)
 	{
-		b=MCL_BIG_bit(e[i/MCL_BIGBITS],i%MCL_BIGBITS);
-		MCL_FF_modmul(r,R0,R1,p,ND,n);
-
-		FF_cswap(R0,R1,b,n);
-		MCL_FF_modsqr(R0,R0,p,ND,n);
-
-		MCL_FF_copy(R1,r,n);
-		FF_cswap(R0,R1,b,n);
+		w=FF_ebits(e,i,FF_SKWINDOW);
+		MCL_FF_copy(t,tab[0],n);
+		for (j=1;j<(1<<FF_SKWINDOW);j++)
+			FF_cmove(t,tab[j],FF_teq(j,w),n);
+		if (i==8*MCL_MODBYTES*n-1)
+		{
+			MCL_FF_copy(r,t,n);
+			continue;
+		}
+		for (k=0;k<FF_SKWINDOW;k++)
+			MCL_FF_modsqr(r,r,p,ND,n);
+		MCL_FF_modmul(r,r,t,p,ND,n);
 	}
-	MCL_FF_copy(r,R0,n);
 	FF_redc(r,p,ND,n);
 }
 
@@ -905,28 +1361,180 @@ void MCL_FF_power(mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],int e,mcl_chunk p[
 	FF_redc(r,p,ND,n);
 }
 
-/* r=x^e mod p, faster but not side channel resistant */
-void MCL_FF_pow(mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk e[][MCL_BS],mcl_chunk p[][MCL_BS],int n)
+/* Montgomery context - everything that depends only on the modulus, so
+   repeated arithmetic with one modulus pays for the setup once */
+void MCL_FF_mont_init(MCL_FF_mont *M,mcl_chunk p[][MCL_BS],int n)
 {
-	int i,b;
+	M->n=n;
+	MCL_FF_copy(M->p,p,n);
+	MCL_FF_norm(M->p,n);
+	M->backend=0;
+#ifdef MCL_FF_X86
+	if (ff_select()!=0 && MCL_BIG_parity(M->p[0])==1)
+	{ /* the backend sets up one and R2 itself, and never needs ND */
+		FF_mont_init_backend(M);
+		return;
+	}
+#endif
+	FF_invmod2m(M->ND,M->p,n);
+	MCL_FF_one(M->one,n);
+	FF_nres(M->one,M->p,n);
+	MCL_FF_copy(M->R2,M->one,n);
+	FF_nres(M->R2,M->p,n);
+}
+
+/* Pick the Montgomery arithmetic backend for this CPU, once, up front */
+void MCL_FF_backend_init(void)
+{
+#ifdef MCL_FF_X86
+	ff_select();
+#endif
+}
+
+/* a=a.R mod p, fully reduced. Needs 0 <= a < p */
+void MCL_FF_mont_nres(MCL_FF_mont *M,mcl_chunk a[][MCL_BS])
+{
+#ifdef MCL_FF_X86
+	unsign64 w[MCL_FF_MONT_LIMBS];
+	if (M->backend)
+	{
+		FF_mont_load(M,w,a);
+		FF_mont_mulw(M,w,w,M->R2w);
+		FF_mont_store(M,a,w);
+		return;
+	}
+#endif
+	MCL_FF_modmul(a,a,M->R2,M->p,M->ND,M->n);
+	MCL_FF_mod(a,M->p,M->n);
+}
+
+/* a=a/R mod p, fully reduced */
+void MCL_FF_mont_redc(MCL_FF_mont *M,mcl_chunk a[][MCL_BS])
+{
+#ifdef MCL_FF_X86
+	int i;
+	unsign64 w[MCL_FF_MONT_LIMBS],u[MCL_FF_MONT_LIMBS];
+	if (M->backend)
+	{
+		for (i=0;i<MCL_FF_MONT_LIMBS;i++) u[i]=0;
+		u[0]=1;
+		MCL_FF_mod(a,M->p,M->n);
+		FF_mont_load(M,w,a);
+		FF_mont_mulw(M,w,w,u);
+		FF_mont_store(M,a,w);
+		return;
+	}
+#endif
+	FF_redc(a,M->p,M->ND,M->n);
+}
+
+/* z=x.y/R mod p - not fully reduced */
+void MCL_FF_mont_mul(MCL_FF_mont *M,mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk y[][MCL_BS])
+{
+#ifdef MCL_FF_X86
+	unsign64 wx[MCL_FF_MONT_LIMBS],wy[MCL_FF_MONT_LIMBS];
+	if (M->backend)
+	{
+		FF_mont_load(M,wx,x);
+		FF_mont_load(M,wy,y);
+		FF_mont_mulw(M,wx,wx,wy);
+		FF_mont_store(M,z,wx);
+		return;
+	}
+#endif
+	MCL_FF_modmul(z,x,y,M->p,M->ND,M->n);
+}
+
+/* z=x^2/R mod p - not fully reduced */
+void MCL_FF_mont_sqr(MCL_FF_mont *M,mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS])
+{
+#ifdef MCL_FF_X86
+	unsign64 w[MCL_FF_MONT_LIMBS];
+	if (M->backend)
+	{
+		FF_mont_load(M,w,x);
+		FF_mont_mulw(M,w,w,w);
+		FF_mont_store(M,z,w);
+		return;
+	}
+#endif
+	MCL_FF_modsqr(z,x,M->p,M->ND,M->n);
+}
+
+/* r=x^e mod p using sliding windows, faster but not side channel resistant */
+/* x and r are in Montgomery form, r is not fully reduced */
+void MCL_FF_mont_pow(MCL_FF_mont *M,mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk e[][MCL_BS])
+{
+	int i,j,k,f=1;
+	int n=M->n;
 #ifndef C99
-	mcl_chunk w[MCL_FFLEN][MCL_BS],ND[MCL_FFLEN][MCL_BS];
+	mcl_chunk x2[MCL_FFLEN][MCL_BS];
+	mcl_chunk tab[1<<(FF_WINDOW-1)][MCL_FFLEN][MCL_BS];
 #else
-	mcl_chunk w[n][MCL_BS],ND[n][MCL_BS];
+	mcl_chunk x2[n][MCL_BS];
+	mcl_chunk tab[1<<(FF_WINDOW-1)][n][MCL_BS];
+#endif
+#ifdef MCL_FF_X86
+	unsign64 wx[MCL_FF_MONT_LIMBS],wr[MCL_FF_MONT_LIMBS];
+	if (M->backend)
+	{
+		MCL_FF_copy(x2,x,n);
+		MCL_FF_mod(x2,M->p,n);
+		FF_mont_load(M,wx,x2);
+		FF_mont_pow_backend(M,wr,wx,e);
+		FF_mont_store(M,r,wr);
+		return;
+	}
 #endif
-	FF_invmod2m(ND,p,n);
-	MCL_FF_copy(w,x,n);
-	MCL_FF_one(r,n);
-	FF_nres(r,p,n);
-	FF_nres(w,p,n);
 
-	for (i=8*MCL_MODBYTES*n-1;i>=0;i--)
+/* tab[j]=x^(2j+1), in Montgomery form */
+	MCL_FF_copy(tab[0],x,n);
+	MCL_FF_mod(tab[0],M->p,n);
+	MCL_FF_mont_sqr(M,x2,tab[0]);
+	MCL_FF_mod(x2,M->p,n);
+	for (j=1;j<(1<<(FF_WINDOW-1));j++)
+	{ /* fully reduce the table, so multiplying by it never needs a mid-loop MCL_FF_mod */
+		MCL_FF_mont_mul(M,tab[j],tab[j-1],x2);
+		MCL_FF_mod(tab[j],M->p,n);
+	}
+
+	MCL_FF_copy(r,M->one,n);
+
+	for (i=8*MCL_MODBYTES*n-1;i>=0;)
 	{
-		MCL_FF_modsqr(r,r,p,ND,n);
-		b=MCL_BIG_bit(e[i/MCL_BIGBITS],i%MCL_BIGBITS);
-		if (b==1) MCL_FF_modmul(r,r,w,p,ND,n);
+		if (MCL_BIG_bit(e[i/MCL_BIGBITS],i%MCL_BIGBITS)==0)
+		{
+			if (!f) MCL_FF_mont_sqr(M,r,r);
+			i--;
+			continue;
+		}
+/* longest window ending in a 1 bit */
+		j=i-FF_WINDOW+1;
+		if (j<0) j=0;
+		while (MCL_BIG_bit(e[j/MCL_BIGBITS],j%MCL_BIGBITS)==0) j++;
+
+		if (f) MCL_FF_copy(r,tab[FF_ebits(e,i,i-j+1)/2],n);
+		else
+		{
+			for (k=i;k>=j;k--)
+				MCL_FF_mont_sqr(M,r,r);
+			MCL_FF_mont_mul(M,r,r,tab[FF_ebits(e,i,i-j+1)/2]);
+		}
+		f=0;
+		i=j-1;
 	}
-	FF_redc(r,p,ND,n);
+}
+
+/* r=x^e mod p, faster but not side channel resistant */
+void MCL_FF_pow(mcl_chunk r[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk e[][MCL_BS],mcl_chunk p[][MCL_BS],int n)
+{
+	MCL_FF_mont M;
+	MCL_FF_mont_init(&M,p,n);
+	MCL_FF_copy(r,x,n);
+	MCL_FF_mod(r,M.p,n);
+	MCL_FF_mont_nres(&M,r);
+	MCL_FF_mont_pow(&M,r,r,e);
+	MCL_FF_mont_redc(&M,r);
 }
 
 /* double exponentiation r=x^e.y^f mod p */
@@ -1007,22 +1615,44 @@ int MCL_FF_cfactor(mcl_chunk w[][MCL_BS],sign32 s,int n)
 	return 0;
 }
 
-/* Miller-Rabin test for primality. Slow. */
-int MCL_FF_prime(mcl_chunk p[][MCL_BS],csprng *rng,int n)
+/* Miller-Rabin rounds per candidate */
+#define FF_MR_ROUNDS 10
+/* random base Miller-Rabin rounds after the base 2 and Lucas tests of MCL_FF_PRIME_BPSW */
+#define FF_BPSW_ROUNDS 2
+/* Lucas D values to try before giving up (a square has none) */
+#define FF_LUCAS_TRIES 64
+
+/* One Miller-Rabin round on base x, in Montgomery form, where p-1=2^s.d and
+   nm1 is p-1 in Montgomery form. x is destroyed. Returns 1 if p passes */
+static int FF_mr_round(MCL_FF_mont *M,mcl_chunk x[][MCL_BS],mcl_chunk d[][MCL_BS],mcl_chunk nm1[][MCL_BS],int s)
 {
-	int i,j,loop,s=0;
-#ifndef C99
-	mcl_chunk d[MCL_FFLEN][MCL_BS],x[MCL_FFLEN][MCL_BS],unity[MCL_FFLEN][MCL_BS],nm1[MCL_FFLEN][MCL_BS];
-#else
-	mcl_chunk d[n][MCL_BS],x[n][MCL_BS],unity[n][MCL_BS],nm1[n][MCL_BS];
-#endif
+	int j,n=M->n;
+	MCL_FF_mont_pow(M,x,x,d);
+	MCL_FF_mod(x,M->p,n);
+
+	if (MCL_FF_comp(x,M->one,n)==0 || MCL_FF_comp(x,nm1,n)==0) return 1;
+	for (j=1;j<s;j++)
+	{
+		MCL_FF_mont_sqr(M,x,x);
+		MCL_FF_mod(x,M->p,n);
+		if (MCL_FF_comp(x,M->one,n)==0) return 0;
+		if (MCL_FF_comp(x,nm1,n)==0) return 1;
+	}
+	return 0;
+}
+
+/* Set up p for Miller-Rabin - trial division, p-1=2^s.d, nm1=p-1 in Montgomery
+   form. Returns s, or 0 if p is certainly composite */
+static int FF_mr_setup(MCL_FF_mont *M,mcl_chunk p[][MCL_BS],mcl_chunk d[][MCL_BS],mcl_chunk nm1[][MCL_BS],int n)
+{
+	int s=0;
 	sign32 sf=4849845;/* 3*5*.. *19 */
 
 	MCL_FF_norm(p,n);
 	if (MCL_FF_cfactor(p,sf,n)) return 0;
 
-	MCL_FF_one(unity,n);
-	MCL_FF_sub(nm1,p,unity,n);
+	MCL_FF_one(nm1,n);
+	MCL_FF_sub(nm1,p,nm1,n);
 	MCL_FF_norm(nm1,n);
 	MCL_FF_copy(d,nm1,n);
 
@@ -1033,26 +1663,477 @@ int MCL_FF_prime(mcl_chunk p[][MCL_BS],csprng *rng,int n)
 	}
 	if (s==0) return 0;
 
-	for (i=0;i<10;i++)
+	MCL_FF_mont_init(M,p,n);
+	MCL_FF_mont_nres(M,nm1);
+	return s;
+}
+
+/* x mod m, for a small m */
+static int FF_modint(mcl_chunk x[][MCL_BS],int m,int n)
+{
+	int i;
+	sign32 r=0;
+	for (i=8*MCL_MODBYTES*n-1;i>=0;i--)
+		r=(2*r+MCL_BIG_bit(x[i/MCL_BIGBITS],i%MCL_BIGBITS))%m;
+	return (int)r;
+}
+
+/* Jacobi symbol (a/m), for m odd and positive */
+static int FF_jacobi_int(int a,int m)
+{
+	int t,j=1;
+	a%=m;
+	if (a<0) a+=m;
+	while (a!=0)
+	{
+		while ((a&1)==0)
+		{
+			a>>=1;
+			if ((m&7)==3 || (m&7)==5) j=-j;
+		}
+		t=a; a=m; m=t;
+		if ((a&3)==3 && (m&3)==3) j=-j;
+		a%=m;
+	}
+	return (m==1)?j:0;
+}
+
+/* Jacobi symbol (D/p), for a small odd D and a large odd p, by reciprocity */
+static int FF_jacobi_small(int D,mcl_chunk p[][MCL_BS],int n)
+{
+	int a=(D<0)?-D:D,j;
+	j=FF_jacobi_int(FF_modint(p,a,n),a);
+	if ((a&3)==3 && MCL_FF_lastbits(p,2)==3) j=-j;
+	if (D<0 && MCL_FF_lastbits(p,2)==3) j=-j; /* (-1/p) */
+	return j;
+}
+
+/* z=x+y mod p, for x,y in [0,p) */
+static void FF_modadd(mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk y[][MCL_BS],mcl_chunk p[][MCL_BS],int n)
+{
+	MCL_FF_add(z,x,y,n);
+	MCL_FF_norm(z,n);
+	if (MCL_FF_comp(z,p,n)>=0)
+	{
+		MCL_FF_sub(z,z,p,n);
+		MCL_FF_norm(z,n);
+	}
+}
+
+/* z=x-y mod p, for x,y in [0,p) */
+static void FF_modsub(mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk y[][MCL_BS],mcl_chunk p[][MCL_BS],int n)
+{
+#ifndef C99
+	mcl_chunk t[MCL_FFLEN][MCL_BS];
+#else
+	mcl_chunk t[n][MCL_BS];
+#endif
+	if (MCL_FF_comp(x,y,n)<0)
+	{
+		MCL_FF_add(t,x,p,n);
+		MCL_FF_sub(z,t,y,n);
+	}
+	else MCL_FF_sub(z,x,y,n);
+	MCL_FF_norm(z,n);
+}
+
+/* x=x/2 mod p, for x in [0,p) */
+static void FF_modhalf(mcl_chunk x[][MCL_BS],mcl_chunk p[][MCL_BS],int n)
+{
+	if (MCL_FF_parity(x))
+	{
+		MCL_FF_add(x,x,p,n);
+		MCL_FF_norm(x,n);
+	}
+	MCL_FF_shr(x,n);
+}
+
+/* x=m mod p in Montgomery form, for a small signed m */
+static void FF_mont_int(MCL_FF_mont *M,mcl_chunk x[][MCL_BS],int m)
+{
+	if (m>=0) MCL_FF_init(x,m,M->n);
+	else
+	{
+		MCL_FF_copy(x,M->p,M->n);
+		MCL_FF_dec(x,-m,M->n);
+	}
+	MCL_FF_mont_nres(M,x);
+}
+
+/* z=x.y/R mod p, fully reduced */
+static void FF_mont_mulmod(MCL_FF_mont *M,mcl_chunk z[][MCL_BS],mcl_chunk x[][MCL_BS],mcl_chunk y[][MCL_BS])
+{
+	MCL_FF_mont_mul(M,z,x,y);
+	MCL_FF_mod(z,M->p,M->n);
+}
+
+/* Strong Lucas probable prime test, with Selfridge's parameters - the first D
+   in 5,-7,9,-11.. with (D/p)=-1, P=1 and Q=(1-D)/4. With p+1=2^s.d, p passes
+   if U_d=0, or V_(d.2^r)=0 for some 0<=r<s. Returns 1 if p passes, 0 if it is
+   composite, or -1 if no D was found (as for a square) */
+static int FF_lucas(MCL_FF_mont *M)
+{
+	int i,j,D,Q,s=0,top,n=M->n;
+#ifndef C99
+	mcl_chunk d[MCL_FFLEN][MCL_BS],U[MCL_FFLEN][MCL_BS],V[MCL_FFLEN][MCL_BS],Qk[MCL_FFLEN][MCL_BS];
+	mcl_chunk Dm[MCL_FFLEN][MCL_BS],Qm[MCL_FFLEN][MCL_BS],t[MCL_FFLEN][MCL_BS];
+#else
+	mcl_chunk d[n][MCL_BS],U[n][MCL_BS],V[n][MCL_BS],Qk[n][MCL_BS];
+	mcl_chunk Dm[n][MCL_BS],Qm[n][MCL_BS],t[n][MCL_BS];
+#endif
+
+	for (i=0,D=5;i<FF_LUCAS_TRIES;i++)
+	{
+		j=FF_jacobi_small(D,M->p,n);
+		if (j==-1) break;
+		if (j==0) return 0; /* |D| is a factor, and p is larger */
+		D=(D>0)?-(D+2):-(D-2);
+	}
+	if (i==FF_LUCAS_TRIES) return -1;
+	Q=(1-D)/4;
+
+/* p+1=2^s.d */
+	MCL_FF_copy(d,M->p,n);
+	MCL_FF_inc(d,1,n);
+	while (MCL_FF_parity(d)==0)
+	{
+		MCL_FF_shr(d,n);
+		s++;
+	}
+
+	FF_mont_int(M,Dm,D);
+	FF_mont_int(M,Qm,Q);
+
+/* U_1=1, V_1=P=1, Q^1 - then left to right through the bits of d */
+	MCL_FF_copy(U,M->one,n);
+	MCL_FF_copy(V,M->one,n);
+	MCL_FF_copy(Qk,Qm,n);
+	for (top=8*MCL_MODBYTES*n-1;MCL_BIG_bit(d[top/MCL_BIGBITS],top%MCL_BIGBITS)==0;top--);
+	for (i=top-1;i>=0;i--)
+	{
+/* U_2k=U_k.V_k, V_2k=V_k^2-2Q^k, Q^2k */
+		FF_mont_mulmod(M,U,U,V);
+		FF_mont_mulmod(M,V,V,V);
+		FF_modadd(t,Qk,Qk,M->p,n);
+		FF_modsub(V,V,t,M->p,n);
+		FF_mont_mulmod(M,Qk,Qk,Qk);
+		if (MCL_BIG_bit(d[i/MCL_BIGBITS],i%MCL_BIGBITS))
+		{
+/* U_k+1=(U_k+V_k)/2, V_k+1=(D.U_k+V_k)/2, Q^k+1 */
+			FF_mont_mulmod(M,t,Dm,U);
+			FF_modadd(U,U,V,M->p,n);
+			FF_modhalf(U,M->p,n);
+			FF_modadd(V,t,V,M->p,n);
+			FF_modhalf(V,M->p,n);
+			FF_mont_mulmod(M,Qk,Qk,Qm);
+		}
+	}
+
+	if (MCL_FF_iszilch(U,n) || MCL_FF_iszilch(V,n)) return 1;
+	for (j=1;j<s;j++)
+	{
+		FF_mont_mulmod(M,V,V,V);
+		FF_modadd(t,Qk,Qk,M->p,n);
+		FF_modsub(V,V,t,M->p,n);
+		if (MCL_FF_iszilch(V,n)) return 1;
+		FF_mont_mulmod(M,Qk,Qk,Qk);
+	}
+	return 0;
+}
+
+/* Probable prime test. MCL_FF_PRIME_MR is 10 random base Miller-Rabin rounds.
+   MCL_FF_PRIME_BPSW starts with base 2, which rejects nearly every composite
+   in one exponentiation, then runs a strong Lucas test and just a couple of
+   random base rounds on the survivors */
+/* All rounds share one Montgomery context, and stay in Montgomery form */
+int MCL_FF_prime_test(mcl_chunk p[][MCL_BS],csprng *rng,int profile,int n)
+{
+	int i,s,rounds=FF_MR_ROUNDS;
+	MCL_FF_mont M;
+#ifndef C99
+	mcl_chunk d[MCL_FFLEN][MCL_BS],x[MCL_FFLEN][MCL_BS],nm1[MCL_FFLEN][MCL_BS];
+#else
+	mcl_chunk d[n][MCL_BS],x[n][MCL_BS],nm1[n][MCL_BS];
+#endif
+
+	s=FF_mr_setup(&M,p,d,nm1,n);
+	if (s==0) return 0;
+
+	if (profile==MCL_FF_PRIME_BPSW)
+	{
+		FF_mont_int(&M,x,2);
+		if (!FF_mr_round(&M,x,d,nm1,s)) return 0;
+		i=FF_lucas(&M);
+		if (i==0) return 0;
+		if (i>0) rounds=FF_BPSW_ROUNDS; /* else fall back to the full count */
+	}
+
+	for (i=0;i<rounds;i++)
 	{
 		MCL_FF_randomnum(x,p,rng,n);
-		MCL_FF_pow(x,x,d,p,n);
+		MCL_FF_mont_nres(&M,x);
+		if (!FF_mr_round(&M,x,d,nm1,s)) return 0;
+	}
 
-		if (MCL_FF_comp(x,unity,n)==0 || MCL_FF_comp(x,nm1,n)==0) continue;
-		loop=0;
-		for (j=1;j<s;j++)
+	return 1;
+}
+
+/* Miller-Rabin test for primality. Slow. */
+int MCL_FF_prime(mcl_chunk p[][MCL_BS],csprng *rng,int n)
+{
+	return MCL_FF_prime_test(p,rng,MCL_FF_PRIME_MR,n);
+}
+
+/* Batch Miller-Rabin. Up to MCL_FF_PRIME_LANES candidates are in flight, one
+   per lane; every pass gives each of them its next round, and a lane whose
+   candidate fails or passes every round takes the next candidate, so the
+   lanes stay full while most candidates fail their first round */
+
+typedef struct
+{
+	int c;		/* candidate in this lane, -1 if idle */
+	int round;	/* rounds passed */
+	int rounds;	/* rounds needed */
+	int s;		/* p-1=2^s.d */
+	int pass;	/* outcome of this pass */
+	MCL_FF_mont M;
+	mcl_chunk d[MCL_FFLEN][MCL_BS];
+	mcl_chunk nm1[MCL_FFLEN][MCL_BS];	/* p-1 in Montgomery form */
+	mcl_chunk x[MCL_FFLEN][MCL_BS];		/* the round's base, in Montgomery form */
+} FF_mr_lane;
+
+#ifdef MCL_FF_X86
+
+/* z=x.y/R mod p in each of 8 lanes, fully reduced, with limb i of lane k at
+   [i][k]. The IFMA kernel turned on its side, so that every lane can have its
+   own modulus */
+__attribute__((target("avx512f,avx512ifma")))
+static void FF_mul_ifma_x8(unsign64 z[][8],unsign64 x[][8],unsign64 y[][8],unsign64 p[][8],const unsign64 k0[8],int K)
+{
+	int i,j;
+	__m512i acc[MCL_FF_MONT_LIMBS],d[MCL_FF_MONT_LIMBS];
+	__m512i xi,m,c,b,k,m52=_mm512_set1_epi64((long long)FF_M52),zero=_mm512_setzero_si512();
+	__mmask8 keep;
+
+	k=_mm512_loadu_si512((const void *)k0);
+	for (j=0;j<K;j++) acc[j]=zero;
+	for (i=0;i<K;i++)
+	{
+		xi=_mm512_loadu_si512((const void *)x[i]);
+		for (j=0;j<K;j++) acc[j]=_mm512_madd52lo_epu64(acc[j],xi,_mm512_loadu_si512((const void *)y[j]));
+		m=_mm512_madd52lo_epu64(zero,acc[0],k);
+		for (j=0;j<K;j++) acc[j]=_mm512_madd52lo_epu64(acc[j],m,_mm512_loadu_si512((const void *)p[j]));
+		c=_mm512_srli_epi64(acc[0],52); /* limb 0 is now a multiple of 2^52 */
+/* shift a limb out, adding in the high halves one limb up */
+		for (j=0;j<K-1;j++)
 		{
-			MCL_FF_power(x,x,2,p,n);
-			if (MCL_FF_comp(x,unity,n)==0) return 0;
-			if (MCL_FF_comp(x,nm1,n)==0 ) {loop=1; break;}
+			acc[j]=_mm512_madd52hi_epu64(acc[j+1],xi,_mm512_loadu_si512((const void *)y[j]));
+			acc[j]=_mm512_madd52hi_epu64(acc[j],m,_mm512_loadu_si512((const void *)p[j]));
 		}
-		if (loop) continue;
-		return 0;
+		acc[K-1]=_mm512_madd52hi_epu64(zero,xi,_mm512_loadu_si512((const void *)y[K-1]));
+		acc[K-1]=_mm512_madd52hi_epu64(acc[K-1],m,_mm512_loadu_si512((const void *)p[K-1]));
+		acc[0]=_mm512_add_epi64(acc[0],c);
+	}
+
+	for (c=zero,j=0;j<K;j++)
+	{
+		acc[j]=_mm512_add_epi64(acc[j],c);
+		c=_mm512_srli_epi64(acc[j],52);
+		acc[j]=_mm512_and_si512(acc[j],m52);
+	}
+/* acc < 2p, so subtract p in the lanes where that does not borrow */
+	for (b=zero,j=0;j<K;j++)
+	{
+		d[j]=_mm512_sub_epi64(_mm512_sub_epi64(acc[j],_mm512_loadu_si512((const void *)p[j])),b);
+		b=_mm512_srli_epi64(d[j],63);
+		d[j]=_mm512_and_si512(d[j],m52);
 	}
+	keep=_mm512_cmpneq_epi64_mask(b,zero);
+	for (j=0;j<K;j++) _mm512_storeu_si512((void *)z[j],_mm512_mask_blend_epi64(keep,d[j],acc[j]));
+}
+
+/* z=tab[w[k]] in each lane k */
+__attribute__((target("avx512f")))
+static void FF_select_x8(unsign64 z[][8],unsign64 tab[][MCL_FF_MONT_LIMBS][8],const int w[8],int K)
+{
+	int j,k;
+	unsign64 ix[8];
+	__m512i idx,step=_mm512_set1_epi64(8);
+	for (k=0;k<8;k++) ix[k]=(unsign64)(w[k]*MCL_FF_MONT_LIMBS*8+k);
+	idx=_mm512_loadu_si512((const void *)ix);
+	for (j=0;j<K;j++)
+	{
+		_mm512_storeu_si512((void *)z[j],_mm512_i64gather_epi64(idx,(const void *)tab,8));
+		idx=_mm512_add_epi64(idx,step);
+	}
+}
 
+/* Is lane k of x equal to y? */
+static int FF_eq_x8(unsign64 x[][8],int k,const unsign64 y[],int K)
+{
+	int j;
+	for (j=0;j<K;j++)
+		if (x[j][k]!=y[j]) return 0;
 	return 1;
 }
 
+/* One Miller-Rabin round in every lane, 8 at a time on IFMA. Each lane's base
+   goes to its own d with 4-bit fixed windows, so that all lanes do the same
+   sequence of multiplications. L[k] may repeat, filling idle lanes */
+static void FF_mr_round_x8(FF_mr_lane *L[8])
+{
+	int i,j,k,w[8],top,bits,maxs,pending;
+	int K=L[0]->M.nw,n=L[0]->M.n;
+	unsign64 P[MCL_FF_MONT_LIMBS][8],X[MCL_FF_MONT_LIMBS][8],R[MCL_FF_MONT_LIMBS][8],T[MCL_FF_MONT_LIMBS][8],k0[8];
+	unsign64 tab[1<<FF_SKWINDOW][MCL_FF_MONT_LIMBS][8],v[MCL_FF_MONT_LIMBS],nm1[8][MCL_FF_MONT_LIMBS];
+
+	top=0; maxs=0;
+	for (k=0;k<8;k++)
+	{
+		k0[k]=L[k]->M.k0;
+		FF_mont_load(&L[k]->M,v,L[k]->x);
+		for (j=0;j<K;j++)
+		{
+			P[j][k]=L[k]->M.pw[j];
+			X[j][k]=v[j];
+			tab[0][j][k]=L[k]->M.onew[j];
+		}
+		FF_mont_load(&L[k]->M,nm1[k],L[k]->nm1);
+		for (bits=8*MCL_MODBYTES*n;bits>0 && MCL_BIG_bit(L[k]->d[(bits-1)/MCL_BIGBITS],(bits-1)%MCL_BIGBITS)==0;bits--);
+		if (bits>top) top=bits;
+		if (L[k]->s>maxs) maxs=L[k]->s;
+	}
+
+/* tab[j]=x^j, in Montgomery form */
+	for (j=0;j<K;j++)
+		for (k=0;k<8;k++) tab[1][j][k]=X[j][k];
+	for (i=2;i<(1<<FF_SKWINDOW);i++)
+		FF_mul_ifma_x8(tab[i],tab[i-1],X,P,k0,K);
+
+/* R=x^d */
+	top=(top+FF_SKWINDOW-1)/FF_SKWINDOW*FF_SKWINDOW; /* d is odd, so top>0 */
+	for (i=top-1;i>=0;i-=FF_SKWINDOW)
+	{
+		for (k=0;k<8;k++) w[k]=FF_ebits(L[k]->d,i,FF_SKWINDOW);
+		if (i==top-1)
+		{
+			FF_select_x8(R,tab,w,K);
+			continue;
+		}
+		for (j=0;j<FF_SKWINDOW;j++)
+			FF_mul_ifma_x8(R,R,R,P,k0,K);
+		FF_select_x8(T,tab,w,K);
+		FF_mul_ifma_x8(R,R,T,P,k0,K);
+	}
+
+/* then square up to s-1 times, looking for -1 */
+	pending=0;
+	for (k=0;k<8;k++)
+	{
+		L[k]->pass=-1;
+		if (FF_eq_x8(R,k,L[k]->M.onew,K) || FF_eq_x8(R,k,nm1[k],K)) L[k]->pass=1;
+		else pending=1;
+	}
+	for (i=1;i<maxs && pending;i++)
+	{
+		FF_mul_ifma_x8(R,R,R,P,k0,K);
+		pending=0;
+		for (k=0;k<8;k++)
+		{
+			if (L[k]->pass>=0) continue;
+			if (i>=L[k]->s) L[k]->pass=0;
+			else if (FF_eq_x8(R,k,L[k]->M.onew,K)) L[k]->pass=0;
+			else if (FF_eq_x8(R,k,nm1[k],K)) L[k]->pass=1;
+			else pending=1;
+		}
+	}
+	for (k=0;k<8;k++)
+		if (L[k]->pass<0) L[k]->pass=0;
+}
+
+#endif /* MCL_FF_X86 */
+
+int MCL_FF_prime_batch(int r[],mcl_chunk (*p[])[MCL_BS],int m,csprng *rng,int profile,int n)
+{
+	int i,k,active,next=0,np=0;
+	FF_mr_lane lane[MCL_FF_PRIME_LANES];
+#ifdef MCL_FF_X86
+	FF_mr_lane *L[8];
+	int wide;
+#endif
+
+	for (k=0;k<MCL_FF_PRIME_LANES;k++) lane[k].c=-1;
+	for (;;)
+	{
+/* refill idle lanes, skipping candidates which fail trial division */
+		active=0;
+		for (k=0;k<MCL_FF_PRIME_LANES;k++)
+		{
+			while (lane[k].c<0 && next<m)
+			{
+				r[next]=0;
+				lane[k].s=FF_mr_setup(&lane[k].M,p[next],lane[k].d,lane[k].nm1,n);
+				if (lane[k].s>0)
+				{
+					lane[k].c=next;
+					lane[k].round=0;
+					lane[k].rounds=(profile==MCL_FF_PRIME_BPSW)?1+FF_BPSW_ROUNDS:FF_MR_ROUNDS;
+				}
+				next++;
+			}
+			if (lane[k].c>=0) active++;
+		}
+		if (active==0) break;
+
+		for (k=0;k<MCL_FF_PRIME_LANES;k++)
+		{
+			if (lane[k].c<0) continue;
+			if (profile==MCL_FF_PRIME_BPSW && lane[k].round==0)
+			{
+				FF_mont_int(&lane[k].M,lane[k].x,2);
+				continue;
+			}
+			MCL_FF_randomnum(lane[k].x,lane[k].M.p,rng,n);
+			MCL_FF_mont_nres(&lane[k].M,lane[k].x);
+		}
+
+#ifdef MCL_FF_X86
+/* with one lane left there is nothing to share, and the scalar kernel is faster */
+		wide=(active>1 && MCL_FF_PRIME_LANES==8);
+		for (k=0;k<MCL_FF_PRIME_LANES;k++)
+			if (lane[k].c>=0 && lane[k].M.backend!=FF_CPU_IFMA) wide=0;
+		if (wide)
+		{
+			for (i=0;lane[i].c<0;i++);
+			for (k=0;k<8;k++) L[k]=(lane[k].c>=0)?&lane[k]:&lane[i];
+			FF_mr_round_x8(L);
+		}
+		else
+#endif
+		for (k=0;k<MCL_FF_PRIME_LANES;k++)
+			if (lane[k].c>=0) lane[k].pass=FF_mr_round(&lane[k].M,lane[k].x,lane[k].d,lane[k].nm1,lane[k].s);
+
+		for (k=0;k<MCL_FF_PRIME_LANES;k++)
+		{
+			if (lane[k].c<0) continue;
+			if (lane[k].pass && profile==MCL_FF_PRIME_BPSW && lane[k].round==0)
+			{ /* passed base 2, so on to the Lucas test */
+				i=FF_lucas(&lane[k].M);
+				if (i==0) lane[k].pass=0;
+				if (i<0) lane[k].rounds=1+FF_MR_ROUNDS;
+			}
+			if (lane[k].pass && ++lane[k].round<lane[k].rounds) continue;
+			if (lane[k].pass)
+			{
+				r[lane[k].c]=1;
+				np++;
+			}
+			lane[k].c=-1;
+		}
+	}
+	return np;
+}
+
 /*
 MCL_BIG P[4]= {{0x1670957,0x1568CD3C,0x2595E5,0xEED4F38,0x1FC9A971,0x14EF7E62,0xA503883,0x9E1E05E,0xBF59E3},{0x1844C908,0x1B44A798,0x3A0B1E7,0xD1B5B4E,0x1836046F,0x87E94F9,0x1D34C537,0xF7183B0,0x46D07},{0x17813331,0x19E28A90,0x1473A4D6,0x1CACD01F,0x1EEA8838,0xAF2AE29,0x1F85292A,0x1632585E,0xD945E5},{0x919F5EF,0x1567B39F,0x19F6AD11,0x16CE47CF,0x9B36EB1,0x35B7D3,0x483B28C,0xCBEFA27,0xB5FC21}};
 
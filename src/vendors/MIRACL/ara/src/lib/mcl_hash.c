@@ -53,6 +53,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.             *
 #include "mcl_arch.h"
 #include "mcl_hash.h"
 
+/* x86-64 SHA-256 backends, picked at run time (see hash256_cpu_features) */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MCL_HASH256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #define FIX
 
 /* Include this #define in order to implement the
@@ -216,7 +223,7 @@ static const unsign32 K_256[64]={
 
 
 /* SU= 72 */
-static void MCL_HASH256_transform(mcl_hash256 *sh)
+static void hash256_transform_c(mcl_hash256 *sh)
 { /* basic transformation step */
     unsign32 a,b,c,d,e,f,g,h,t1,t2;
     int j;
@@ -242,6 +249,190 @@ static void MCL_HASH256_transform(mcl_hash256 *sh)
     sh->h[4]+=e; sh->h[5]+=f; sh->h[6]+=g; sh->h[7]+=h; 
 } 
 
+#ifdef MCL_HASH256_X86
+
+#define HASH256_CPU_AVX2 1
+#define HASH256_CPU_SHA  2
+
+/* Which of the x86 SHA-256 backends this CPU can run */
+static int hash256_cpu_features(void)
+{
+    unsigned int a,b,c,d,xcr0_lo,xcr0_hi;
+    int sse41,osxsave,features=0;
+
+    if (!__get_cpuid(1,&a,&b,&c,&d)) return 0;
+    sse41=(c>>19)&1;
+    osxsave=(c>>27)&1;
+    if (!__get_cpuid_count(7,0,&a,&b,&c,&d)) return 0;
+
+    if (sse41 && ((b>>29)&1)) features|=HASH256_CPU_SHA;
+    if (osxsave && ((b>>5)&1))
+    { /* the OS must also save the YMM registers */
+        __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0_lo&6)==6) features|=HASH256_CPU_AVX2;
+    }
+    return features;
+}
+
+/* transformation step with the SHA extensions */
+__attribute__((target("sha,sse4.1")))
+static void hash256_transform_sha(mcl_hash256 *sh)
+{ /* the schedule words are already native, so need no byte swap */
+    __m128i state0,state1,abef,cdgh,msg,tmp,m[4];
+    int i;
+
+    tmp=_mm_loadu_si128((const __m128i *)&sh->h[0]);
+    state1=_mm_loadu_si128((const __m128i *)&sh->h[4]);
+    tmp=_mm_shuffle_epi32(tmp,0xB1);                /* CDAB */
+    state1=_mm_shuffle_epi32(state1,0x1B);          /* EFGH */
+    state0=_mm_alignr_epi8(tmp,state1,8);           /* ABEF */
+    state1=_mm_blend_epi16(state1,tmp,0xF0);        /* CDGH */
+    abef=state0;
+    cdgh=state1;
+
+    for (i=0;i<4;i++) m[i]=_mm_loadu_si128((const __m128i *)&sh->w[4*i]);
+
+    for (i=0;i<16;i++)
+    { /* 4 rounds at a time, extending the schedule 4 words ahead */
+        msg=_mm_add_epi32(m[i&3],_mm_loadu_si128((const __m128i *)&K_256[4*i]));
+        state1=_mm_sha256rnds2_epu32(state1,state0,msg);
+        if (i>=3 && i<15)
+            m[(i+1)&3]=_mm_sha256msg2_epu32(_mm_add_epi32(m[(i+1)&3],_mm_alignr_epi8(m[i&3],m[(i-1)&3],4)),m[i&3]);
+        if (i>=1 && i<13)
+            m[(i-1)&3]=_mm_sha256msg1_epu32(m[(i-1)&3],m[i&3]);
+        msg=_mm_shuffle_epi32(msg,0x0E);
+        state0=_mm_sha256rnds2_epu32(state0,state1,msg);
+    }
+
+    state0=_mm_add_epi32(state0,abef);
+    state1=_mm_add_epi32(state1,cdgh);
+    tmp=_mm_shuffle_epi32(state0,0x1B);             /* FEBA */
+    state1=_mm_shuffle_epi32(state1,0xB1);          /* DCHG */
+    state0=_mm_blend_epi16(tmp,state1,0xF0);        /* DCBA */
+    state1=_mm_alignr_epi8(state1,tmp,8);           /* HGFE */
+    _mm_storeu_si128((__m128i *)&sh->h[0],state0);
+    _mm_storeu_si128((__m128i *)&sh->h[4],state1);
+}
+
+#define ROTR8(x,n) _mm256_or_si256(_mm256_srli_epi32(x,n),_mm256_slli_epi32(x,32-(n)))
+
+/* padded block blk of a len-byte message */
+static void hash256_block(const uchar *m,int len,int blk,int nblocks,uchar *b)
+{
+    int i,pos;
+    unsign32 hi,lo;
+    for (i=0;i<64;i++)
+    {
+        pos=64*blk+i;
+        b[i]=(pos<len)? m[pos] : (pos==len)? PAD : ZERO;
+    }
+    if (blk==nblocks-1)
+    { /* 64-bit bit length */
+        hi=(unsign32)(len>>29);
+        lo=(unsign32)len<<3;
+        for (i=0;i<4;i++)
+        {
+            b[56+i]=(uchar)(hi>>(24-8*i));
+            b[60+i]=(uchar)(lo>>(24-8*i));
+        }
+    }
+}
+
+/* hash 8 equal length messages at once, one per AVX2 lane */
+__attribute__((target("avx2")))
+static void hash256_x8_avx2(const char *const *m,int len,char *const *digest)
+{
+    __m256i w[64],st[8],a,b,c,d,e,f,g,h,t1,t2;
+    uchar blocks[8][64];
+    unsign32 out[8][8];
+    int i,j,k,blk,nblocks;
+
+    nblocks=(len+8)/64+1;
+    st[0]=_mm256_set1_epi32((int)H0_256); st[1]=_mm256_set1_epi32((int)H1_256);
+    st[2]=_mm256_set1_epi32((int)H2_256); st[3]=_mm256_set1_epi32((int)H3_256);
+    st[4]=_mm256_set1_epi32((int)H4_256); st[5]=_mm256_set1_epi32((int)H5_256);
+    st[6]=_mm256_set1_epi32((int)H6_256); st[7]=_mm256_set1_epi32((int)H7_256);
+
+    for (blk=0;blk<nblocks;blk++)
+    {
+        for (k=0;k<8;k++) hash256_block((const uchar *)m[k],len,blk,nblocks,blocks[k]);
+        for (j=0;j<16;j++)
+        { /* transpose: lane k gets word j of message k */
+            unsign32 v[8];
+            for (k=0;k<8;k++)
+                v[k]=((unsign32)blocks[k][4*j]<<24)|((unsign32)blocks[k][4*j+1]<<16)|((unsign32)blocks[k][4*j+2]<<8)|(unsign32)blocks[k][4*j+3];
+            w[j]=_mm256_loadu_si256((const __m256i *)v);
+        }
+        for (j=16;j<64;j++)
+        {
+            t1=_mm256_xor_si256(_mm256_xor_si256(ROTR8(w[j-2],17),ROTR8(w[j-2],19)),_mm256_srli_epi32(w[j-2],10));
+            t2=_mm256_xor_si256(_mm256_xor_si256(ROTR8(w[j-15],7),ROTR8(w[j-15],18)),_mm256_srli_epi32(w[j-15],3));
+            w[j]=_mm256_add_epi32(_mm256_add_epi32(t1,w[j-7]),_mm256_add_epi32(t2,w[j-16]));
+        }
+
+        a=st[0]; b=st[1]; c=st[2]; d=st[3];
+        e=st[4]; f=st[5]; g=st[6]; h=st[7];
+        for (j=0;j<64;j++)
+        {
+            t1=_mm256_xor_si256(_mm256_xor_si256(ROTR8(e,6),ROTR8(e,11)),ROTR8(e,25));
+            t1=_mm256_add_epi32(_mm256_add_epi32(h,t1),_mm256_xor_si256(_mm256_and_si256(e,f),_mm256_andnot_si256(e,g)));
+            t1=_mm256_add_epi32(_mm256_add_epi32(t1,_mm256_set1_epi32((int)K_256[j])),w[j]);
+            t2=_mm256_xor_si256(_mm256_xor_si256(ROTR8(a,2),ROTR8(a,13)),ROTR8(a,22));
+            t2=_mm256_add_epi32(t2,_mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a,b),_mm256_and_si256(a,c)),_mm256_and_si256(b,c)));
+            h=g; g=f; f=e;
+            e=_mm256_add_epi32(d,t1);
+            d=c; c=b; b=a;
+            a=_mm256_add_epi32(t1,t2);
+        }
+        st[0]=_mm256_add_epi32(st[0],a); st[1]=_mm256_add_epi32(st[1],b);
+        st[2]=_mm256_add_epi32(st[2],c); st[3]=_mm256_add_epi32(st[3],d);
+        st[4]=_mm256_add_epi32(st[4],e); st[5]=_mm256_add_epi32(st[5],f);
+        st[6]=_mm256_add_epi32(st[6],g); st[7]=_mm256_add_epi32(st[7],h);
+    }
+
+    for (j=0;j<8;j++)
+    {
+        unsign32 v[8];
+        _mm256_storeu_si256((__m256i *)v,st[j]);
+        for (k=0;k<8;k++) out[k][j]=v[k];
+    }
+    for (k=0;k<8;k++)
+        if (digest[k]!=NULL) for (i=0;i<32;i++)
+            digest[k][i]=(char)((out[k][i/4]>>(8*(3-i%4))) & 0xffL);
+}
+
+#endif /* MCL_HASH256_X86 */
+
+/* -1 until the first hash picks the backends */
+static int hash256_cpu=-1;
+
+static int hash256_select(void)
+{ /* relaxed is enough: every thread computes the same value */
+    int cpu=__atomic_load_n(&hash256_cpu,__ATOMIC_RELAXED);
+    if (cpu<0)
+    {
+#ifdef MCL_HASH256_X86
+        cpu=hash256_cpu_features();
+#else
+        cpu=0;
+#endif
+        __atomic_store_n(&hash256_cpu,cpu,__ATOMIC_RELAXED);
+    }
+    return cpu;
+}
+
+static void MCL_HASH256_transform(mcl_hash256 *sh)
+{ /* basic transformation step, on the fastest backend */
+#ifdef MCL_HASH256_X86
+    if (hash256_select()&HASH256_CPU_SHA)
+    {
+        hash256_transform_sha(sh);
+        return;
+    }
+#endif
+    hash256_transform_c(sh);
+}
+
 /* Initialise Hash function */
 void MCL_HASH256_init(mcl_hash256 *sh)
 { /* re-initialise */
@@ -275,6 +466,34 @@ void MCL_HASH256_process(mcl_hash256 *sh,int byte)
     if ((sh->length[0]%512)==0) MCL_HASH256_transform(sh);
 }
 
+/* process a run of bytes */
+void MCL_HASH256_update(mcl_hash256 *sh,const char *buf,int len)
+{ /* process the next len message bytes, whole blocks at a time */
+    int i;
+    const uchar *b=(const uchar *)buf;
+
+    while (len>0 && (sh->length[0]%512)!=0)
+    { /* top up a partial block */
+        MCL_HASH256_process(sh,*b++);
+        len--;
+    }
+    while (len>=64)
+    { /* load a whole block straight into the message schedule */
+        for (i=0;i<16;i++)
+            sh->w[i]=((unsign32)b[4*i]<<24)|((unsign32)b[4*i+1]<<16)|((unsign32)b[4*i+2]<<8)|(unsign32)b[4*i+3];
+        sh->length[0]+=512;
+        if (sh->length[0]==0L) sh->length[1]++;
+        MCL_HASH256_transform(sh);
+        b+=64;
+        len-=64;
+    }
+    while (len>0)
+    {
+        MCL_HASH256_process(sh,*b++);
+        len--;
+    }
+}
+
 /* SU= 24 */
 /* Generate 32-byte Hash */
 void MCL_HASH256_hash(mcl_hash256 *sh,char *digest)
@@ -295,6 +514,38 @@ void MCL_HASH256_hash(mcl_hash256 *sh,char *digest)
     MCL_HASH256_init(sh);
 }
 
+/* Hash several equal length messages */
+void MCL_HASH256_batch(int n,const char *const *m,int len,char *const *h)
+{ /* the SHA extensions beat 8 AVX2 lanes, so only use those without them */
+    int i;
+    mcl_hash256 sh;
+#ifdef MCL_HASH256_X86
+    const char *lm[8];
+    char *lh[8];
+    int cpu=hash256_select();
+    if ((cpu&(HASH256_CPU_SHA|HASH256_CPU_AVX2))==HASH256_CPU_AVX2)
+    {
+        while (n>0)
+        { /* unused lanes rehash the first message, their digests dropped */
+            for (i=0;i<8;i++)
+            {
+                lm[i]=(i<n)? m[i] : m[0];
+                lh[i]=(i<n)? h[i] : NULL;
+            }
+            hash256_x8_avx2(lm,len,lh);
+            m+=8; h+=8; n-=8;
+        }
+        return;
+    }
+#endif
+    for (i=0;i<n;i++)
+    {
+        MCL_HASH256_init(&sh);
+        MCL_HASH256_update(&sh,m[i],len);
+        MCL_HASH256_hash(&sh,h[i]);
+    }
+}
+
 
 #define H0_512 0x6a09e667f3bcc908 
 #define H1_512 0xbb67ae8584caa73b 
@@ -366,11 +366,10 @@ void MCL_OCT_chop(mcl_octet *x,mcl_octet *y,int n)
 /* set x to len random bytes */
 void MCL_OCT_rand(mcl_octet *x,csprng *RNG,int len)
 {
-    int i;
     if (len>x->max) len=x->max;
     x->len=len;
 
-    for (i=0;i<len;i++) x->val[i]=MCL_RAND_byte(RNG);
+    MCL_RAND_bytes(RNG,x->val,len);
 }
 
 #ifdef MCL_BUILD_TEST
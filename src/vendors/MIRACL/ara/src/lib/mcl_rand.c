@@ -49,6 +49,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.             *
  */
 /* SU=m, m is Stack Usage */
 
+#include <string.h>
 #include "mcl_arch.h"
 #include "mcl_rand.h"
 #include "mcl_hash.h"
@@ -99,9 +100,11 @@ static void sirand(csprng* rng,unsign32 seed)
 static void fill_pool(csprng *rng)
 { /* hash down output of RNG to re-fill the pool */
     int i;
+    char buf[128];
     mcl_hash256 sh;
     MCL_HASH256_init(&sh);
-    for (i=0;i<128;i++) MCL_HASH256_process(&sh,sbrand(rng));
+    for (i=0;i<128;i++) buf[i]=(char)sbrand(rng);
+    MCL_HASH256_update(&sh,buf,128);
     MCL_HASH256_hash(&sh,rng->pool);
     rng->pool_ptr=0;
 }
@@ -125,8 +128,7 @@ void MCL_RAND_seed(csprng *rng,int rawlen,char *raw)
     if (rawlen>0)
     {
         MCL_HASH256_init(&sh);
-        for (i=0;i<rawlen;i++)
-            MCL_HASH256_process(&sh,raw[i]);
+        MCL_HASH256_update(&sh,raw,rawlen);
         MCL_HASH256_hash(&sh,digest);
 
 /* initialise PRNG from distilled randomness */
@@ -161,6 +163,21 @@ int MCL_RAND_byte(csprng *rng)
     return (r&0xff);
 }
 
+/* get n random bytes, a pool at a time */
+void MCL_RAND_bytes(csprng *rng,char *b,int n)
+{
+    int k;
+    while (n>0)
+    {
+        k=32-rng->pool_ptr;
+        if (k>n) k=n;
+        memcpy(b,&rng->pool[rng->pool_ptr],k);
+        b+=k; n-=k;
+        rng->pool_ptr+=k;
+        if (rng->pool_ptr>=32) fill_pool(rng);
+    }
+}
+
 /* test main program */
 /*
 #include <stdio.h>
@@ -68,7 +68,8 @@ static int hashit(int sha,mcl_octet *p,int n,mcl_octet *w)
     
 	hlen=sha;
 
-    if (p!=NULL) for (i=0;i<p->len;i++)
+    if (p!=NULL && sha==MCL_SHA256) MCL_HASH256_update(&sha256,p->val,p->len);
+    else if (p!=NULL) for (i=0;i<p->len;i++)
 	{	
 		switch(sha)
 		{